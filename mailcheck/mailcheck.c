@@ -9,15 +9,40 @@
  * 26Jun12 wb migrated to mate for Fedora 17
  * 26Feb14 wb converted to mate 1.6.2 for Fedora 20
  * 04Jan22 wb play with -q
+ * 19Oct26 wb watch the mail file with inotify
+ * 19Oct26 wb count messages by scanning only the new part of the mail file
+ * 19Oct26 wb add maildir support
+ * 19Oct26 wb watch several mailboxes and folder directories
+ * 19Oct26 wb show the senders and subjects of new mail in the tooltip
+ * 19Oct26 wb check mailboxes that inotify cannot watch in a thread
+ * 19Oct26 wb notify once per burst of deliveries, with one sound player at a time
+ * 19Oct26 wb save a checkpoint of the scans for the next start
+ * 19Oct26 wb add IMAP mailboxes that push new mail with IDLE
+ * 19Oct26 wb poll less often while the mailboxes do not change
+ * 19Oct26 wb wait for the MTA to unlock the mail file before scanning it
  */
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/unistd.h>
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/stat.h>
 #include <time.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 
 #include <mate-panel-applet.h>
 
@@ -26,103 +51,4194 @@
 #include <gtk/gtkbox.h>
 #include <gdk/gdkx.h>
 
-#define VERSION		"04Jan22"
+#define VERSION		"19Oct26"
 
 #define	BASE_NAME	"mailcheck"
 
 #define	DEFAULT_INTERVAL	5
+#define	DEFAULT_MAX_INTERVAL	60
+#define	DEFAULT_SAFETY_INTERVAL	300
+#define	DEFAULT_SUMMARIES	5
+#define	DEFAULT_DEADLINE	10
+#define	DEFAULT_SETTLE		2
+#define	DEFAULT_MAX_DELAY	10
+
+#ifndef AT_STATX_SYNC_AS_STAT
+#define	AT_STATX_SYNC_AS_STAT	0x0000
+#endif
+#ifndef AT_STATX_DONT_SYNC
+#define	AT_STATX_DONT_SYNC	0x4000
+#endif
+#ifndef STATX_MNT_ID
+#define	STATX_MNT_ID		0x1000
+#endif
+#ifndef F_OFD_GETLK
+#define	F_OFD_GETLK		36
+#endif
+
+static int interval = 0;		/* time between mail checks */
+static int max_interval = 0;		/* most time between mail checks while nothing changes */
+static int poll_interval = 0;		/* time between mail checks now, from interval to max_interval */
+static gboolean poll_changed = FALSE;	/* a mailbox changed since the last timed check */
+static int timer_wakeups = 0;		/* timer calls since wakeup_start */
+static time_t wakeup_start = 0;		/* start of the hour for timer_wakeups */
+static int debug = 0;			/* enable debug messages to the log file */
+static char *home_dir = NULL;		/* user's home directory */
+static FILE *log_file = NULL;		/* file for log messages */
+static char *mail_name = NULL;		/* mail spool file from $MAIL, used if the setup file lists none */
+static char *sound_name = NULL;		/* name of the sound file for new messages */
+static int do_beep = 0;			/* beep on new messages */
+static char *setup_name = NULL;		/* name of the config file */
+static char *state_name = NULL;		/* name of the checkpoint file */
+static gint timer_handle = 0;		/* handle to change the mate timer */
+static int timer_interval = 0;		/* seconds between timer calls */
+static int do_watch = 1;		/* watch the mail file with inotify */
+static int safety_interval = 0;		/* time between mail checks while inotify works */
+static int inotify_fd = -1;		/* inotify descriptor, -1 if not watching */
+static guint inotify_watch = 0;		/* main loop watch on inotify_fd */
+static time_t last_full_check = 0;	/* time every mailbox was last checked */
+static long message_count = 0;		/* messages in all mailboxes */
+static long unread_count = 0;		/* unread messages in all mailboxes */
+static long new_message_count = 0;	/* unread messages not yet seen by a mail reader */
+static int show_summaries = 0;		/* newest messages listed in the tooltip */
+static int deadline = 0;		/* seconds before a check in the thread is slow */
+static int settle_time = 0;		/* quiet seconds before notifying of new mail */
+static int max_delay = 0;		/* most seconds a notification waits for a burst to settle */
+static long arrived_count = 0;		/* messages that arrived since the last check */
+static long burst_count = 0;		/* messages that arrived in the current burst */
+static time_t burst_start = 0;		/* time of the first arrival in the current burst */
+static guint burst_timer = 0;		/* timer to notify when the burst settles, 0 if no burst */
+static GPid player_pid = 0;		/* running sound player, 0 if none */
+
+enum mail_state_enum {
+	INIT_MAIL = 0,	/* nothing displayed yet */
+	NO_MAIL,	/* mailbox is empty */
+	OLD_MAIL,	/* mailbox has read mail */
+	UNREAD_MAIL,	/* mailbox has unread mail */
+	NEW_MAIL,	/* mailbox has new mail since the last check */
+	SLOW_MAIL,	/* the check in the thread passed its deadline */
+	NUM_MAIL_STATES
+};
+
+static const char *mail_state_name[ NUM_MAIL_STATES ] =
+	{ NULL, "No mail", "Mail", "New mail", NULL, "Mail server slow" };
+
+/* Incremental mbox scan */
+/*   Messages start with "From " at the start of the file or after a newline. */
+/*   Only the header block of each message is parsed, for its Status: and X-Status: */
+/*   flags, and the body is skipped with Content-Length when it is present. */
+/*   The scan remembers where it stopped, so each check only reads and parses */
+/*   the bytes appended since the last check.  A different inode, a file that */
+/*   shrank or kept its size, or a different hash of the first bytes or of the */
+/*   bytes before the old end means the file was rewritten, for example when a */
+/*   mail reader saved new flags.  A mail reader rewrites the file from the */
+/*   first changed message, so the messages in the index whose "From " lines */
+/*   are still at their offsets are kept, with only their header blocks read */
+/*   again for the flags, and the file is parsed again after them. */
+
+enum mbox_scan_enum {
+	MBOX_HASH_LEN = 1024,		/* bytes in the prefix and tail hashes */
+	MBOX_SEPARATOR_LEN = 6,		/* strlen("\nFrom ") */
+	MIN_MBOX_MESSAGES = 256,	/* first size of the message index */
+	MBOX_CHUNK_LEN = 1 << 20,	/* bytes read at a time */
+	MBOX_INDEX_READ_LEN = 16384,	/* bytes read at a time to check the index */
+	MAX_MBOX_HEADER_LEN = 16 << 20	/* longest header block kept whole */
+};
+
+enum mbox_flag_enum {
+	MBOX_READ = 1,			/* Status: R */
+	MBOX_OLD = 2,			/* Status: O, seen by a mail reader */
+	MBOX_DELETED = 4		/* X-Status: D */
+};
+
+struct mbox_message {
+	off_t offset;			/* offset of "From " */
+	uint32_t from_hash;		/* hash of the "From " line */
+	unsigned char flags;		/* enum mbox_flag_enum */
+};
+
+struct mbox_scan {
+	dev_t dev;			/* device of the scanned file */
+	ino_t ino;			/* inode of the scanned file, 0 if none */
+	off_t size;			/* size when last scanned */
+	off_t scan_pos;			/* where to look for the next "\nFrom ", 0 for the start */
+	uint64_t prefix_hash;		/* hash of the first prefix_len bytes */
+	int prefix_len;
+	uint64_t tail_hash;		/* hash of the tail_len bytes before size */
+	int tail_len;
+	struct mbox_message *messages;	/* index of complete header blocks */
+	long num_messages;
+	long max_messages;
+	gboolean indexed;		/* messages has all num_messages, not a checkpoint's count */
+	long unread;			/* messages without R or D */
+	long new_messages;		/* unread messages without O */
+	long new_unread;		/* unread messages added by the last scan */
+	gboolean record;		/* add summaries of the unread messages being scanned */
+};
+
+/* Return a time stamp */
+
+static char *show_time(void)
+{
+	enum time_buf_enum { TIME_BUF_LEN = 100 };
+	static char buf[ TIME_BUF_LEN ];
+	struct tm *tm_ptr;
+	time_t time_val;
+
+	time_val = time(NULL);
+	tm_ptr = localtime(&time_val);
+
+	buf[0] = '\0';
+
+	strftime(buf, TIME_BUF_LEN, "%e %b %Y %H:%M:%S", tm_ptr);
+
+	buf[ TIME_BUF_LEN - 1 ] = '\0';
+
+	return buf;
+}
+
+/* Exit after a serious error */
+
+static void
+exit_mailcheck(void)
+{
+	if (log_file != NULL) {
+		fprintf(log_file, "Exiting at %s.\n", show_time());
+		fclose(log_file);
+		log_file = NULL;
+	}
+
+	exit(1);
+}
+
+/* Get the type, size, times and inode of a mailbox with statx */
+/*   Only the fields the checks use are requested.  With dont_sync, */
+/*   which is for callers that only need the type, a network filesystem */
+/*   may answer from its cache instead of asking the server. */
+
+static int
+stat_mailbox(const char *name, struct stat *stat_buf, gboolean dont_sync)
+{
+	struct statx stx;
+	unsigned int mask;
+	int flags;
+
+	mask = (dont_sync? STATX_TYPE: STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_ATIME | STATX_INO);
+	flags = (dont_sync? AT_STATX_DONT_SYNC: AT_STATX_SYNC_AS_STAT);
+	if (syscall(SYS_statx, AT_FDCWD, name, flags, mask, &stx) != 0) {
+		/* kernels before 4.11 do not have statx */
+		return (errno == ENOSYS? stat(name, stat_buf): -1);
+	}
+	memset(stat_buf, 0, sizeof(*stat_buf));
+	stat_buf->st_mode = stx.stx_mode;
+	stat_buf->st_size = stx.stx_size;
+	stat_buf->st_mtime = stx.stx_mtime.tv_sec;
+	stat_buf->st_atime = stx.stx_atime.tv_sec;
+	stat_buf->st_ino = stx.stx_ino;
+	stat_buf->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	return 0;
+}
+
+/* Return the FNV-1a hash of len bytes */
+
+static uint64_t
+hash_bytes(const unsigned char *p, size_t len)
+{
+	uint64_t hash;
+	size_t i;
+
+	hash = 14695981039346656037ULL;
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ p[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+/* Hash len bytes of the mail file at offset */
+
+static uint64_t
+hash_mbox_bytes(int fd, off_t offset, int len)
+{
+	unsigned char buf[ MBOX_HASH_LEN ];
+	uint64_t hash;
+	int got;
+
+	got = pread(fd, buf, len, offset);
+	hash = hash_bytes(buf, (got > 0? got: 0));
+	return (got == len? hash: ~hash);
+}
+
+/* Forget the scanned messages */
+
+static void
+reset_mbox_scan(struct mbox_scan *scan)
+{
+	scan->ino = 0;
+	scan->size = 0;
+	scan->scan_pos = 0;
+	scan->prefix_len = 0;
+	scan->tail_len = 0;
+	scan->num_messages = 0;
+	scan->indexed = TRUE;
+	scan->unread = 0;
+	scan->new_messages = 0;
+	scan->new_unread = 0;
+}
+
+/* Return TRUE if a header line starts with name, ignoring case */
+
+static gboolean
+is_header(const char *line, const char *end, const char *name, int name_len)
+{
+	return (end - line > name_len && strncasecmp(line, name, name_len) == 0);
+}
+
+/* Summaries of new messages */
+/*   The From:, Subject: and Date: headers of messages that arrive while the */
+/*   applet runs are decoded into a fixed ring of slots, so the memory does not */
+/*   grow with the mailboxes.  The headers are only taken from the newly scanned */
+/*   part of an mbox file or from a file that was just delivered to a maildir. */
+
+enum summary_enum {
+	MAX_SUMMARIES = 10,		/* slots in the ring */
+	SUMMARY_FROM_LEN = 80,
+	SUMMARY_SUBJECT_LEN = 120,
+	SUMMARY_DATE_LEN = 40,
+	SUMMARY_TEXT_LEN = 16 + MAX_SUMMARIES * (SUMMARY_FROM_LEN + SUMMARY_SUBJECT_LEN + SUMMARY_DATE_LEN + 8),
+	HEADER_RAW_LEN = 1024,		/* longest header value that is decoded */
+	CHARSET_LEN = 40
+};
+
+struct summary {
+	char from[ SUMMARY_FROM_LEN ];
+	char subject[ SUMMARY_SUBJECT_LEN ];
+	char date[ SUMMARY_DATE_LEN ];
+};
+
+static struct summary summaries[ MAX_SUMMARIES ];
+static int summary_head = 0;		/* slot for the next summary */
+static int num_summaries = 0;		/* filled slots */
+static unsigned summary_generation = 0;	/* changes when the ring changes */
+static GMutex summary_lock;		/* the check thread also adds summaries */
+
+/* Copy a header value, joining its continuation lines */
+
+static void
+copy_header_value(const char *value, const char *end, char *out, int out_len)
+{
+	const char *eol;
+	int len;
+
+	while (value < end && (*value == ' ' || *value == '\t')) value++;
+
+	len = 0;
+	for (;;) {
+		eol = memchr(value, '\n', end - value);
+		if (eol == NULL) {
+			eol = end;
+		}
+		while (value < eol && len < out_len - 1) {
+			out[ len++ ] = ((*value == '\t' || *value == '\r')? ' ': *value);
+			value++;
+		}
+		if (eol + 1 >= end || (eol[1] != ' ' && eol[1] != '\t')) {
+			break;
+		}
+		value = eol + 1;
+	}
+	while (len > 0 && out[ len - 1 ] == ' ') {
+		len--;
+	}
+	out[ len ] = '\0';
+}
+
+/* Make a header value valid UTF-8 for the tooltip */
+/*   8 bit text that is not UTF-8 is taken as ISO-8859-1, */
+/*   and a character cut off at the end is dropped */
+
+static void
+make_utf8(char *str, int str_len)
+{
+	const gchar *valid_end;
+	gchar *utf8;
+
+	if (g_utf8_validate(str, -1, &valid_end)) {
+		return;
+	}
+	if (g_utf8_get_char_validated(valid_end, strlen(valid_end)) != (gunichar) -2) {
+		utf8 = g_convert(str, -1, "UTF-8", "ISO-8859-1", NULL, NULL, NULL);
+		if (utf8 != NULL) {
+			g_strlcpy(str, utf8, str_len);
+			g_free(utf8);
+		}
+	}
+	if (!g_utf8_validate(str, -1, &valid_end)) {
+		*(gchar *) valid_end = '\0';
+	}
+}
+
+/* Decode an RFC 2047 encoded word, =?charset?Q?text?= or =?charset?B?text?= */
+/*   Returns the end of the word, or NULL if p does not start an encoded word */
+
+static const char *
+decode_word(const char *p, char *charset, char *word, int word_max, int *word_len)
+{
+	static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const char *q;
+	const char *text_end;
+	const char *digit;
+	unsigned bits;
+	int num_bits;
+	int len;
+	char encoding;
+	char *star;
+
+	if (p[0] != '=' || p[1] != '?') {
+		return NULL;
+	}
+	q = strchr(p + 2, '?');
+	if (q == NULL || q - (p + 2) >= CHARSET_LEN || q[1] == '\0' || q[2] != '?') {
+		return NULL;
+	}
+	encoding = toupper(q[1]);
+	if (encoding != 'Q' && encoding != 'B') {
+		return NULL;
+	}
+	text_end = strstr(q + 3, "?=");
+	if (text_end == NULL) {
+		return NULL;
+	}
+	memcpy(charset, p + 2, q - (p + 2));
+	charset[ q - (p + 2) ] = '\0';
+	/* drop an RFC 2231 language, as in utf-8*en */
+	star = strchr(charset, '*');
+	if (star != NULL) {
+		*star = '\0';
+	}
+
+	len = 0;
+	bits = 0;
+	num_bits = 0;
+	for (q += 3; q < text_end && len < word_max; q++) {
+		if (encoding == 'Q') {
+			if (*q == '_') {
+				word[ len++ ] = ' ';
+			} else if (*q == '=' && isxdigit(q[1]) && isxdigit(q[2])) {
+				word[ len++ ] = (char) strtol((char []) { q[1], q[2], '\0' }, NULL, 16);
+				q += 2;
+			} else {
+				word[ len++ ] = *q;
+			}
+		} else if (*q != '=' && (digit = strchr(base64, *q)) != NULL) {
+			bits = (bits << 6) | (unsigned) (digit - base64);
+			num_bits += 6;
+			if (num_bits >= 8) {
+				num_bits -= 8;
+				word[ len++ ] = (char) (bits >> num_bits);
+			}
+		}
+	}
+	*word_len = len;
+	return text_end + 2;
+}
+
+/* Decode the RFC 2047 encoded words in a header value to UTF-8 */
+
+static void
+decode_header(const char *in, char *out, int out_len)
+{
+	char charset[ CHARSET_LEN ];
+	char word[ HEADER_RAW_LEN ];
+	const char *p;
+	const char *end;
+	const char *next;
+	gchar *utf8;
+	gsize utf8_len;
+	int word_len;
+	int copy_len;
+	int len;
+
+	len = 0;
+	p = in;
+	while (*p != '\0' && len < out_len - 1) {
+		end = decode_word(p, charset, word, HEADER_RAW_LEN, &word_len);
+		if (end == NULL) {
+			out[ len++ ] = *p++;
+			continue;
+		}
+		utf8 = g_convert(word, word_len, "UTF-8", charset, NULL, &utf8_len, NULL);
+		if (utf8 != NULL) {
+			copy_len = ((int) utf8_len < out_len - 1 - len? (int) utf8_len: out_len - 1 - len);
+			memcpy(out + len, utf8, copy_len);
+			g_free(utf8);
+		} else {
+			copy_len = (word_len < out_len - 1 - len? word_len: out_len - 1 - len);
+			memcpy(out + len, word, copy_len);
+		}
+		len += copy_len;
+
+		/* white space between encoded words is dropped */
+		for (next = end; *next == ' ' || *next == '\t'; next++);
+		p = (decode_word(next, charset, word, HEADER_RAW_LEN, &word_len) != NULL? next: end);
+	}
+	out[ len ] = '\0';
+	make_utf8(out, out_len);
+}
+
+/* Add a summary of the headers in [start, end) to the ring */
+
+static void
+add_summary(const char *start, const char *end)
+{
+	char raw[ HEADER_RAW_LEN ];
+	struct summary *sm;
+	const char *line;
+	const char *eol;
+
+	if (show_summaries <= 0) {
+		return;
+	}
+
+	g_mutex_lock(&summary_lock);
+	sm = &summaries[ summary_head ];
+	sm->from[0] = '\0';
+	sm->subject[0] = '\0';
+	sm->date[0] = '\0';
+	for (line = start; line < end; line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		if (eol == NULL) {
+			eol = end;
+		}
+		if (is_header(line, eol, "From:", 5)) {
+			copy_header_value(line + 5, end, raw, HEADER_RAW_LEN);
+			decode_header(raw, sm->from, SUMMARY_FROM_LEN);
+		} else if (is_header(line, eol, "Subject:", 8)) {
+			copy_header_value(line + 8, end, raw, HEADER_RAW_LEN);
+			decode_header(raw, sm->subject, SUMMARY_SUBJECT_LEN);
+		} else if (is_header(line, eol, "Date:", 5)) {
+			copy_header_value(line + 5, end, sm->date, SUMMARY_DATE_LEN);
+			make_utf8(sm->date, SUMMARY_DATE_LEN);
+		}
+	}
+	if (sm->from[0] != '\0' || sm->subject[0] != '\0') {
+		summary_head = (summary_head + 1) % MAX_SUMMARIES;
+		if (num_summaries < MAX_SUMMARIES) {
+			num_summaries++;
+		}
+		summary_generation++;
+	}
+	g_mutex_unlock(&summary_lock);
+}
+
+/* Forget the summaries */
+
+static void
+clear_summaries()
+{
+	g_mutex_lock(&summary_lock);
+	if (num_summaries > 0) {
+		num_summaries = 0;
+		summary_generation++;
+	}
+	g_mutex_unlock(&summary_lock);
+}
+
+/* Format the newest summaries for the tooltip */
+
+static void
+format_summaries(char *text, int text_len)
+{
+	const struct summary *sm;
+	int len;
+	int i;
+
+	text[0] = '\0';
+	if (show_summaries <= 0) {
+		return;
+	}
+	g_mutex_lock(&summary_lock);
+	len = (num_summaries > 0? snprintf(text, text_len, "Newest mail:"): 0);
+	for (i = 0; i < num_summaries && i < show_summaries && len < text_len; i++) {
+		sm = &summaries[ (summary_head - 1 - i + MAX_SUMMARIES) % MAX_SUMMARIES ];
+		len += snprintf(text + len, text_len - len, "\n%s: %s%s%s%s",
+			(sm->from[0] != '\0'? sm->from: "?"), sm->subject,
+			(sm->date[0] != '\0'? " (": ""), sm->date, (sm->date[0] != '\0'? ")": ""));
+	}
+	g_mutex_unlock(&summary_lock);
+}
+
+/* Parse the flags of a header block in [start, end) */
+/*   Returns the Content-Length, or -1 if there is none */
+
+static long
+parse_mbox_headers(const char *start, const char *end, unsigned char *flags_ptr)
+{
+	const char *line;
+	const char *eol;
+	const char *p;
+	unsigned char flags;
+	long content_length;
+
+	flags = 0;
+	content_length = -1;
+	for (line = start; line < end; line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		if (eol == NULL) {
+			eol = end;
+		}
+		if (is_header(line, eol, "Status:", 7)) {
+			for (p = line + 7; p < eol; p++) {
+				if (*p == 'R') flags |= MBOX_READ;
+				if (*p == 'O') flags |= MBOX_OLD;
+			}
+		} else if (is_header(line, eol, "X-Status:", 9)) {
+			for (p = line + 9; p < eol; p++) {
+				if (*p == 'D') flags |= MBOX_DELETED;
+			}
+		} else if (is_header(line, eol, "Content-Length:", 15)) {
+			for (p = line + 15; p < eol && (*p == ' ' || *p == '\t'); p++);
+			if (p < eol && isdigit(*p)) {
+				content_length = strtol(p, NULL, 10);
+			}
+		}
+	}
+	*flags_ptr = flags;
+	return content_length;
+}
+
+/* Return the hash of the "From " line of a header block in [start, end) */
+
+static uint32_t
+hash_from_line(const char *start, const char *end)
+{
+	const char *eol;
+
+	eol = memchr(start, '\n', end - start);
+	return (uint32_t) hash_bytes((const unsigned char *) start, (eol != NULL? eol: end) - start);
+}
+
+/* Count a message */
+
+static void
+count_mbox_message(struct mbox_scan *scan, unsigned char flags)
+{
+	if ((flags & (MBOX_READ | MBOX_DELETED)) == 0) {
+		scan->unread++;
+		scan->new_unread++;
+		if ((flags & MBOX_OLD) == 0) {
+			scan->new_messages++;
+		}
+	}
+}
+
+/* Add a message with its header block in [start, end) to the index */
+/*   Returns the Content-Length, or -1 if there is none */
+
+static long
+add_mbox_message(struct mbox_scan *scan, off_t offset, const char *start, const char *end)
+{
+	struct mbox_message *messages;
+	unsigned char flags;
+	long content_length;
+	long max_messages;
+
+	content_length = parse_mbox_headers(start, end, &flags);
+	count_mbox_message(scan, flags);
+	if (scan->record && (flags & (MBOX_READ | MBOX_DELETED)) == 0) {
+		add_summary(start, end);
+	}
+
+	if (!scan->indexed) {
+		/* the counts came from a checkpoint, so only count until a rewrite */
+		scan->num_messages++;
+		return content_length;
+	}
+	if (scan->num_messages >= scan->max_messages) {
+		max_messages = (scan->num_messages >= MIN_MBOX_MESSAGES? 2 * scan->num_messages: MIN_MBOX_MESSAGES);
+		messages = realloc(scan->messages, max_messages * sizeof(*messages));
+		if (messages == NULL) {
+			/* count it, and check a rewrite from the start */
+			scan->indexed = FALSE;
+			scan->num_messages++;
+			return content_length;
+		}
+		scan->messages = messages;
+		scan->max_messages = max_messages;
+	}
+	scan->messages[ scan->num_messages ].offset = offset;
+	scan->messages[ scan->num_messages ].from_hash = hash_from_line(start, end);
+	scan->messages[ scan->num_messages ].flags = flags;
+	scan->num_messages++;
+	return content_length;
+}
+
+/* Find the empty line that ends a header block */
+/*   Returns the first newline of the pair, or NULL if it is not there yet */
+
+static const char *
+find_header_end(const char *p, const char *end)
+{
+	while (p < end - 1 && (p = memchr(p, '\n', (end - 1) - p)) != NULL) {
+		if (p[1] == '\n') {
+			return p;
+		}
+		p++;
+	}
+	return NULL;
+}
+
+/* A window of the mail file read with pread */
+/*   The file is read, not mapped, so a mail reader that truncates it while */
+/*   it is scanned makes a read come up short instead of raising SIGBUS. */
+
+struct mbox_window {
+	int fd;
+	off_t file_size;		/* size from the stat before the scan */
+	char *buf;
+	size_t buf_len;			/* bytes allocated */
+	off_t start;			/* offset of buf[0] */
+	size_t len;			/* bytes read into buf */
+};
+
+/* Return the bytes at offset, with at least need bytes or up to the end of */
+/* the file in the window, reading the window again if needed */
+/*   Returns NULL if the file was truncated or could not be read */
+
+static const char *
+read_mbox_window(struct mbox_window *w, off_t offset, size_t need)
+{
+	size_t want;
+	ssize_t got;
+
+	if (need > (size_t) (w->file_size - offset)) {
+		need = w->file_size - offset;
+	}
+	if (offset >= w->start && offset + (off_t) need <= w->start + (off_t) w->len) {
+		return w->buf + (offset - w->start);
+	}
+
+	want = w->buf_len;
+	if (want > (size_t) (w->file_size - offset)) {
+		want = w->file_size - offset;
+	}
+	w->start = offset;
+	w->len = 0;
+	while (w->len < want) {
+		got = pread(w->fd, w->buf + w->len, want - w->len, offset + w->len);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			return NULL;
+		}
+		w->len += got;
+	}
+	return w->buf;
+}
+
+/* Return the offset of the next "From " after a newline at or after pos */
+/*   Returns -1 if there is none, or -2 if the file could not be read */
+
+static off_t
+find_mbox_separator(struct mbox_window *w, off_t pos)
+{
+	const char *data;
+	const char *p;
+	const char *end;
+
+	while (w->file_size - pos >= MBOX_SEPARATOR_LEN) {
+		data = read_mbox_window(w, pos, MBOX_SEPARATOR_LEN);
+		if (data == NULL) {
+			return -2;
+		}
+		/* memchr is vectorized in glibc */
+		end = w->buf + w->len;
+		for (p = data; end - p >= MBOX_SEPARATOR_LEN && (p = memchr(p, '\n', end - p - (MBOX_SEPARATOR_LEN - 1))) != NULL; p++) {
+			if (memcmp(p + 1, "From ", MBOX_SEPARATOR_LEN - 1) == 0) {
+				return w->start + (p + 1 - w->buf);
+			}
+		}
+		/* look again at a separator cut off by the end of the window */
+		pos = w->start + w->len - (MBOX_SEPARATOR_LEN - 1);
+		if (w->start + (off_t) w->len >= w->file_size) {
+			break;
+		}
+	}
+	return -1;
+}
+
+/* Return the offset of the empty line that ends the header block at msg, */
+/* with the whole block in the window */
+/*   Returns -1 if it is not there yet, or -2 if the file could not be read. */
+/*   A header block larger than MAX_MBOX_HEADER_LEN ends where the window does. */
+
+static off_t
+find_mbox_header_end(struct mbox_window *w, off_t msg)
+{
+	const char *data;
+	const char *p;
+	char *buf;
+
+	for (;;) {
+		data = read_mbox_window(w, msg, 2);
+		if (data == NULL) {
+			return -2;
+		}
+		p = find_header_end(data, w->buf + w->len);
+		if (p != NULL) {
+			return w->start + (p - w->buf);
+		}
+		if (w->start + (off_t) w->len >= w->file_size) {
+			/* the headers are still being written */
+			return -1;
+		}
+		if (w->start < msg) {
+			/* read again with the block at the start of the window */
+			w->len = 0;
+		} else if (w->buf_len >= MAX_MBOX_HEADER_LEN ||
+			   (buf = realloc(w->buf, 2 * w->buf_len)) == NULL) {
+			return w->start + w->len - 1;
+		} else {
+			w->buf = buf;
+			w->buf_len *= 2;
+			w->len = 0;
+		}
+	}
+}
+
+/* Parse the header blocks of the messages after scan_pos */
+/*   The file is read in windows of at most MBOX_CHUNK_LEN bytes, and bodies */
+/*   skipped with Content-Length are not read.  Returns FALSE if the file */
+/*   could not be read or was truncated, and then the counts are not changed. */
+
+static gboolean
+parse_mbox(struct mbox_scan *scan, int fd, off_t file_size)
+{
+	struct mbox_window w;
+	const char *data;
+	off_t old_scan_pos;
+	off_t pos;
+	off_t msg;
+	off_t header_end;
+	off_t body_end;
+	long old_num_messages;
+	long old_unread;
+	long old_new_messages;
+	long old_new_unread;
+	long content_length;
+	gboolean ok;
+
+	if (file_size <= scan->scan_pos) {
+		return TRUE;
+	}
+	w.fd = fd;
+	w.file_size = file_size;
+	w.buf_len = (file_size - scan->scan_pos < MBOX_CHUNK_LEN? file_size - scan->scan_pos: MBOX_CHUNK_LEN);
+	if (w.buf_len < MBOX_SEPARATOR_LEN) {
+		w.buf_len = MBOX_SEPARATOR_LEN;
+	}
+	w.buf = malloc(w.buf_len);
+	w.start = 0;
+	w.len = 0;
+	if (w.buf == NULL) {
+		return FALSE;
+	}
+	posix_fadvise(fd, scan->scan_pos, 0, POSIX_FADV_SEQUENTIAL);
+
+	old_scan_pos = scan->scan_pos;
+	old_num_messages = scan->num_messages;
+	old_unread = scan->unread;
+	old_new_messages = scan->new_messages;
+	old_new_unread = scan->new_unread;
+
+	ok = TRUE;
+	pos = scan->scan_pos;
+	for (;;) {
+		/* find the next message */
+		data = (pos == 0? read_mbox_window(&w, 0, MBOX_SEPARATOR_LEN - 1): NULL);
+		if (data != NULL && file_size >= MBOX_SEPARATOR_LEN - 1 && memcmp(data, "From ", MBOX_SEPARATOR_LEN - 1) == 0) {
+			msg = 0;
+		} else {
+			msg = find_mbox_separator(&w, pos);
+			if (msg == -1) {
+				/* a separator that starts in the last bytes is not complete yet */
+				if (file_size - (MBOX_SEPARATOR_LEN - 1) > scan->scan_pos) {
+					scan->scan_pos = file_size - (MBOX_SEPARATOR_LEN - 1);
+				}
+				break;
+			}
+		}
+
+		/* the header block ends with an empty line */
+		header_end = (msg < 0? msg: find_mbox_header_end(&w, msg));
+		if (header_end == -1) {
+			/* the headers are still being written */
+			scan->scan_pos = (msg == 0? 0: msg - 1);
+			break;
+		}
+		if (header_end < 0) {
+			ok = FALSE;
+			break;
+		}
+		content_length = add_mbox_message(scan, msg, w.buf + (msg - w.start), w.buf + (header_end + 1 - w.start));
+
+		/* skip the body */
+		pos = header_end + 1;
+		if (content_length >= 0 && content_length <= file_size - (header_end + 2)) {
+			body_end = header_end + 2 + content_length;
+			data = read_mbox_window(&w, body_end - 1, MBOX_SEPARATOR_LEN + 1);
+			if (data == NULL) {
+				ok = FALSE;
+				break;
+			}
+			if (body_end == file_size) {
+				/* the next message will start after the newline that ends this one */
+				pos = (data[0] == '\n'? body_end - 1: body_end);
+			} else if (file_size - body_end >= MBOX_SEPARATOR_LEN && memcmp(data + 1, "\nFrom ", MBOX_SEPARATOR_LEN) == 0) {
+				pos = body_end;
+			} else if (file_size - body_end >= MBOX_SEPARATOR_LEN - 1 && data[0] == '\n' &&
+			    memcmp(data + 1, "From ", MBOX_SEPARATOR_LEN - 1) == 0) {
+				pos = body_end - 1;
+			}
+		}
+		scan->scan_pos = pos;
+	}
+
+	free(w.buf);
+	if (!ok) {
+		/* leave the counts as they were, the next check scans again */
+		scan->scan_pos = old_scan_pos;
+		scan->num_messages = old_num_messages;
+		scan->unread = old_unread;
+		scan->new_messages = old_new_messages;
+		scan->new_unread = old_new_unread;
+	}
+	return ok;
+}
+
+/* Keep the messages of a rewritten file that are still at their offsets */
+/*   Checks the "From " line of each message in the index and reads its */
+/*   header block again for the flags, up to the first message that moved. */
+/*   The last message kept in place is dropped too, since its body may have */
+/*   changed, and the scan goes on from it. */
+
+static void
+keep_mbox_messages(struct mbox_scan *scan, int fd, off_t file_size, long num_messages)
+{
+	struct mbox_window w;
+	struct mbox_message *m;
+	const char *data;
+	off_t header_end;
+	long kept;
+	long i;
+
+	w.fd = fd;
+	w.file_size = file_size;
+	w.buf_len = MBOX_INDEX_READ_LEN;
+	w.buf = malloc(w.buf_len);
+	w.start = 0;
+	w.len = 0;
+	if (w.buf == NULL) {
+		return;
+	}
+
+	for (i = 0; i < num_messages; i++) {
+		m = &scan->messages[i];
+		if (file_size - m->offset < MBOX_SEPARATOR_LEN - 1) {
+			break;
+		}
+		data = read_mbox_window(&w, (m->offset == 0? 0: m->offset - 1), MBOX_SEPARATOR_LEN);
+		if (data == NULL || (m->offset > 0 && *data++ != '\n') ||
+		    memcmp(data, "From ", MBOX_SEPARATOR_LEN - 1) != 0) {
+			break;
+		}
+		header_end = find_mbox_header_end(&w, m->offset);
+		if (header_end < 0 ||
+		    hash_from_line(w.buf + (m->offset - w.start), w.buf + (header_end + 1 - w.start)) != m->from_hash) {
+			break;
+		}
+		parse_mbox_headers(w.buf + (m->offset - w.start), w.buf + (header_end + 1 - w.start), &m->flags);
+	}
+	free(w.buf);
+
+	kept = (i > 0? i - 1: 0);
+	for (i = 0; i < kept; i++) {
+		count_mbox_message(scan, scan->messages[i].flags);
+	}
+	scan->num_messages = kept;
+	scan->scan_pos = (kept > 0? scan->messages[ kept ].offset - 1: 0);
+
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "kept %ld of %ld messages in place\n", kept, num_messages);
+	}
+}
+
+/* Bring the message index up to date */
+/*   The cost is proportional to the bytes added since the last scan */
+/*   Summaries are added for appended messages, and for all messages */
+/*   if was_empty says the file was empty or missing at the last check */
+
+static void
+scan_mbox(struct mbox_scan *scan, const char *name, const struct stat *stat_buf, gboolean was_empty)
+{
+	int fd;
+	off_t old_size;
+	long old_unread;
+	long num_messages;
+	gboolean in_place;
+
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return;
+	}
+
+	scan->new_unread = 0;
+	old_size = scan->size;
+	old_unread = scan->unread;
+
+	if (stat_buf->st_ino != scan->ino || stat_buf->st_dev != scan->dev ||
+	    stat_buf->st_size <= old_size ||
+	    hash_mbox_bytes(fd, 0, scan->prefix_len) != scan->prefix_hash ||
+	    hash_mbox_bytes(fd, old_size - scan->tail_len, scan->tail_len) != scan->tail_hash) {
+		if (debug && log_file != NULL && scan->ino != 0) {
+			fprintf(log_file, "%s was rewritten, scanning it again\n", name);
+		}
+		in_place = (scan->indexed && stat_buf->st_ino == scan->ino && stat_buf->st_dev == scan->dev);
+		num_messages = scan->num_messages;
+		reset_mbox_scan(scan);
+		scan->dev = stat_buf->st_dev;
+		scan->ino = stat_buf->st_ino;
+		old_size = 0;
+		if (in_place) {
+			keep_mbox_messages(scan, fd, stat_buf->st_size, num_messages);
+		}
+	}
+
+	scan->record = (old_size > 0 || was_empty);
+	if (!parse_mbox(scan, fd, stat_buf->st_size)) {
+		scan->record = FALSE;
+		close(fd);
+		return;
+	}
+	scan->record = FALSE;
+	scan->size = stat_buf->st_size;
+	if (old_size == 0) {
+		/* after a rewrite, only more unread messages are new */
+		scan->new_unread = (scan->unread > old_unread? scan->unread - old_unread: 0);
+	}
+
+	scan->prefix_len = (scan->size < MBOX_HASH_LEN? (int) scan->size: MBOX_HASH_LEN);
+	scan->prefix_hash = hash_mbox_bytes(fd, 0, scan->prefix_len);
+	scan->tail_len = scan->prefix_len;
+	scan->tail_hash = hash_mbox_bytes(fd, scan->size - scan->tail_len, scan->tail_len);
+
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "scanned %ld bytes of %s, %ld messages, %ld unread, %ld new unread\n",
+			(long) (scan->size - old_size), name, scan->num_messages, scan->unread, scan->new_unread);
+	}
+
+	close(fd);
+}
+
+/* Maildir */
+/*   Messages in new/ are unread, and messages in cur/ are unread unless */
+/*   their info ":2,flags" has S (seen) or T (trashed).  Both directories are */
+/*   counted with one getdents64 pass and no stat, and inotify events on them */
+/*   adjust the counts by name, so an arriving message costs constant work. */
+
+enum maildir_enum { DENTS_BUF_LEN = 32768 };
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct maildir_counts {
+	long new_count;			/* messages in new/ */
+	long cur_count;			/* messages in cur/ */
+	long cur_unseen;		/* messages in cur/ without S or T */
+	long arrivals;			/* messages added to new/ since the last check */
+	gboolean scanned;		/* counts were taken at least once */
+	gboolean valid;			/* counts are current */
+};
+
+/* Return TRUE if a maildir file name is a message */
+
+static gboolean
+is_maildir_message(const char *name)
+{
+	return (name[0] != '.' && name[0] != '\0');
+}
+
+/* Return TRUE if a message in cur/ is unseen */
+
+static gboolean
+is_maildir_unseen(const char *name)
+{
+	const char *info;
+
+	info = strstr(name, ":2,");
+	if (info == NULL) {
+		return TRUE;
+	}
+	return (strchr(info + 3, 'S') == NULL && strchr(info + 3, 'T') == NULL);
+}
+
+/* Count the messages in new/ or cur/ */
+/*   Returns FALSE if the directory could not be read */
+
+static gboolean
+count_maildir_dir(const char *name, const char *sub_dir, long *count, long *unseen)
+{
+	char dents[ DENTS_BUF_LEN ] __attribute__ ((aligned(8)));
+	const struct linux_dirent64 *de;
+	char *path;
+	int fd;
+	int len;
+	int pos;
+
+	*count = 0;
+	*unseen = 0;
+	path = malloc(strlen(name) + strlen(sub_dir) + 2);
+	if (path == NULL) {
+		return FALSE;
+	}
+	sprintf(path, "%s/%s", name, sub_dir);
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	free(path);
+	if (fd == -1) {
+		return FALSE;
+	}
+	while ((len = syscall(SYS_getdents64, fd, dents, DENTS_BUF_LEN)) > 0) {
+		for (pos = 0; pos < len; pos += de->d_reclen) {
+			de = (const struct linux_dirent64 *) &dents[ pos ];
+			if (is_maildir_message(de->d_name)) {
+				(*count)++;
+				if (is_maildir_unseen(de->d_name)) {
+					(*unseen)++;
+				}
+			}
+		}
+	}
+	close(fd);
+	return (len == 0);
+}
+
+/* Count the messages in the maildir */
+
+static void
+scan_maildir(struct maildir_counts *md, const char *name)
+{
+	long old_unread;
+	long unseen;
+
+	old_unread = md->new_count + md->cur_unseen;
+	if (!count_maildir_dir(name, "new", &md->new_count, &unseen) ||
+	    !count_maildir_dir(name, "cur", &md->cur_count, &md->cur_unseen)) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Could not read maildir '%s'.\n", name);
+		}
+	}
+	if (!md->scanned) {
+		md->arrivals = md->new_count + md->cur_unseen;
+	} else if (md->new_count + md->cur_unseen > old_unread) {
+		md->arrivals += md->new_count + md->cur_unseen - old_unread;
+	}
+	md->scanned = TRUE;
+	md->valid = TRUE;
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "scanned maildir %s, %ld new, %ld cur, %ld unseen\n",
+			name, md->new_count, md->cur_count, md->cur_unseen);
+	}
+}
+
+/* Add the summary of a message delivered to new/ */
+
+static void
+add_maildir_summary(const char *dir_name, const char *name)
+{
+	enum maildir_summary_enum { SUMMARY_READ_LEN = 8192 };
+	char buf[ SUMMARY_READ_LEN ];
+	const char *header_end;
+	char *path;
+	ssize_t got;
+	int fd;
+
+	if (show_summaries <= 0) {
+		return;
+	}
+	path = malloc(strlen(dir_name) + strlen(name) + 6);
+	if (path == NULL) {
+		return;
+	}
+	sprintf(path, "%s/new/%s", dir_name, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd == -1) {
+		return;
+	}
+	got = read(fd, buf, SUMMARY_READ_LEN);
+	close(fd);
+	if (got <= 0) {
+		return;
+	}
+	header_end = find_header_end(buf, buf + got);
+	add_summary(buf, (header_end != NULL? header_end + 1: buf + got));
+}
+
+/* Adjust the maildir counts for an inotify event in new/ or cur/ */
+
+static void
+maildir_event(struct maildir_counts *md, const char *dir_name, gboolean in_cur, uint32_t mask, const char *name)
+{
+	int delta;
+
+	if (!is_maildir_message(name)) {
+		return;
+	}
+	if (mask & (IN_CREATE | IN_MOVED_TO)) {
+		delta = 1;
+	} else if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+		delta = -1;
+	} else {
+		return;
+	}
+	if (in_cur) {
+		md->cur_count += delta;
+		if (is_maildir_unseen(name)) {
+			md->cur_unseen += delta;
+		}
+	} else {
+		md->new_count += delta;
+		if (delta > 0) {
+			md->arrivals++;
+			add_maildir_summary(dir_name, name);
+		}
+	}
+	if (md->new_count < 0 || md->cur_count < 0 || md->cur_unseen < 0) {
+		/* missed an event */
+		md->valid = FALSE;
+	}
+}
+
+/* Mailboxes */
+/*   Every mail entry in the setup file, and every mbox file and maildir */
+/*   in a folder directory, has its own record.  They share one inotify */
+/*   descriptor and one timer, and a check only looks at the mailboxes */
+/*   that had events, so more folders do not mean more timers or polling. */
+
+enum mailbox_enum {
+	MIN_MAILBOXES = 16,		/* first size of the mailbox array */
+	MAX_FOLDERS = 16,		/* folder directories in the setup file */
+	TOOLTIP_MAILBOXES = 5		/* busiest mailboxes in the tooltip */
+};
+
+enum watch_enum { WATCH_DIR_EVENTS = IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR };
+
+/* IMAP accounts */
+/*   An imap line in the setup file adds a mailbox on an IMAP server, */
+/*   imaps://user@host[:port][/mailbox] with TLS or imap://... without it. */
+/*   The applet logs in once, opens the mailbox read-only with EXAMINE so */
+/*   the \Recent flags are left for the mail reader, counts the unseen messages, */
+/*   and waits in IDLE, so the server pushes new mail and nothing is polled. */
+/*   A server without the IDLE capability, or that refuses IDLE, is asked */
+/*   with NOOP every interval seconds instead. */
+/*   The socket is non-blocking and watched by the main loop, and host names */
+/*   are looked up in a short lived thread.  A connection that fails, closes, */
+/*   or stops answering is retried after a delay that doubles up to 5 minutes. */
+
+enum imap_enum {
+	IMAP_BUF_LEN = 4096,		/* longest response line kept */
+	IMAP_OUT_LEN = 1024,		/* longest command */
+	IMAP_PASSWORD_LEN = 256,
+	IMAP_REPLY_TIME = 60,		/* seconds to wait for a reply */
+	IMAP_IDLE_TIME = 600,		/* seconds in IDLE before it is renewed */
+	MAX_IMAP_RETRY_DELAY = 300
+};
+
+enum imap_state_enum {
+	IMAP_DOWN,			/* not connected, maybe waiting to retry */
+	IMAP_RESOLVING,
+	IMAP_CONNECTING,
+	IMAP_HANDSHAKE,			/* TLS handshake */
+	IMAP_GREETING,
+	IMAP_LOGIN,
+	IMAP_EXAMINE,
+	IMAP_CAPABILITY,
+	IMAP_SEARCH,
+	IMAP_IDLE,			/* sent IDLE */
+	IMAP_DONE,			/* sent DONE to leave IDLE */
+	IMAP_WAIT,			/* waiting to send NOOP, without IDLE */
+	IMAP_NOOP
+};
+
+struct imap_account {
+	char *user;
+	char *host;
+	char *port;
+	char *folder;			/* mailbox on the server */
+	char *password_name;		/* file with the password on its first line */
+	gboolean use_tls;
+	enum imap_state_enum state;
+	int fd;				/* socket, -1 if closed */
+	SSL *ssl;			/* TLS session, NULL without TLS */
+	guint watch;			/* main loop watch on fd */
+	GIOCondition watch_condition;
+	guint timer;			/* reply timeout, IDLE renewal, or retry */
+	int lookup_id;			/* host name lookup for this connection */
+	char buf[ IMAP_BUF_LEN ];	/* partial response line */
+	int buf_len;
+	gboolean skip_line;		/* dropping the rest of a long line */
+	long skip_bytes;		/* bytes of a literal still to skip */
+	char out[ IMAP_OUT_LEN ];	/* commands not yet sent */
+	int out_len;
+	int tag;			/* number of the last tagged command */
+	gboolean want_write;		/* TLS needs the socket to be writable */
+	gboolean have_capability;	/* the capabilities of the session are known */
+	gboolean can_idle;		/* the server has the IDLE capability */
+	gboolean idling;		/* the server accepted IDLE */
+	gboolean changed;		/* the mailbox changed since the last SEARCH */
+	gboolean known;			/* the counts were read at least once */
+	long exists;			/* messages in the mailbox */
+	long recent;			/* messages no session has seen */
+	long unseen;			/* messages without \Seen */
+	long search_count;		/* unseen messages counted so far */
+	long arrivals;			/* messages that arrived since the last check */
+	int failures;			/* consecutive failures */
+	GtkEventBox *event_box;		/* panel to update */
+};
+
+struct mailbox {
+	char *name;			/* path of the mbox file or maildir, or the IMAP URL */
+	const char *short_name;		/* last part of name */
+	off_t last_size;		/* last size of an mbox file */
+	time_t last_mtime;		/* last modification time of an mbox file */
+	struct mbox_scan mbox;
+	struct maildir_counts maildir;
+	int dir_wd;			/* watch on the directory of an mbox file */
+	int file_wd;			/* watch on an mbox file */
+	int new_wd;			/* watch on maildir new/ */
+	int cur_wd;			/* watch on maildir cur/ */
+	gboolean watched;		/* inotify sees its changes */
+	gboolean probe;			/* find in the next check whether inotify can watch it */
+	gboolean local;			/* the check found it where inotify sees all changes */
+	gboolean retry;			/* probe again, the directory was missing */
+	gboolean dirty;			/* check at the next update */
+	gboolean checked;		/* checked at least once */
+	gboolean busy;			/* a copy is being checked in the thread */
+	gboolean in_folder;		/* found in a folder directory, dropped when it is gone */
+	gboolean missing;		/* the running folder scan has not found it yet */
+	gboolean pending_new;		/* the thread found new mail */
+	long arrivals;			/* messages that arrived, if the state is new mail */
+	time_t lock_start;		/* when a write lock on the mail file was seen, 0 if none */
+	enum mail_state_enum state;	/* result of the last check */
+	long message_count;
+	long unread_count;
+	long new_count;			/* unread messages not yet seen by a mail reader */
+	struct imap_account *imap;	/* IMAP account, NULL for a local mailbox */
+};
+
+struct folder {
+	char *name;			/* directory of mbox files and maildirs */
+	int wd;				/* watch on the directory */
+	gboolean probe;			/* find in the next check whether inotify can watch it */
+	gboolean local;			/* the check found it where inotify sees all changes */
+	gboolean scanned;		/* the check read the directory */
+};
+
+static struct mailbox *mailboxes = NULL;
+static int num_mailboxes = 0;
+static int max_mailboxes = 0;
+static struct mailbox *old_mailboxes = NULL;	/* mailboxes before the setup file was read again */
+static int num_old_mailboxes = 0;
+static struct folder folders[ MAX_FOLDERS ];
+static int num_folders = 0;
+static gboolean folders_dirty = FALSE;	/* look for new mailboxes in the folders at the next check */
+
+/* Return the mailbox with a name, or NULL */
+
+static struct mailbox *
+find_mailbox(const char *name)
+{
+	int i;
+
+	for (i = 0; i < num_mailboxes; i++) {
+		if (strcmp(mailboxes[i].name, name) == 0) {
+			return &mailboxes[i];
+		}
+	}
+	return NULL;
+}
+
+/* Return the folder directory with a name, or NULL */
+
+static struct folder *
+find_folder(const char *name)
+{
+	int i;
+
+	for (i = 0; i < num_folders; i++) {
+		if (strcmp(folders[i].name, name) == 0) {
+			return &folders[i];
+		}
+	}
+	return NULL;
+}
+
+/* Return TRUE if a path is an entry of a folder directory */
+
+static gboolean
+is_in_folder(const char *path, const char *folder_name)
+{
+	size_t len;
+
+	len = strlen(folder_name);
+	return (strncmp(path, folder_name, len) == 0 && path[len] == '/' &&
+		path[len + 1] != '\0' && strchr(path + len + 1, '/') == NULL);
+}
+
+/* Add a mailbox */
+/*   A mailbox that was there before the setup file was read again keeps its counts. */
+/*   Returns NULL if there is no memory.  The pointer is only good until the next add. */
+
+static struct mailbox *
+add_mailbox(const char *name)
+{
+	struct mailbox *mb;
+	char *str;
+	char *slash;
+	int max_len;
+	int len;
+	int i;
+
+	str = strdup(name);
+	if (str == NULL) {
+		return NULL;
+	}
+	len = strlen(str);
+	while (len > 1 && str[ len - 1 ] == '/') {
+		str[ --len ] = '\0';
+	}
+	mb = find_mailbox(str);
+	if (mb != NULL) {
+		free(str);
+		return mb;
+	}
+
+	if (num_mailboxes >= max_mailboxes) {
+		max_len = (max_mailboxes > 0? 2 * max_mailboxes: MIN_MAILBOXES);
+		mb = realloc(mailboxes, max_len * sizeof(*mb));
+		if (mb == NULL) {
+			free(str);
+			return NULL;
+		}
+		mailboxes = mb;
+		max_mailboxes = max_len;
+	}
+	mb = &mailboxes[ num_mailboxes ];
+
+	for (i = 0; i < num_old_mailboxes; i++) {
+		if (old_mailboxes[i].name != NULL && strcmp(old_mailboxes[i].name, str) == 0) {
+			break;
+		}
+	}
+	if (i < num_old_mailboxes) {
+		*mb = old_mailboxes[i];
+		old_mailboxes[i].name = NULL;
+		free(str);
+	} else {
+		memset(mb, 0, sizeof(*mb));
+		mb->name = str;
+		mb->dir_wd = -1;
+		mb->file_wd = -1;
+		mb->new_wd = -1;
+		mb->cur_wd = -1;
+		mb->state = NO_MAIL;
+	}
+	slash = strrchr(mb->name, '/');
+	mb->short_name = (slash != NULL && slash[1] != '\0'? slash + 1: mb->name);
+	mb->dirty = TRUE;
+	num_mailboxes++;
+	return mb;
+}
+
+/* Start a new list of mailboxes while reading the setup file */
+
+static void
+begin_mailboxes()
+{
+	int i;
+
+	old_mailboxes = mailboxes;
+	num_old_mailboxes = num_mailboxes;
+	mailboxes = NULL;
+	num_mailboxes = 0;
+	max_mailboxes = 0;
+
+	for (i = 0; i < num_folders; i++) {
+		free(folders[i].name);
+	}
+	num_folders = 0;
+}
+
+/* Forward declaration */
+
+static void free_imap(struct imap_account *imap);
+
+/* Finish the new list of mailboxes */
+/*   Use $MAIL if the setup file did not list any */
+
+static void
+end_mailboxes()
+{
+	int i;
+
+	if (num_mailboxes == 0 && mail_name != NULL) {
+		add_mailbox(mail_name);
+	}
+
+	for (i = 0; i < num_old_mailboxes; i++) {
+		if (old_mailboxes[i].name != NULL) {
+			free(old_mailboxes[i].name);
+			free(old_mailboxes[i].mbox.messages);
+			free_imap(old_mailboxes[i].imap);
+		}
+	}
+	free(old_mailboxes);
+	old_mailboxes = NULL;
+	num_old_mailboxes = 0;
+}
+
+static SSL_CTX *imap_ssl_ctx = NULL;	/* shared by the TLS connections */
+static int imap_lookups = 0;		/* id of the last host name lookup */
+
+/* Forward declarations */
+
+static gboolean open_window (GtkEventBox *event_box);
+static gboolean reset_timer(GtkWidget *event_box);
+static gboolean on_imap_io(GIOChannel *source, GIOCondition condition, gpointer data);
+static gboolean on_imap_timer(gpointer data);
+
+/* Close an IMAP connection */
+
+static void
+close_imap(struct imap_account *imap)
+{
+	if (imap->watch != 0) {
+		g_source_remove(imap->watch);
+		imap->watch = 0;
+	}
+	if (imap->timer != 0) {
+		g_source_remove(imap->timer);
+		imap->timer = 0;
+	}
+	if (imap->ssl != NULL) {
+		SSL_free(imap->ssl);
+		imap->ssl = NULL;
+	}
+	if (imap->fd != -1) {
+		close(imap->fd);
+		imap->fd = -1;
+	}
+	imap->state = IMAP_DOWN;
+	imap->watch_condition = 0;
+	imap->buf_len = 0;
+	imap->skip_line = FALSE;
+	imap->skip_bytes = 0;
+	imap->out_len = 0;
+	imap->want_write = FALSE;
+	imap->idling = FALSE;
+}
+
+/* Close an IMAP account and free it */
+
+static void
+free_imap(struct imap_account *imap)
+{
+	if (imap == NULL) {
+		return;
+	}
+	close_imap(imap);
+	free(imap->user);
+	free(imap->host);
+	free(imap->port);
+	free(imap->folder);
+	free(imap->password_name);
+	free(imap);
+}
+
+/* Make an IMAP account from imaps://user@host[:port][/mailbox] */
+/*   Returns NULL if the URL is bad or there is no memory */
+
+static struct imap_account *
+new_imap(const char *url, const char *password_name)
+{
+	struct imap_account *imap;
+	const char *p;
+	const char *end;
+	const char *at;
+	const char *colon;
+	const char *host;
+	int host_len;
+
+	imap = calloc(1, sizeof(*imap));
+	if (imap == NULL) {
+		return NULL;
+	}
+	imap->fd = -1;
+	imap->state = IMAP_DOWN;
+
+	if (strncmp(url, "imaps://", 8) == 0) {
+		imap->use_tls = TRUE;
+		p = url + 8;
+	} else if (strncmp(url, "imap://", 7) == 0) {
+		imap->use_tls = FALSE;
+		p = url + 7;
+	} else {
+		free_imap(imap);
+		return NULL;
+	}
+
+	end = strchr(p, '/');
+	if (end == NULL) {
+		end = p + strlen(p);
+	}
+	for (at = end - 1; at >= p && *at != '@'; at--) ;
+	if (at <= p || at + 1 >= end) {
+		free_imap(imap);
+		return NULL;
+	}
+	host = at + 1;
+	if (*host == '[') {
+		/* allow [::1]:port */
+		host++;
+		colon = memchr(host, ']', end - host);
+		host_len = (colon != NULL? colon - host: 0);
+		colon = (colon != NULL && colon[1] == ':'? colon + 1: NULL);
+	} else {
+		colon = memchr(host, ':', end - host);
+		host_len = (colon != NULL? colon: end) - host;
+	}
+	if (host_len == 0 || (colon != NULL && colon + 1 >= end)) {
+		free_imap(imap);
+		return NULL;
+	}
+
+	imap->user = strndup(p, at - p);
+	imap->host = strndup(host, host_len);
+	imap->port = (colon != NULL? strndup(colon + 1, end - colon - 1): strdup(imap->use_tls? "993": "143"));
+	imap->folder = strdup(*end == '/' && end[1] != '\0'? end + 1: "INBOX");
+	imap->password_name = strdup(password_name);
+	if (imap->user == NULL || imap->host == NULL || imap->port == NULL ||
+	    imap->folder == NULL || imap->password_name == NULL) {
+		free_imap(imap);
+		return NULL;
+	}
+	return imap;
+}
+
+/* Run a timer for an IMAP account, replacing the last one */
+
+static void
+set_imap_timer(struct imap_account *imap, int seconds)
+{
+	if (imap->timer != 0) {
+		g_source_remove(imap->timer);
+	}
+	imap->timer = g_timeout_add_seconds(seconds, on_imap_timer, imap);
+}
+
+/* Close an IMAP connection after a failure and schedule the retry */
+
+static void
+fail_imap(struct imap_account *imap, const char *reason)
+{
+	int delay;
+
+	close_imap(imap);
+	if (imap->failures < 16) {
+		imap->failures++;
+	}
+	delay = 1 << (imap->failures - 1);
+	if (delay > MAX_IMAP_RETRY_DELAY) {
+		delay = MAX_IMAP_RETRY_DELAY;
+	}
+	set_imap_timer(imap, delay);
+	if (log_file != NULL) {
+		fprintf(log_file, "IMAP '%s@%s' %s at %s, retry in %d seconds.\n", imap->user, imap->host, reason, show_time(), delay);
+		fflush(log_file);
+	}
+}
+
+/* Watch the socket for input, and for output while something waits to be sent */
+
+static void
+update_imap_watch(struct imap_account *imap)
+{
+	GIOChannel *channel;
+	GIOCondition condition;
+
+	condition = G_IO_IN | G_IO_HUP | G_IO_ERR;
+	if (imap->state == IMAP_CONNECTING || imap->out_len > 0 || imap->want_write) {
+		condition |= G_IO_OUT;
+	}
+	if (imap->watch != 0 && condition == imap->watch_condition) {
+		return;
+	}
+	if (imap->watch != 0) {
+		g_source_remove(imap->watch);
+	}
+	channel = g_io_channel_unix_new(imap->fd);
+	imap->watch = g_io_add_watch(channel, condition, on_imap_io, imap);
+	imap->watch_condition = condition;
+	g_io_channel_unref(channel);
+}
+
+/* Read from an IMAP connection */
+/*   Returns the bytes read, 0 at the end, or -1 with errno EAGAIN if it would block */
+
+static int
+read_imap_socket(struct imap_account *imap, char *buf, int len)
+{
+	int result;
+	int error;
+
+	if (imap->ssl == NULL) {
+		return read(imap->fd, buf, len);
+	}
+	result = SSL_read(imap->ssl, buf, len);
+	if (result > 0) {
+		return result;
+	}
+	error = SSL_get_error(imap->ssl, result);
+	if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+		imap->want_write = (error == SSL_ERROR_WANT_WRITE);
+		errno = EAGAIN;
+		return -1;
+	}
+	if (error == SSL_ERROR_ZERO_RETURN) {
+		return 0;
+	}
+	errno = EIO;
+	return -1;
+}
+
+/* Write to an IMAP connection */
+/*   Returns the bytes written, or -1 with errno EAGAIN if it would block */
+
+static int
+write_imap_socket(struct imap_account *imap, const char *buf, int len)
+{
+	int result;
+	int error;
+
+	if (imap->ssl == NULL) {
+		return write(imap->fd, buf, len);
+	}
+	result = SSL_write(imap->ssl, buf, len);
+	if (result > 0) {
+		return result;
+	}
+	error = SSL_get_error(imap->ssl, result);
+	if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+		imap->want_write = (error == SSL_ERROR_WANT_WRITE);
+		errno = EAGAIN;
+		return -1;
+	}
+	errno = EIO;
+	return -1;
+}
+
+/* Send what fits of the queued commands */
+/*   Returns FALSE if the connection failed */
+
+static gboolean
+flush_imap(struct imap_account *imap)
+{
+	int len;
+
+	while (imap->out_len > 0) {
+		len = write_imap_socket(imap, imap->out, imap->out_len);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+			break;
+		}
+		if (len <= 0) {
+			fail_imap(imap, "write failed");
+			return FALSE;
+		}
+		imap->out_len -= len;
+		memmove(imap->out, &imap->out[ len ], imap->out_len);
+	}
+	update_imap_watch(imap);
+	return TRUE;
+}
+
+/* Queue a tagged command and wait for its reply in a new state */
+
+static void
+send_imap(struct imap_account *imap, const char *command, enum imap_state_enum state)
+{
+	int len;
+
+	imap->tag++;
+	len = snprintf(&imap->out[ imap->out_len ], IMAP_OUT_LEN - imap->out_len, "m%d %s\r\n", imap->tag, command);
+	if (len >= IMAP_OUT_LEN - imap->out_len) {
+		fail_imap(imap, "has a command that is too long");
+		return;
+	}
+	if (debug > 1 && log_file != NULL) {
+		/* never log the password */
+		fprintf(log_file, "IMAP '%s' m%d %s\n", imap->host, imap->tag, (state == IMAP_LOGIN? "LOGIN": command));
+	}
+	imap->out_len += len;
+	imap->state = state;
+	set_imap_timer(imap, IMAP_REPLY_TIME);
+	flush_imap(imap);
+}
+
+/* Append an IMAP quoted string */
+/*   Returns FALSE if the string does not fit or cannot be quoted */
+
+static gboolean
+quote_imap(char *out, int out_len, const char *str)
+{
+	int len;
+
+	len = 0;
+	if (out_len < 3) {
+		return FALSE;
+	}
+	out[ len++ ] = '"';
+	for (; *str != '\0'; str++) {
+		if (*str == '\r' || *str == '\n' || len + 4 > out_len) {
+			return FALSE;
+		}
+		if (*str == '"' || *str == '\\') {
+			out[ len++ ] = '\\';
+		}
+		out[ len++ ] = *str;
+	}
+	out[ len++ ] = '"';
+	out[ len ] = '\0';
+	return TRUE;
+}
+
+/* Read the capabilities listed after CAPABILITY */
+
+static void
+read_imap_capability(struct imap_account *imap, const char *p)
+{
+	int len;
+
+	imap->have_capability = TRUE;
+	imap->can_idle = FALSE;
+	for (;;) {
+		while (*p == ' ') p++;
+		len = strcspn(p, " ]");
+		if (len == 0) {
+			return;
+		}
+		if (len == 4 && strncasecmp(p, "IDLE", 4) == 0) {
+			imap->can_idle = TRUE;
+		}
+		p += len;
+	}
+}
+
+/* Read a [CAPABILITY ...] response code in a greeting or a reply */
+
+static void
+read_imap_capability_code(struct imap_account *imap, const char *p)
+{
+	p = strstr(p, "[CAPABILITY ");
+	if (p != NULL) {
+		read_imap_capability(imap, p + 12);
+	}
+}
+
+/* Wait for the next NOOP, for a server without IDLE */
+
+static void
+wait_imap(struct imap_account *imap)
+{
+	imap->state = IMAP_WAIT;
+	set_imap_timer(imap, interval);
+}
+
+/* Log in with the password from the password file */
+/*   The password is read for every login, so it can change without a reload */
+
+static void
+send_imap_login(struct imap_account *imap)
+{
+	char password[ IMAP_PASSWORD_LEN ];
+	char command[ IMAP_OUT_LEN ];
+	FILE *password_file;
+	int len;
+	int ok;
+
+	/* the capabilities can change after login */
+	imap->have_capability = FALSE;
+	imap->can_idle = FALSE;
+	password_file = fopen(imap->password_name, "r");
+	if (password_file == NULL) {
+		fail_imap(imap, "has no password file");
+		return;
+	}
+	if (fgets(password, IMAP_PASSWORD_LEN, password_file) == NULL) {
+		password[0] = '\0';
+	}
+	fclose(password_file);
+	len = strcspn(password, "\r\n");
+	password[ len ] = '\0';
+
+	strcpy(command, "LOGIN ");
+	len = strlen(command);
+	ok = quote_imap(&command[ len ], IMAP_OUT_LEN - len, imap->user);
+	len = strlen(command);
+	if (ok && len + 1 < IMAP_OUT_LEN) {
+		command[ len++ ] = ' ';
+		ok = quote_imap(&command[ len ], IMAP_OUT_LEN - len, password);
+	} else {
+		ok = FALSE;
+	}
+	OPENSSL_cleanse(password, IMAP_PASSWORD_LEN);
+	if (!ok) {
+		fail_imap(imap, "has a user or password that cannot be sent");
+	} else {
+		send_imap(imap, command, IMAP_LOGIN);
+	}
+	OPENSSL_cleanse(command, IMAP_OUT_LEN);
+}
+
+/* Open the mailbox read-only, after asking for the capabilities if needed */
+
+static void
+send_imap_examine(struct imap_account *imap)
+{
+	char command[ IMAP_OUT_LEN ];
+
+	if (!imap->have_capability) {
+		send_imap(imap, "CAPABILITY", IMAP_CAPABILITY);
+		return;
+	}
+
+	strcpy(command, "EXAMINE ");
+	if (!quote_imap(&command[8], IMAP_OUT_LEN - 8, imap->folder)) {
+		fail_imap(imap, "has a mailbox name that cannot be sent");
+		return;
+	}
+	send_imap(imap, command, IMAP_EXAMINE);
+}
+
+/* Count the unseen messages */
+
+static void
+send_imap_search(struct imap_account *imap)
+{
+	imap->search_count = 0;
+	imap->changed = FALSE;
+	send_imap(imap, "SEARCH UNSEEN", IMAP_SEARCH);
+}
+
+/* Leave IDLE, to count again or to renew it */
+
+static void
+send_imap_done(struct imap_account *imap)
+{
+	if (imap->out_len + 6 > IMAP_OUT_LEN) {
+		fail_imap(imap, "has too much to send");
+		return;
+	}
+	memcpy(&imap->out[ imap->out_len ], "DONE\r\n", 6);
+	imap->out_len += 6;
+	imap->idling = FALSE;
+	imap->state = IMAP_DONE;
+	set_imap_timer(imap, IMAP_REPLY_TIME);
+	flush_imap(imap);
+}
+
+/* Count the words in a SEARCH response */
+
+static long
+count_imap_words(const char *p)
+{
+	long count;
+
+	count = 0;
+	for (;;) {
+		while (*p == ' ') p++;
+		if (*p == '\0') {
+			return count;
+		}
+		count++;
+		while (*p != ' ' && *p != '\0') p++;
+	}
+}
+
+/* Update the panel with new counts from an IMAP account */
+
+static void
+report_imap(struct imap_account *imap)
+{
+	int i;
+
+	for (i = 0; i < num_mailboxes; i++) {
+		if (mailboxes[i].imap == imap) {
+			mailboxes[i].dirty = TRUE;
+		}
+	}
+	if (imap->event_box != NULL) {
+		open_window(imap->event_box);
+	}
+}
+
+/* Handle an untagged response */
+
+static void
+imap_untagged(struct imap_account *imap, const char *p)
+{
+	char *end;
+	long n;
+
+	if (imap->state == IMAP_GREETING) {
+		imap->have_capability = FALSE;
+		imap->can_idle = FALSE;
+		read_imap_capability_code(imap, p);
+		if (strncmp(p, "OK", 2) == 0) {
+			send_imap_login(imap);
+		} else if (strncmp(p, "PREAUTH", 7) == 0) {
+			send_imap_examine(imap);
+		} else {
+			fail_imap(imap, "refused the connection");
+		}
+		return;
+	}
+	if (strncmp(p, "BYE", 3) == 0) {
+		fail_imap(imap, "ended the session");
+		return;
+	}
+	if (strncmp(p, "SEARCH", 6) == 0 && (p[6] == ' ' || p[6] == '\0')) {
+		imap->search_count += count_imap_words(p + 6);
+		return;
+	}
+	if (strncmp(p, "CAPABILITY ", 11) == 0) {
+		read_imap_capability(imap, p + 11);
+		return;
+	}
+	if (!isdigit(*p)) {
+		return;
+	}
+	n = strtol(p, &end, 10);
+	if (strcmp(end, " EXISTS") == 0) {
+		if (imap->known && n > imap->exists) {
+			/* also counts mail that arrived while the connection was down */
+			imap->arrivals += n - imap->exists;
+		}
+		imap->exists = n;
+		imap->changed = TRUE;
+	} else if (strcmp(end, " RECENT") == 0) {
+		imap->recent = n;
+		imap->changed = TRUE;
+	} else if (strcmp(end, " EXPUNGE") == 0) {
+		if (imap->exists > 0) {
+			imap->exists--;
+		}
+		imap->changed = TRUE;
+	} else if (strncmp(end, " FETCH", 6) == 0) {
+		/* the flags of a message changed */
+		imap->changed = TRUE;
+	}
+	if (imap->changed && imap->state == IMAP_IDLE && imap->idling) {
+		send_imap_done(imap);
+	} else if (imap->changed && imap->state == IMAP_WAIT) {
+		send_imap_search(imap);
+	}
+}
+
+/* Handle the reply to the last command */
+
+static void
+imap_tagged(struct imap_account *imap, const char *result)
+{
+	enum imap_enum { REASON_LEN = 120 };
+	char reason[ REASON_LEN ];
+
+	if (strncmp(result, "OK", 2) != 0 && imap->state == IMAP_IDLE && !imap->idling) {
+		/* the server listed IDLE but refused it */
+		if (log_file != NULL) {
+			fprintf(log_file, "IMAP '%s@%s' refused IDLE, checking every %d seconds.\n", imap->user, imap->host, interval);
+		}
+		imap->can_idle = FALSE;
+		if (imap->changed) {
+			send_imap_search(imap);
+		} else {
+			wait_imap(imap);
+		}
+		return;
+	}
+	if (strncmp(result, "OK", 2) != 0) {
+		snprintf(reason, REASON_LEN, "said '%s'", result);
+		fail_imap(imap, reason);
+		return;
+	}
+
+	switch (imap->state) {
+	case IMAP_LOGIN:
+		read_imap_capability_code(imap, result);
+		send_imap_examine(imap);
+		break;
+	case IMAP_CAPABILITY:
+		if (!imap->have_capability) {
+			/* no CAPABILITY response, so do not count on IDLE */
+			imap->have_capability = TRUE;
+		}
+		send_imap_examine(imap);
+		break;
+	case IMAP_EXAMINE:
+		send_imap_search(imap);
+		break;
+	case IMAP_SEARCH:
+		imap->unseen = imap->search_count;
+		if (!imap->known && log_file != NULL) {
+			fprintf(log_file, "IMAP '%s@%s' %s has %ld messages, %ld unseen, at %s.\n",
+				imap->user, imap->host, imap->folder, imap->exists, imap->unseen, show_time());
+			fflush(log_file);
+		}
+		if (!imap->can_idle && (!imap->known || imap->failures > 0) && log_file != NULL) {
+			fprintf(log_file, "IMAP '%s@%s' has no IDLE, checking every %d seconds.\n", imap->user, imap->host, interval);
+		}
+		imap->known = TRUE;
+		imap->failures = 0;
+		imap->changed = FALSE;
+		if (imap->can_idle) {
+			send_imap(imap, "IDLE", IMAP_IDLE);
+		} else {
+			wait_imap(imap);
+		}
+		report_imap(imap);
+		break;
+	case IMAP_DONE:
+		if (imap->changed) {
+			send_imap_search(imap);
+		} else {
+			/* renew IDLE before the server or a router drops the connection */
+			send_imap(imap, "IDLE", IMAP_IDLE);
+		}
+		break;
+	case IMAP_NOOP:
+		if (imap->changed) {
+			send_imap_search(imap);
+		} else {
+			wait_imap(imap);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/* Handle one response line */
+
+static void
+imap_line(struct imap_account *imap, char *line)
+{
+	char *end;
+	long tag;
+
+	if (debug > 1 && log_file != NULL) {
+		fprintf(log_file, "IMAP '%s' %.80s\n", imap->host, line);
+	}
+	if (line[0] == '*' && line[1] == ' ') {
+		imap_untagged(imap, line + 2);
+	} else if (line[0] == '+') {
+		if (imap->state == IMAP_IDLE) {
+			imap->idling = TRUE;
+			if (imap->changed) {
+				/* a change came between IDLE and the continuation */
+				send_imap_done(imap);
+			} else {
+				set_imap_timer(imap, IMAP_IDLE_TIME);
+			}
+		}
+	} else if (line[0] == 'm' && isdigit(line[1])) {
+		tag = strtol(line + 1, &end, 10);
+		if (tag == imap->tag && *end == ' ') {
+			imap_tagged(imap, end + 1);
+		}
+	}
+}
+
+/* Keep a response line that does not fit in the buffer */
+/*   The numbers in a long SEARCH response are counted as they arrive, */
+/*   and other long lines are dropped */
+
+static void
+long_imap_line(struct imap_account *imap)
+{
+	char *last;
+	int len;
+
+	last = (imap->skip_line? NULL: strrchr(imap->buf, ' '));
+	if (last != NULL && strncmp(imap->buf, "* SEARCH ", 9) == 0 && last > &imap->buf[8]) {
+		*last = '\0';
+		imap->search_count += count_imap_words(&imap->buf[9]);
+		len = imap->buf_len - (last + 1 - imap->buf);
+		memmove(&imap->buf[9], last + 1, len + 1);
+		imap->buf_len = 9 + len;
+	} else {
+		imap->skip_line = TRUE;
+		imap->buf_len = 0;
+	}
+}
+
+/* Read and handle the responses that arrived */
+
+static void
+receive_imap(struct imap_account *imap)
+{
+	char *buf_end;
+	char *line;
+	char *nl;
+	char *brace;
+	long skip;
+	int len;
+
+	for (;;) {
+		len = read_imap_socket(imap, &imap->buf[ imap->buf_len ], IMAP_BUF_LEN - 1 - imap->buf_len);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+			return;
+		}
+		if (len <= 0) {
+			fail_imap(imap, (len == 0? "closed the connection": "read failed"));
+			return;
+		}
+		imap->buf_len += len;
+		imap->buf[ imap->buf_len ] = '\0';
+		buf_end = &imap->buf[ imap->buf_len ];
+
+		line = imap->buf;
+		while (imap->fd != -1) {
+			if (imap->skip_bytes > 0) {
+				/* a literal, such as a header the applet did not ask for */
+				skip = (imap->skip_bytes < buf_end - line? imap->skip_bytes: buf_end - line);
+				line += skip;
+				imap->skip_bytes -= skip;
+				if (imap->skip_bytes > 0) {
+					break;
+				}
+			}
+			nl = memchr(line, '\n', buf_end - line);
+			if (nl == NULL) {
+				break;
+			}
+			*nl = '\0';
+			if (nl > line && nl[-1] == '\r') {
+				nl[-1] = '\0';
+			}
+			if (imap->skip_line) {
+				imap->skip_line = FALSE;
+			} else {
+				brace = strrchr(line, '{');
+				if (brace != NULL && isdigit(brace[1]) && strchr(brace, '}') != NULL && strchr(brace, '}')[1] == '\0') {
+					imap->skip_bytes = atol(brace + 1);
+				}
+				imap_line(imap, line);
+			}
+			line = nl + 1;
+		}
+		if (imap->fd == -1) {
+			return;
+		}
+		imap->buf_len = buf_end - line;
+		memmove(imap->buf, line, imap->buf_len + 1);
+		if (imap->buf_len >= IMAP_BUF_LEN - 1) {
+			long_imap_line(imap);
+		}
+	}
+}
+
+/* Start TLS on a connected socket */
+/*   The server certificate must match the host name and be signed by a system CA */
+
+static gboolean
+start_imap_tls(struct imap_account *imap)
+{
+	if (imap_ssl_ctx == NULL) {
+		imap_ssl_ctx = SSL_CTX_new(TLS_client_method());
+		if (imap_ssl_ctx == NULL) {
+			fail_imap(imap, "could not start TLS");
+			return FALSE;
+		}
+		SSL_CTX_set_min_proto_version(imap_ssl_ctx, TLS1_2_VERSION);
+		SSL_CTX_set_verify(imap_ssl_ctx, SSL_VERIFY_PEER, NULL);
+		SSL_CTX_set_default_verify_paths(imap_ssl_ctx);
+	}
+	imap->ssl = SSL_new(imap_ssl_ctx);
+	if (imap->ssl == NULL || SSL_set_fd(imap->ssl, imap->fd) != 1 ||
+	    SSL_set_tlsext_host_name(imap->ssl, imap->host) != 1 || SSL_set1_host(imap->ssl, imap->host) != 1) {
+		fail_imap(imap, "could not start TLS");
+		return FALSE;
+	}
+	SSL_set_mode(imap->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	imap->state = IMAP_HANDSHAKE;
+	return TRUE;
+}
+
+/* Continue the TLS handshake */
+/*   Returns TRUE when it is done */
+
+static gboolean
+imap_handshake(struct imap_account *imap)
+{
+	enum handshake_enum { REASON_LEN = 160 };
+	char reason[ REASON_LEN ];
+	long verify;
+	int result;
+	int error;
+
+	result = SSL_connect(imap->ssl);
+	if (result == 1) {
+		imap->want_write = FALSE;
+		imap->state = IMAP_GREETING;
+		return TRUE;
+	}
+	error = SSL_get_error(imap->ssl, result);
+	if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+		imap->want_write = (error == SSL_ERROR_WANT_WRITE);
+		update_imap_watch(imap);
+		return FALSE;
+	}
+	verify = SSL_get_verify_result(imap->ssl);
+	if (verify != X509_V_OK) {
+		snprintf(reason, REASON_LEN, "has a bad certificate, %s", X509_verify_cert_error_string(verify));
+	} else {
+		snprintf(reason, REASON_LEN, "failed the TLS handshake, %s", ERR_reason_error_string(ERR_peek_last_error()));
+	}
+	ERR_clear_error();
+	fail_imap(imap, reason);
+	return FALSE;
+}
+
+/* Handle the socket of an IMAP account */
+
+static gboolean
+on_imap_io(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	struct imap_account *imap = (struct imap_account *) data;
+	guint watch;
+	socklen_t len;
+	int error;
+
+	watch = imap->watch;
+	if (imap->state == IMAP_CONNECTING) {
+		error = 0;
+		len = sizeof(error);
+		if (getsockopt(imap->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0) {
+			fail_imap(imap, "could not connect");
+			return FALSE;
+		}
+		if (!imap->use_tls) {
+			imap->state = IMAP_GREETING;
+		} else if (!start_imap_tls(imap)) {
+			return FALSE;
+		}
+	}
+	if (imap->state == IMAP_HANDSHAKE && !imap_handshake(imap)) {
+		return (imap->watch == watch);
+	}
+	if (imap->out_len > 0 && !flush_imap(imap)) {
+		return FALSE;
+	}
+	imap->want_write = FALSE;
+	receive_imap(imap);
+	if (imap->fd != -1) {
+		update_imap_watch(imap);
+	}
+	return (imap->watch == watch);
+}
+
+/* Look up an IMAP host name outside of the main loop */
+
+struct imap_lookup {
+	int id;				/* lookup_id of the account */
+	char *host;
+	char *port;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	int error;			/* getaddrinfo result */
+};
+
+/* Start a non-blocking connect */
+
+static void
+connect_imap(struct imap_account *imap, const struct sockaddr *addr, socklen_t addr_len)
+{
+	int on;
+
+	imap->fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (imap->fd == -1) {
+		fail_imap(imap, "has no socket");
+		return;
+	}
+	/* notice a server that went away while the applet waits in IDLE */
+	on = 1;
+	setsockopt(imap->fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	if (connect(imap->fd, addr, addr_len) != 0 && errno != EINPROGRESS) {
+		fail_imap(imap, "could not connect");
+		return;
+	}
+	imap->state = IMAP_CONNECTING;
+	set_imap_timer(imap, IMAP_REPLY_TIME);
+	update_imap_watch(imap);
+}
+
+/* Connect to an IMAP server after its host name was looked up */
+
+static gboolean
+on_imap_lookup_done(gpointer data)
+{
+	struct imap_lookup *lookup = (struct imap_lookup *) data;
+	struct imap_account *imap;
+	int i;
+
+	for (i = 0; i < num_mailboxes; i++) {
+		imap = mailboxes[i].imap;
+		if (imap != NULL && imap->lookup_id == lookup->id && imap->state == IMAP_RESOLVING) {
+			if (lookup->error != 0) {
+				fail_imap(imap, gai_strerror(lookup->error));
+			} else {
+				connect_imap(imap, (struct sockaddr *) &lookup->addr, lookup->addr_len);
+			}
+			break;
+		}
+	}
+	free(lookup->host);
+	free(lookup->port);
+	free(lookup);
+	return FALSE;
+}
+
+/* Look up a host name */
+
+static gpointer
+imap_lookup_thread(gpointer data)
+{
+	struct imap_lookup *lookup = (struct imap_lookup *) data;
+	struct addrinfo hints;
+	struct addrinfo *result;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	lookup->error = getaddrinfo(lookup->host, lookup->port, &hints, &result);
+	if (lookup->error == 0) {
+		memcpy(&lookup->addr, result->ai_addr, result->ai_addrlen);
+		lookup->addr_len = result->ai_addrlen;
+		freeaddrinfo(result);
+	}
+	g_idle_add(on_imap_lookup_done, lookup);
+	return NULL;
+}
+
+/* Start connecting an IMAP account */
+
+static void
+start_imap_account(struct imap_account *imap)
+{
+	struct imap_lookup *lookup;
+	GThread *thread;
+
+	close_imap(imap);
+	lookup = calloc(1, sizeof(*lookup));
+	if (lookup == NULL) {
+		fail_imap(imap, "has no memory");
+		return;
+	}
+	lookup->id = ++imap_lookups;
+	lookup->host = strdup(imap->host);
+	lookup->port = strdup(imap->port);
+	imap->lookup_id = lookup->id;
+	imap->state = IMAP_RESOLVING;
+	thread = (lookup->host && lookup->port? g_thread_try_new("imap lookup", imap_lookup_thread, lookup, NULL): NULL);
+	if (thread == NULL) {
+		free(lookup->host);
+		free(lookup->port);
+		free(lookup);
+		fail_imap(imap, "could not start a lookup");
+		return;
+	}
+	g_thread_unref(thread);
+	/* a resolver that hangs counts as a failure */
+	set_imap_timer(imap, IMAP_REPLY_TIME);
+}
+
+/* Handle the timer of an IMAP account */
+
+static gboolean
+on_imap_timer(gpointer data)
+{
+	struct imap_account *imap = (struct imap_account *) data;
+
+	imap->timer = 0;
+	if (imap->state == IMAP_DOWN) {
+		start_imap_account(imap);
+	} else if (imap->state == IMAP_IDLE && imap->idling) {
+		send_imap_done(imap);
+	} else if (imap->state == IMAP_WAIT) {
+		send_imap(imap, "NOOP", IMAP_NOOP);
+	} else {
+		fail_imap(imap, "did not answer");
+	}
+	return FALSE;
+}
+
+/* Find the current state of an IMAP mailbox */
+/*   The counts were pushed by the server, so nothing is read here */
+
+static enum mail_state_enum
+check_imap_state(struct mailbox *mb)
+{
+	enum mail_state_enum result;
+	struct imap_account *imap;
+
+	imap = mb->imap;
+	mb->message_count = imap->exists;
+	mb->unread_count = imap->unseen;
+	mb->new_count = (imap->recent < imap->unseen? imap->recent: imap->unseen);
+	if (imap->exists == 0) {
+		result = NO_MAIL;
+	} else if (imap->arrivals > 0 && imap->unseen > 0) {
+		result = NEW_MAIL;
+	} else {
+		result = (imap->unseen > 0? UNREAD_MAIL: OLD_MAIL);
+	}
+	mb->arrivals = (result == NEW_MAIL? imap->arrivals: 0);
+	imap->arrivals = 0;
+
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "%s imap state %d result %d messages %ld unread %ld\n",
+			mb->name, imap->state, result, mb->message_count, mb->unread_count);
+		fflush(log_file);
+	}
+	return result;
+}
+
+/* Connect the IMAP accounts that are down */
+/*   A click connects at once instead of waiting for the retry */
+
+static void
+start_imap(GtkEventBox *event_box)
+{
+	struct imap_account *imap;
+	int i;
+
+	for (i = 0; i < num_mailboxes; i++) {
+		imap = mailboxes[i].imap;
+		if (imap != NULL) {
+			imap->event_box = event_box;
+			if (imap->state == IMAP_DOWN) {
+				start_imap_account(imap);
+			}
+		}
+	}
+}
+
+/* Add an IMAP account from the setup file, "url password-file" */
+/*   An account that was there before keeps its connection */
+
+static void
+add_imap_account(const char *buf)
+{
+	enum add_imap_enum { URL_LEN = 512 };
+	char url[ URL_LEN ];
+	struct imap_account *imap;
+	struct mailbox *mb;
+	const char *p;
+	int len;
+
+	p = buf;
+	while (*p != '\0' && !isspace(*p)) p++;
+	len = p - buf;
+	while (isspace(*p)) p++;
+	imap = NULL;
+	if (len > 0 && len < URL_LEN && *p != '\0') {
+		memcpy(url, buf, len);
+		url[ len ] = '\0';
+		imap = new_imap(url, p);
+	}
+	if (imap == NULL) {
+		if (log_file != NULL)
+			fprintf(log_file, "Setup file '%s' has bad 'imap' '%s', use imaps://user@host/mailbox password-file.\n", setup_name, buf);
+		return;
+	}
+
+	mb = add_mailbox(url);
+	if (mb == NULL) {
+		free_imap(imap);
+		return;
+	}
+	if (mb->imap == NULL) {
+		mb->imap = imap;
+		mb->watched = TRUE;
+	} else {
+		free(mb->imap->password_name);
+		mb->imap->password_name = imap->password_name;
+		imap->password_name = NULL;
+		free_imap(imap);
+	}
+	if (access(mb->imap->password_name, R_OK) != 0 && log_file != NULL) {
+		fprintf(log_file, "Setup file '%s' lists missing 'imap' password file '%s'.\n", setup_name, mb->imap->password_name);
+	}
+	if (log_file != NULL)
+		fprintf(log_file, "Add 'imap' '%s'.\n", url);
+}
+
+/* Checkpoint */
+/*   The scan position, hashes and counts of each mailbox are saved in */
+/*   $HOME/.mailcheck.state, so after a restart the first check only reads */
+/*   what arrived while the applet was not running, and mail that was */
+/*   already seen does not beep again.  The file is written to a temporary */
+/*   name, synced, and renamed over the old one, and only when it changes. */
+
+#define	CHECKPOINT_HEADER	"# mailcheck checkpoint 1\n"
+
+enum checkpoint_enum {
+	CHECKPOINT_DELAY = 30,		/* seconds between a change and the save */
+	CHECKPOINT_LINE_LEN = 4096
+};
+
+static char *last_checkpoint = NULL;	/* text of the last saved checkpoint */
+static guint checkpoint_timer = 0;	/* timer to save the checkpoint, 0 if none */
+static gboolean checkpoint_loaded = FALSE;	/* counts came from the checkpoint */
+
+/* Format the checkpoint */
+/*   Returns a malloc'd string, or NULL if there is no memory */
+
+static char *
+format_checkpoint()
+{
+	const struct mailbox *mb;
+	char *text;
+	size_t text_len;
+	FILE *stream;
+	int i;
+
+	stream = open_memstream(&text, &text_len);
+	if (stream == NULL) {
+		return NULL;
+	}
+	fputs(CHECKPOINT_HEADER, stream);
+	for (i = 0; i < num_mailboxes; i++) {
+		mb = &mailboxes[i];
+		if (mb->maildir.scanned) {
+			fprintf(stream, "maildir %ld %ld %ld %s\n",
+				mb->maildir.new_count, mb->maildir.cur_count, mb->maildir.cur_unseen, mb->name);
+		} else if (mb->checked) {
+			fprintf(stream, "mbox %llu %llu %lld %lld %lld %lld %d %llx %d %llx %ld %ld %ld %s\n",
+				(unsigned long long) mb->mbox.dev, (unsigned long long) mb->mbox.ino,
+				(long long) mb->mbox.size, (long long) mb->mbox.scan_pos,
+				(long long) mb->last_size, (long long) mb->last_mtime,
+				mb->mbox.prefix_len, (unsigned long long) mb->mbox.prefix_hash,
+				mb->mbox.tail_len, (unsigned long long) mb->mbox.tail_hash,
+				mb->mbox.num_messages, mb->mbox.unread, mb->mbox.new_messages, mb->name);
+		}
+	}
+	if (fclose(stream) != 0) {
+		free(text);
+		return NULL;
+	}
+	return text;
+}
+
+/* Save the checkpoint if it changed */
+
+static gboolean
+on_save_checkpoint(gpointer data)
+{
+	char *text;
+	char *tmp_name;
+	FILE *tmp_file;
+	int ok;
+
+	checkpoint_timer = 0;
+	if (state_name == NULL) {
+		return FALSE;
+	}
+
+	text = format_checkpoint();
+	if (text == NULL) {
+		return FALSE;
+	}
+	if (last_checkpoint != NULL && strcmp(text, last_checkpoint) == 0) {
+		free(text);
+		return FALSE;
+	}
+
+	tmp_name = malloc(strlen(state_name) + 5);
+	if (tmp_name == NULL) {
+		free(text);
+		return FALSE;
+	}
+	sprintf(tmp_name, "%s.tmp", state_name);
+
+	ok = FALSE;
+	tmp_file = fopen(tmp_name, "w");
+	if (tmp_file != NULL) {
+		ok = (fputs(text, tmp_file) >= 0 && fflush(tmp_file) == 0 && fsync(fileno(tmp_file)) == 0);
+		ok = (fclose(tmp_file) == 0 && ok);
+		ok = (ok && rename(tmp_name, state_name) == 0);
+	}
+	if (!ok) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Could not save checkpoint '%s', errno %d.\n", state_name, errno);
+		}
+		unlink(tmp_name);
+		free(text);
+	} else {
+		free(last_checkpoint);
+		last_checkpoint = text;
+		if (debug && log_file != NULL) {
+			fprintf(log_file, "saved checkpoint '%s'\n", state_name);
+		}
+	}
+	free(tmp_name);
+	return FALSE;
+}
+
+/* Save the checkpoint a little later, so a burst of checks writes it once */
+
+static void
+schedule_checkpoint()
+{
+	if (checkpoint_timer == 0 && state_name != NULL) {
+		checkpoint_timer = g_timeout_add_seconds(CHECKPOINT_DELAY, on_save_checkpoint, NULL);
+	}
+}
+
+/* Return the mailbox of a checkpoint line, or NULL */
+/*   The folder directories are scanned later in the check thread, so a */
+/*   mailbox found in a folder before is added again from its name */
+
+static struct mailbox *
+find_checkpoint_mailbox(const char *name)
+{
+	struct mailbox *mb;
+	int i;
+
+	mb = find_mailbox(name);
+	for (i = 0; mb == NULL && i < num_folders; i++) {
+		if (is_in_folder(name, folders[i].name)) {
+			mb = add_mailbox(name);
+			if (mb != NULL) {
+				mb->in_folder = TRUE;
+			}
+		}
+	}
+	return mb;
+}
+
+/* Restore the mailboxes from the checkpoint */
+/*   The first check still compares the inode, size and hashes, */
+/*   and scans again from the start if the mail file was rewritten */
+
+static void
+load_checkpoint()
+{
+	char line[ CHECKPOINT_LINE_LEN ];
+	unsigned long long dev, ino, prefix_hash, tail_hash;
+	long long size, scan_pos, last_size, last_mtime;
+	long num_messages, unread, new_messages;
+	long new_count, cur_count, cur_unseen;
+	int prefix_len, tail_len;
+	struct mailbox *mb;
+	FILE *state_file;
+	char *nl;
+	int restored;
+	int pos;
+
+	state_file = fopen(state_name, "r");
+	if (state_file == NULL) {
+		return;
+	}
+	if (fgets(line, CHECKPOINT_LINE_LEN, state_file) == NULL || strcmp(line, CHECKPOINT_HEADER) != 0) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Ignoring checkpoint '%s' from another version.\n", state_name);
+		}
+		fclose(state_file);
+		return;
+	}
+
+	restored = 0;
+	while (fgets(line, CHECKPOINT_LINE_LEN, state_file) != NULL) {
+		nl = strchr(line, '\n');
+		if (nl == NULL) {
+			/* a name that is too long, or a partial line */
+			continue;
+		}
+		*nl = '\0';
+		pos = 0;
+		if (sscanf(line, "mbox %llu %llu %lld %lld %lld %lld %d %llx %d %llx %ld %ld %ld %n",
+				&dev, &ino, &size, &scan_pos, &last_size, &last_mtime,
+				&prefix_len, &prefix_hash, &tail_len, &tail_hash,
+				&num_messages, &unread, &new_messages, &pos) == 13 && pos > 0 &&
+		    (mb = find_checkpoint_mailbox(line + pos)) != NULL &&
+		    prefix_len >= 0 && prefix_len <= MBOX_HASH_LEN && tail_len >= 0 && tail_len <= MBOX_HASH_LEN) {
+			mb->mbox.dev = (dev_t) dev;
+			mb->mbox.ino = (ino_t) ino;
+			mb->mbox.size = (off_t) size;
+			mb->mbox.scan_pos = (off_t) scan_pos;
+			mb->mbox.prefix_len = prefix_len;
+			mb->mbox.prefix_hash = prefix_hash;
+			mb->mbox.tail_len = tail_len;
+			mb->mbox.tail_hash = tail_hash;
+			mb->mbox.num_messages = num_messages;
+			mb->mbox.indexed = FALSE;
+			mb->mbox.unread = unread;
+			mb->mbox.new_messages = new_messages;
+			mb->last_size = (off_t) last_size;
+			mb->last_mtime = (time_t) last_mtime;
+			mb->message_count = num_messages;
+			mb->unread_count = unread;
+			mb->new_count = new_messages;
+			mb->state = (num_messages == 0? NO_MAIL: unread > 0? UNREAD_MAIL: OLD_MAIL);
+			mb->checked = TRUE;
+			restored++;
+		} else if (sscanf(line, "maildir %ld %ld %ld %n", &new_count, &cur_count, &cur_unseen, &pos) == 3 && pos > 0 &&
+		    (mb = find_checkpoint_mailbox(line + pos)) != NULL) {
+			/* the maildir is counted again, and only more unread messages are new */
+			mb->maildir.new_count = new_count;
+			mb->maildir.cur_count = cur_count;
+			mb->maildir.cur_unseen = cur_unseen;
+			mb->maildir.scanned = TRUE;
+			mb->maildir.valid = FALSE;
+			restored++;
+		}
+	}
+	fclose(state_file);
+
+	checkpoint_loaded = (restored > 0);
+	if (log_file != NULL) {
+		fprintf(log_file, "Restored %d of %d mailboxes from checkpoint '%s'.\n", restored, num_mailboxes, state_name);
+	}
+}
+
+/* Find the current state of a maildir */
+
+static enum mail_state_enum
+check_maildir_state(struct mailbox *mb)
+{
+	enum mail_state_enum result;
+	struct maildir_counts *md;
+
+	md = &mb->maildir;
+	if (!md->valid || !mb->watched) {
+		scan_maildir(md, mb->name);
+	}
+
+	mb->message_count = md->new_count + md->cur_count;
+	mb->unread_count = md->new_count + md->cur_unseen;
+	mb->new_count = md->new_count;
+	if (mb->message_count == 0) {
+		result = NO_MAIL;
+	} else if (md->arrivals > 0 && mb->unread_count > 0) {
+		result = NEW_MAIL;
+	} else {
+		result = (mb->unread_count > 0? UNREAD_MAIL: OLD_MAIL);
+	}
+	mb->arrivals = (result == NEW_MAIL? md->arrivals: 0);
+	md->arrivals = 0;
+
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "%s maildir result %d messages %ld unread %ld\n", mb->name, result, mb->message_count, mb->unread_count);
+		fflush(log_file);
+	}
+	return result;
+}
+
+/* Mail file locks */
+/*   An MTA or procmail appending to an mbox file holds a dotlock name.lock, */
+/*   an fcntl lock, or a flock lock.  The applet looks for them without taking */
+/*   them: fcntl locks with F_OFD_GETLK on a read-only descriptor, and flock */
+/*   locks in /proc/locks.  While the file is locked for writing it keeps the last counts */
+/*   instead of reading a message that is half written.  Removing the dotlock */
+/*   or closing the file wakes inotify, and a timer checks again in case nothing */
+/*   does.  A lock held longer than LOCK_WAIT_TIME, such as by a mail reader */
+/*   that keeps the mailbox open, is not waited for. */
+
+enum lock_enum {
+	LOCK_RETRY_TIME = 2,		/* seconds between checks of a locked file */
+	LOCK_WAIT_TIME = 30,		/* most seconds to wait for a lock */
+	STALE_DOTLOCK_TIME = 300,	/* older dotlocks were left by a crash */
+	LOCKS_LINE_LEN = 256,
+	MOUNTINFO_LINE_LEN = 4096,
+	LOCK_KIND_LEN = 16
+};
+
+static guint lock_timer = 0;		/* timer to check locked mail files again, 0 if none */
+
+/* Return the device that /proc/locks shows for a file */
+/*   /proc/locks has the device of the filesystem, which is not st_dev on btrfs, */
+/*   where each subvolume has its own st_dev.  The device of the filesystem is */
+/*   the one of the mount in /proc/self/mountinfo. */
+
+static dev_t
+find_lock_device(const char *name, dev_t st_dev)
+{
+	char line[ MOUNTINFO_LINE_LEN ];
+	struct statx stx;
+	unsigned long long mnt_id;
+	unsigned int major_dev;
+	unsigned int minor_dev;
+	FILE *mountinfo_file;
+	gboolean line_start;
+	dev_t dev;
+
+	/* kernels before 5.8 do not give the mount */
+	if (syscall(SYS_statx, AT_FDCWD, name, AT_STATX_DONT_SYNC, STATX_MNT_ID, &stx) != 0 || !(stx.stx_mask & STATX_MNT_ID)) {
+		return st_dev;
+	}
+	mountinfo_file = fopen("/proc/self/mountinfo", "r");
+	if (mountinfo_file == NULL) {
+		return st_dev;
+	}
+	dev = st_dev;
+	line_start = TRUE;
+	while (fgets(line, MOUNTINFO_LINE_LEN, mountinfo_file) != NULL) {
+		/* "36 25 0:32 /home /home rw,relatime shared:1 - btrfs /dev/sda2 rw" */
+		if (line_start && sscanf(line, "%llu %*u %u:%u", &mnt_id, &major_dev, &minor_dev) == 3 &&
+		    mnt_id == stx.stx_mnt_id) {
+			dev = makedev(major_dev, minor_dev);
+			break;
+		}
+		line_start = (strchr(line, '\n') != NULL);
+	}
+	fclose(mountinfo_file);
+	return dev;
+}
+
+/* Return TRUE if another process holds an fcntl write lock on a mail file */
+/*   Asking for a read lock finds the write locks that would block it. */
+/*   F_OFD_GETLK finds both POSIX and open file description locks. */
+
+static gboolean
+has_fcntl_lock(const char *name)
+{
+	struct flock lock;
+	int status;
+	int fd;
+
+	fd = open(name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1) {
+		return FALSE;
+	}
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_RDLCK;
+	lock.l_whence = SEEK_SET;
+	status = fcntl(fd, F_OFD_GETLK, &lock);
+	if (status == -1 && errno == EINVAL) {
+		/* kernels before 3.15 */
+		memset(&lock, 0, sizeof(lock));
+		lock.l_type = F_RDLCK;
+		lock.l_whence = SEEK_SET;
+		status = fcntl(fd, F_GETLK, &lock);
+	}
+	close(fd);
+	return (status == 0 && lock.l_type != F_UNLCK);
+}
+
+/* Return TRUE if another process holds a flock write lock on a mail file */
+
+static gboolean
+has_flock_lock(const char *name, const struct stat *stat_buf)
+{
+	char line[ LOCKS_LINE_LEN ];
+	char kind[ LOCK_KIND_LEN ];
+	char type[ LOCK_KIND_LEN ];
+	unsigned long long ino;
+	unsigned int major_dev;
+	unsigned int minor_dev;
+	FILE *locks_file;
+	gboolean have_dev;
+	gboolean found;
+	dev_t dev;
+
+	locks_file = fopen("/proc/locks", "r");
+	if (locks_file == NULL) {
+		return FALSE;
+	}
+	found = FALSE;
+	have_dev = FALSE;
+	dev = stat_buf->st_dev;
+	while (!found && fgets(line, LOCKS_LINE_LEN, locks_file) != NULL) {
+		/* "1: FLOCK  ADVISORY  WRITE 1234 00:2a:131090 0 EOF", a waiter has "->" before FLOCK */
+		if (sscanf(line, "%*d: %15s %*s %15s %*s %x:%x:%llu", kind, type, &major_dev, &minor_dev, &ino) == 5 &&
+		    strcmp(kind, "FLOCK") == 0 && strcmp(type, "WRITE") == 0 && ino == (unsigned long long) stat_buf->st_ino) {
+			/* only look up the mount for a lock on the same inode number */
+			if (!have_dev) {
+				dev = find_lock_device(name, stat_buf->st_dev);
+				have_dev = TRUE;
+			}
+			found = (makedev(major_dev, minor_dev) == dev);
+		}
+	}
+	fclose(locks_file);
+	return found;
+}
+
+/* Return the kind of write lock on a mail file, or NULL if it is not locked */
+
+static const char *
+find_mbox_lock(const char *name, const struct stat *stat_buf)
+{
+	struct stat lock_buf;
+	char *lock_name;
+	gboolean found;
+
+	lock_name = malloc(strlen(name) + 6);
+	if (lock_name != NULL) {
+		sprintf(lock_name, "%s.lock", name);
+		found = (stat(lock_name, &lock_buf) == 0 && time(NULL) - lock_buf.st_mtime < STALE_DOTLOCK_TIME);
+		free(lock_name);
+		if (found) {
+			return "dotlock";
+		}
+	}
+	if (has_fcntl_lock(name)) {
+		return "fcntl";
+	}
+	if (has_flock_lock(name, stat_buf)) {
+		return "flock";
+	}
+	return NULL;
+}
+
+/* Return TRUE if the scan of a changed mail file has to wait for a lock */
+
+static gboolean
+is_mbox_locked(struct mailbox *mb, const struct stat *stat_buf)
+{
+	const char *kind;
+	time_t now;
+
+	kind = find_mbox_lock(mb->name, stat_buf);
+	now = time(NULL);
+	if (kind == NULL) {
+		if (mb->lock_start != 0 && debug && log_file != NULL) {
+			fprintf(log_file, "%s was unlocked after %ld seconds\n", mb->name, (long) (now - mb->lock_start));
+		}
+		mb->lock_start = 0;
+		return FALSE;
+	}
+	if (mb->lock_start == 0) {
+		mb->lock_start = now;
+		if (debug && log_file != NULL) {
+			fprintf(log_file, "%s is locked by %s, waiting to scan it\n", mb->name, kind);
+		}
+	}
+	if (now - mb->lock_start >= LOCK_WAIT_TIME) {
+		if (debug && log_file != NULL) {
+			fprintf(log_file, "%s has been locked for %ld seconds, scanning it anyway\n", mb->name, (long) (now - mb->lock_start));
+		}
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Return TRUE if a mailbox is waiting for a lock */
+
+static gboolean
+is_waiting_for_lock(const struct mailbox *mb, time_t now)
+{
+	return (mb->lock_start != 0 && now - mb->lock_start < LOCK_WAIT_TIME);
+}
+
+/* Check the locked mail files again */
+
+static gboolean
+on_lock_retry(gpointer data)
+{
+	time_t now;
+	int i;
+
+	lock_timer = 0;
+	now = time(NULL);
+	for (i = 0; i < num_mailboxes; i++) {
+		if (is_waiting_for_lock(&mailboxes[i], now)) {
+			mailboxes[i].dirty = TRUE;
+		}
+	}
+	open_window(GTK_EVENT_BOX(data));
+	return FALSE;
+}
+
+/* Find the current state of a mailbox */
+
+static enum mail_state_enum
+check_mailbox(struct mailbox *mb)
+{
+	enum mail_state_enum result;
+	struct stat stat_buf;
+	gboolean exists;
+
+	if (mb->imap != NULL) {
+		return check_imap_state(mb);
+	}
+
+	result = NO_MAIL;
+
+	exists = (stat_mailbox(mb->name, &stat_buf, FALSE) == 0);
+	if (exists && S_ISDIR(stat_buf.st_mode)) {
+		return check_maildir_state(mb);
+	}
+	mb->maildir.scanned = FALSE;
+
+	if (!exists) {
+		/* mail file does not exist, so there is no mail */
+		mb->last_size = 0;
+		mb->last_mtime = 0;
+		reset_mbox_scan(&mb->mbox);
+	} else if (stat_buf.st_size > 0) {
+		if ((stat_buf.st_size != mb->last_size || stat_buf.st_mtime != mb->last_mtime) &&
+		    is_mbox_locked(mb, &stat_buf)) {
+			/* keep the last result, and check again when the delivery is done */
+			return mb->state;
+		}
+		if (stat_buf.st_size != mb->last_size || stat_buf.st_mtime != mb->last_mtime) {
+			scan_mbox(&mb->mbox, mb->name, &stat_buf, (mb->checked && mb->last_size == 0));
+		}
+		if (mb->mbox.num_messages == 0) {
+			/* not an mbox file, fall back to the times */
+			if (stat_buf.st_size != mb->last_size || stat_buf.st_mtime != mb->last_mtime) {
+				result = NEW_MAIL;
+			} else {
+				result = (stat_buf.st_mtime >= stat_buf.st_atime? UNREAD_MAIL: OLD_MAIL);
+			}
+		} else if (mb->mbox.new_unread > 0) {
+			result = NEW_MAIL;
+		} else {
+			result = (mb->mbox.unread > 0? UNREAD_MAIL: OLD_MAIL);
+		}
+		mb->arrivals = (mb->mbox.new_unread > 0? mb->mbox.new_unread: 1);
+		mb->mbox.new_unread = 0;
+		mb->last_size = stat_buf.st_size;
+		mb->last_mtime = stat_buf.st_mtime;
+	} else {
+		reset_mbox_scan(&mb->mbox);
+	}
+	if (result != NEW_MAIL) {
+		mb->arrivals = 0;
+	}
+	mb->message_count = mb->mbox.num_messages;
+	mb->unread_count = mb->mbox.unread;
+	mb->new_count = mb->mbox.new_messages;
+	mb->checked = TRUE;
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "%s size %ld time %ld result %d messages %ld unread %ld\n", mb->name, (long)mb->last_size, (long)mb->last_mtime, result,
+			mb->message_count, mb->unread_count);
+		fflush(log_file);
+	}
+	return result;
+}
+
+/* Return TRUE if a check found a change in a mailbox */
+
+static gboolean
+is_mailbox_changed(const struct mailbox *before, const struct mailbox *after)
+{
+	return (before->last_size != after->last_size || before->last_mtime != after->last_mtime ||
+		before->message_count != after->message_count || before->unread_count != after->unread_count);
+}
+
+/* Poll at the configured interval again after a change */
+
+static void
+note_poll_change()
+{
+	poll_changed = TRUE;
+	poll_interval = interval;
+}
+
+/* Checks in a thread */
+/*   Mailboxes that inotify does not watch, usually on network filesystems, */
+/*   are checked in a thread so a slow server cannot block the panel.  The */
+/*   thread also finds which mailboxes and folders inotify can watch, and */
+/*   looks for new mailboxes in the folders, since statfs, access, and */
+/*   reading a directory wait for the server too.  The thread works on */
+/*   copies, which own their message index until the main loop copies the */
+/*   results back.  Only one check runs at a time, and a timer sets the */
+/*   label to say the server is slow when it passes the deadline. */
+
+struct found_mailbox {
+	char *name;			/* path of an mbox file or maildir */
+	int folder;			/* index of the folder copy it was found in */
+};
+
+struct check_job {
+	struct mailbox *boxes;		/* copies of the mailboxes */
+	enum mail_state_enum *states;	/* result for each copy */
+	int num_boxes;
+	struct folder folders[ MAX_FOLDERS ];	/* copies of the folders to probe or scan */
+	int num_folders;
+	gboolean scan_folders;		/* look for new mailboxes in the folders */
+	struct found_mailbox *found;	/* mailboxes in the folders */
+	int num_found;
+	int max_found;
+	time_t start_time;
+	GtkEventBox *event_box;
+};
+
+static struct check_job *check_job = NULL;	/* the check in the thread, NULL if none */
+static guint slow_timer = 0;		/* timer for the deadline of the check, 0 if none */
+
+/* Forward declarations */
+
+static gboolean inotify_works(const char *dir_name);
+static void probe_mailbox(struct mailbox *mb);
+static void watch_mailbox(struct mailbox *mb);
+static void scan_folder(struct check_job *job, int folder);
+static void drop_gone_mailboxes(const char *folder_name);
+
+/* Free a check and the copies */
+
+static void
+free_check_job(struct check_job *job)
+{
+	int i;
+
+	for (i = 0; i < job->num_boxes; i++) {
+		free(job->boxes[i].name);
+		free(job->boxes[i].mbox.messages);
+	}
+	for (i = 0; i < job->num_folders; i++) {
+		free(job->folders[i].name);
+	}
+	for (i = 0; i < job->num_found; i++) {
+		free(job->found[i].name);
+	}
+	free(job->boxes);
+	free(job->states);
+	free(job->found);
+	free(job);
+}
+
+/* Probe, scan, and check the copies */
+/*   Runs in the thread, or in the panel if the thread could not start */
+
+static void
+run_check_job(struct check_job *job)
+{
+	int i;
+
+	for (i = 0; i < job->num_folders; i++) {
+		if (job->folders[i].probe) {
+			job->folders[i].local = inotify_works(job->folders[i].name);
+		}
+		if (job->scan_folders) {
+			scan_folder(job, i);
+		}
+	}
+	for (i = 0; i < job->num_boxes; i++) {
+		if (job->boxes[i].probe) {
+			probe_mailbox(&job->boxes[i]);
+		}
+		job->states[i] = check_mailbox(&job->boxes[i]);
+	}
+}
+
+/* Copy the results of a check back to the mailboxes and folders */
+
+static void
+finish_check_job(struct check_job *job)
+{
+	struct mailbox *copy;
+	struct mailbox *mb;
+	struct folder *folder;
+	int added[ MAX_FOLDERS ];
+	int i;
+
+	for (i = 0; i < job->num_boxes; i++) {
+		copy = &job->boxes[i];
+		mb = find_mailbox(copy->name);
+		if (mb == NULL || !mb->busy) {
+			/* the setup file was read again */
+			continue;
+		}
+		if (is_mailbox_changed(mb, copy)) {
+			note_poll_change();
+		}
+		mb->last_size = copy->last_size;
+		mb->last_mtime = copy->last_mtime;
+		mb->mbox = copy->mbox;
+		mb->maildir = copy->maildir;
+		mb->message_count = copy->message_count;
+		mb->unread_count = copy->unread_count;
+		mb->new_count = copy->new_count;
+		mb->checked = copy->checked;
+		mb->arrivals = copy->arrivals;
+		mb->lock_start = copy->lock_start;
+		mb->state = (job->states[i] == NEW_MAIL? UNREAD_MAIL: job->states[i]);
+		mb->pending_new = (job->states[i] == NEW_MAIL);
+		mb->busy = FALSE;
+		copy->mbox.messages = NULL;
+		if (copy->probe && mb->probe) {
+			mb->probe = FALSE;
+			mb->local = copy->local;
+			mb->retry = copy->retry;
+			if (mb->local) {
+				watch_mailbox(mb);
+			}
+		}
+	}
+
+	for (i = 0; i < job->num_folders; i++) {
+		added[i] = 0;
+		folder = find_folder(job->folders[i].name);
+		if (folder != NULL && job->folders[i].probe && folder->probe) {
+			folder->probe = FALSE;
+			folder->local = job->folders[i].local;
+			if (folder->local && inotify_fd != -1 && folder->wd == -1) {
+				folder->wd = inotify_add_watch(inotify_fd, folder->name, WATCH_DIR_EVENTS);
+			}
+		}
+	}
+	for (i = 0; i < job->num_found; i++) {
+		if (find_folder(job->folders[ job->found[i].folder ].name) == NULL) {
+			continue;
+		}
+		mb = find_mailbox(job->found[i].name);
+		if (mb != NULL) {
+			mb->missing = FALSE;
+			continue;
+		}
+		mb = add_mailbox(job->found[i].name);
+		if (mb != NULL) {
+			mb->probe = (inotify_fd != -1);
+			mb->in_folder = TRUE;
+			added[ job->found[i].folder ]++;
+			if (debug && log_file != NULL) {
+				fprintf(log_file, "Added mailbox '%s'.\n", mb->name);
+			}
+		}
+	}
+	for (i = 0; i < job->num_folders; i++) {
+		if (added[i] > 0 && log_file != NULL) {
+			fprintf(log_file, "Added %d mailboxes from folder '%s'.\n", added[i], job->folders[i].name);
+		}
+		if (job->folders[i].scanned) {
+			drop_gone_mailboxes(job->folders[i].name);
+		}
+	}
+}
+
+/* Copy the results of the thread back to the mailboxes */
+
+static gboolean
+on_check_done(gpointer data)
+{
+	struct check_job *job = (struct check_job *) data;
+
+	finish_check_job(job);
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "checked %d mailboxes in the thread in %ld seconds\n",
+			job->num_boxes, (long) (time(NULL) - job->start_time));
+	}
+	check_job = NULL;
+	if (slow_timer != 0) {
+		g_source_remove(slow_timer);
+		slow_timer = 0;
+	}
+	schedule_checkpoint();
+	open_window(job->event_box);
+	/* a change ends the backoff at once */
+	reset_timer(GTK_WIDGET(job->event_box));
+	free_check_job(job);
+	return FALSE;
+}
+
+/* Check the copies outside of the main loop */
+
+static gpointer
+check_thread(gpointer data)
+{
+	struct check_job *job = (struct check_job *) data;
+
+	run_check_job(job);
+	g_idle_add(on_check_done, job);
+	return NULL;
+}
+
+/* Show that the check in the thread passed the deadline */
+
+static gboolean
+on_check_slow(gpointer data)
+{
+	slow_timer = 0;
+	open_window(GTK_EVENT_BOX(data));
+	return FALSE;
+}
+
+/* Return TRUE if the folders have to be probed or scanned */
+
+static gboolean
+is_folder_work()
+{
+	int i;
+
+	for (i = 0; i < num_folders; i++) {
+		if (folders_dirty || folders[i].probe) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* Start checking the dirty mailboxes that inotify does not watch */
+/*   Returns FALSE if the thread could not start, after checking in the panel */
+
+static gboolean
+start_check_job(GtkEventBox *event_box, int num_boxes)
+{
+	struct check_job *job;
+	struct mailbox *mb;
+	GThread *thread;
+	int i;
+
+	job = calloc(1, sizeof(*job));
+	if (job == NULL) {
+		return FALSE;
+	}
+	/* one more, so a check of only the folders allocates too */
+	job->boxes = calloc(num_boxes + 1, sizeof(*job->boxes));
+	job->states = calloc(num_boxes + 1, sizeof(*job->states));
+	job->start_time = time(NULL);
+	job->event_box = event_box;
+	if (job->boxes == NULL || job->states == NULL) {
+		free_check_job(job);
+		return FALSE;
+	}
+	for (i = 0; i < num_mailboxes && job->num_boxes < num_boxes; i++) {
+		mb = &mailboxes[i];
+		if (mb->dirty && !mb->watched && !mb->busy) {
+			job->boxes[ job->num_boxes ] = *mb;
+			job->boxes[ job->num_boxes ].name = strdup(mb->name);
+			if (job->boxes[ job->num_boxes ].name == NULL) {
+				break;
+			}
+			job->num_boxes++;
+		}
+	}
+	job->scan_folders = folders_dirty;
+	for (i = 0; i < num_folders; i++) {
+		if (folders_dirty || folders[i].probe) {
+			job->folders[ job->num_folders ] = folders[i];
+			job->folders[ job->num_folders ].name = strdup(folders[i].name);
+			job->folders[ job->num_folders ].scanned = FALSE;
+			if (job->folders[ job->num_folders ].name == NULL) {
+				break;
+			}
+			job->num_folders++;
+		}
+	}
+	if (job->num_boxes != num_boxes || i < num_folders) {
+		/* the copies do not own the message indexes yet */
+		for (i = 0; i < job->num_boxes; i++) {
+			job->boxes[i].mbox.messages = NULL;
+		}
+		free_check_job(job);
+		return FALSE;
+	}
+
+	/* the copies own the message indexes until the check is done */
+	for (i = 0; i < num_mailboxes; i++) {
+		mb = &mailboxes[i];
+		if (mb->dirty && !mb->watched && !mb->busy) {
+			mb->dirty = FALSE;
+			mb->busy = TRUE;
+			mb->mbox.messages = NULL;
+			mb->mbox.max_messages = 0;
+		}
+	}
+	if (folders_dirty) {
+		/* the scan clears it for the mailboxes still there */
+		for (i = 0; i < num_mailboxes; i++) {
+			mailboxes[i].missing = mailboxes[i].in_folder;
+		}
+	}
+	folders_dirty = FALSE;
+
+	thread = g_thread_try_new("mail check", check_thread, job, NULL);
+	if (thread == NULL) {
+		run_check_job(job);
+		finish_check_job(job);
+		free_check_job(job);
+		schedule_checkpoint();
+		return FALSE;
+	}
+	check_job = job;
+	slow_timer = g_timeout_add(deadline * 1000, on_check_slow, event_box);
+	g_thread_unref(thread);
+	return TRUE;
+}
+
+/* Return TRUE if the check in the thread passed the deadline */
+
+static gboolean
+is_check_slow()
+{
+	return (check_job != NULL && time(NULL) - check_job->start_time >= deadline);
+}
+
+/* Find the current state of all mailboxes */
+/*   Only the mailboxes marked dirty are checked, */
+/*   and the ones that inotify does not watch are checked in a thread */
+
+static enum mail_state_enum
+check_mail_state(GtkEventBox *event_box)
+{
+	enum mail_state_enum result;
+	enum mail_state_enum state;
+	struct mailbox before;
+	struct mailbox *mb;
+	time_t now;
+	int checked;
+	int queued;
+	int waiting;
+	int i;
+
+	if (num_mailboxes == 0) {
+		exit_mailcheck();
+	}
+
+	queued = 0;
+	for (i = 0; i < num_mailboxes; i++) {
+		if (mailboxes[i].dirty && !mailboxes[i].watched && !mailboxes[i].busy) {
+			queued++;
+		}
+	}
+	if ((queued > 0 || is_folder_work()) && check_job == NULL && !start_check_job(event_box, queued)) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Could not start the check thread, checking %d mailboxes in the panel.\n", queued);
+		}
+	}
+
+	result = NO_MAIL;
+	checked = 0;
+	waiting = 0;
+	now = time(NULL);
+	arrived_count = 0;
+	message_count = 0;
+	unread_count = 0;
+	new_message_count = 0;
+	for (i = 0; i < num_mailboxes; i++) {
+		mb = &mailboxes[i];
+		if (mb->dirty && (mb->watched || check_job == NULL)) {
+			mb->dirty = FALSE;
+			before = *mb;
+			state = check_mailbox(mb);
+			if (is_mailbox_changed(&before, mb)) {
+				note_poll_change();
+			}
+			if (state == NEW_MAIL) {
+				/* new mail is reported once */
+				mb->pending_new = TRUE;
+				state = UNREAD_MAIL;
+			}
+			mb->state = state;
+			checked++;
+			schedule_checkpoint();
+		}
+		if (mb->pending_new) {
+			mb->pending_new = FALSE;
+			result = NEW_MAIL;
+			arrived_count += mb->arrivals;
+		}
+		if (mb->state > result) {
+			result = mb->state;
+		}
+		message_count += mb->message_count;
+		unread_count += mb->unread_count;
+		new_message_count += mb->new_count;
+		if (is_waiting_for_lock(mb, now)) {
+			waiting++;
+		}
+	}
+
+	if (waiting > 0 && lock_timer == 0) {
+		lock_timer = g_timeout_add_seconds(LOCK_RETRY_TIME, on_lock_retry, event_box);
+	}
+
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "checked %d of %d mailboxes, result %d messages %ld unread %ld new %ld\n",
+			checked, num_mailboxes, result, message_count, unread_count, new_message_count);
+		fflush(log_file);
+	}
+	return result;
+}
+
+/* Filesystems where inotify misses changes made by other machines */
+
+static const long remote_fs_types[] = {
+	0x6969,		/* nfs */
+	0x517B,		/* smb */
+	0xFF534D42,	/* cifs */
+	0xFE534D42,	/* smb2 */
+	0x65735546,	/* fuse, such as sshfs */
+	0x00C36400,	/* ceph */
+	0x5346414F,	/* afs */
+	0x47504653,	/* gpfs */
+	0x0BD00BD0	/* lustre */
+};
+
+/* Return TRUE if inotify sees all changes to files in a directory */
+/*   Runs in the check thread, since statfs waits for a slow server */
+
+static gboolean
+inotify_works(const char *dir_name)
+{
+	struct statfs statfs_buf;
+	int i;
+
+	if (statfs(dir_name, &statfs_buf) != 0) {
+		return FALSE;
+	}
+	for (i = 0; i < (int) (sizeof(remote_fs_types) / sizeof(remote_fs_types[0])); i++) {
+		if ((unsigned long) statfs_buf.f_type == (unsigned long) remote_fs_types[i]) {
+			if (log_file != NULL) {
+				fprintf(log_file, "'%s' is on a network filesystem (type 0x%lx), polling instead of inotify.\n",
+					dir_name, (unsigned long) statfs_buf.f_type);
+			}
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+
+/* Watch an mbox file itself */
+/*   The file may not exist yet, or may be replaced by a rename, */
+/*   so this is repeated when the directory watch sees it appear */
+
+static void
+watch_mail_file(struct mailbox *mb)
+{
+	int old_wd;
+
+	old_wd = mb->file_wd;
+	mb->file_wd = inotify_add_watch(inotify_fd, mb->name,
+		IN_MODIFY | IN_CLOSE_WRITE | IN_CLOSE_NOWRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+	if (old_wd != -1 && old_wd != mb->file_wd) {
+		/* the old file was renamed away */
+		inotify_rm_watch(inotify_fd, old_wd);
+	}
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "watch '%s' wd %d\n", mb->name, mb->file_wd);
+	}
+}
+
+/* Copy the directory of an mbox file to path */
+
+static void
+copy_mail_dir(char *path, const char *name)
+{
+	char *slash;
+
+	strcpy(path, name);
+	slash = strrchr(path, '/');
+	if (slash == NULL) {
+		strcpy(path, ".");
+	} else if (slash == path) {
+		slash[1] = '\0';
+	} else {
+		*slash = '\0';
+	}
+}
+
+/* Find whether inotify sees all changes to a mailbox */
+/*   Runs in the check thread, since stat, statfs, and access wait for a slow */
+/*   server.  Sets retry if the directory is missing, to probe it again. */
+
+static void
+probe_mailbox(struct mailbox *mb)
+{
+	struct stat stat_buf;
+	char *path;
+
+	mb->local = FALSE;
+	if (mb->imap != NULL) {
+		mb->retry = FALSE;
+		return;
+	}
+	path = malloc(strlen(mb->name) + 8);
+	if (path == NULL) {
+		return;
+	}
+
+	if (stat_mailbox(mb->name, &stat_buf, TRUE) == 0 && S_ISDIR(stat_buf.st_mode)) {
+		strcpy(path, mb->name);
+	} else {
+		copy_mail_dir(path, mb->name);
+	}
+	mb->local = inotify_works(path);
+	if (!mb->local && access(path, F_OK) != 0) {
+		/* the directory is missing, poll until it is back */
+		if (!mb->retry && log_file != NULL) {
+			fprintf(log_file, "Could not watch '%s', errno %d.\n", path, errno);
+		}
+		mb->retry = TRUE;
+	} else {
+		mb->retry = FALSE;
+	}
+	free(path);
+}
+
+/* Watch a mailbox that the check thread found where inotify sees all changes */
+/*   An mbox file is watched with its directory, and a maildir with new/ and cur/ */
+
+static void
+watch_mailbox(struct mailbox *mb)
+{
+	struct stat stat_buf;
+	gboolean was_retry;
+	char *path;
+
+	was_retry = mb->retry;
+	mb->watched = (mb->imap != NULL);
+	mb->retry = FALSE;
+	if (inotify_fd == -1 || mb->imap != NULL || !mb->local) {
+		/* the server pushes the changes to an IMAP mailbox */
+		return;
+	}
+	path = malloc(strlen(mb->name) + 8);
+	if (path == NULL) {
+		return;
+	}
+
+	if (stat_mailbox(mb->name, &stat_buf, TRUE) == 0 && S_ISDIR(stat_buf.st_mode)) {
+		sprintf(path, "%s/new", mb->name);
+		mb->new_wd = inotify_add_watch(inotify_fd, path, WATCH_DIR_EVENTS);
+		if (mb->new_wd != -1) {
+			sprintf(path, "%s/cur", mb->name);
+			mb->cur_wd = inotify_add_watch(inotify_fd, path, WATCH_DIR_EVENTS);
+		}
+		mb->watched = (mb->new_wd != -1 && mb->cur_wd != -1);
+	} else {
+		copy_mail_dir(path, mb->name);
+		mb->dir_wd = inotify_add_watch(inotify_fd, path, WATCH_DIR_EVENTS);
+		mb->watched = (mb->dir_wd != -1);
+		if (mb->watched) {
+			watch_mail_file(mb);
+		}
+	}
+
+	if (mb->watched) {
+		/* events before the watches were added were missed */
+		mb->maildir.valid = FALSE;
+		mb->dirty = TRUE;
+	} else if (access(path, F_OK) != 0) {
+		/* the directory is missing, poll until it is back */
+		if (!was_retry && log_file != NULL) {
+			fprintf(log_file, "Could not watch '%s', errno %d.\n", path, errno);
+		}
+		mb->retry = TRUE;
+	}
+	free(path);
+}
+
+/* Return TRUE if a file name is a dotlock, of a known mail file or one not there yet */
+
+static gboolean
+is_lock_name(const char *name)
+{
+	enum lock_name_enum { LOCK_SUFFIX_LEN = 5 };	/* strlen(".lock") */
+	size_t len;
+
+	len = strlen(name);
+	return (len > LOCK_SUFFIX_LEN && strcmp(name + len - LOCK_SUFFIX_LEN, ".lock") == 0);
+}
+
+/* Return TRUE if a path in a folder directory is an mbox file or a maildir */
+/*   An mbox file is empty or starts with "From ", but an empty name.lock */
+/*   is the dotlock of a delivery */
+
+static gboolean
+is_mailbox_path(const char *path, unsigned char d_type)
+{
+	struct stat stat_buf;
+	char head[ MBOX_SEPARATOR_LEN - 1 ];
+	const char *slash;
+	char *cur_name;
+	ssize_t got;
+	int fd;
+
+	slash = strrchr(path, '/');
+	if (is_lock_name(slash != NULL? slash + 1: path)) {
+		return FALSE;
+	}
+
+	if (d_type == DT_UNKNOWN || d_type == DT_LNK) {
+		if (stat_mailbox(path, &stat_buf, TRUE) != 0) {
+			return FALSE;
+		}
+		d_type = (S_ISDIR(stat_buf.st_mode)? DT_DIR: S_ISREG(stat_buf.st_mode)? DT_REG: DT_UNKNOWN);
+	}
+
+	if (d_type == DT_DIR) {
+		cur_name = malloc(strlen(path) + 5);
+		if (cur_name == NULL) {
+			return FALSE;
+		}
+		sprintf(cur_name, "%s/cur", path);
+		got = access(cur_name, F_OK);
+		free(cur_name);
+		return (got == 0);
+	}
+	if (d_type != DT_REG) {
+		return FALSE;
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return FALSE;
+	}
+	got = read(fd, head, sizeof(head));
+	close(fd);
+	return (got == 0 || (got == (ssize_t) sizeof(head) && memcmp(head, "From ", sizeof(head)) == 0));
+}
+
+/* Add an entry of a folder directory if it is a new mailbox */
+/*   Returns TRUE if a mailbox was added */
+
+static gboolean
+add_folder_entry(int folder, const char *entry, unsigned char d_type)
+{
+	struct mailbox *mb;
+	gboolean added;
+	char *path;
+
+	if (entry[0] == '.') {
+		return FALSE;
+	}
+	path = malloc(strlen(folders[ folder ].name) + strlen(entry) + 2);
+	if (path == NULL) {
+		return FALSE;
+	}
+	sprintf(path, "%s/%s", folders[ folder ].name, entry);
+
+	added = FALSE;
+	if (find_mailbox(path) == NULL && is_mailbox_path(path, d_type)) {
+		mb = add_mailbox(path);
+		if (mb != NULL) {
+			/* the check thread finds whether inotify can watch it */
+			mb->probe = (inotify_fd != -1);
+			mb->in_folder = TRUE;
+			added = TRUE;
+			if (debug && log_file != NULL) {
+				fprintf(log_file, "Added mailbox '%s'.\n", mb->name);
+			}
+		}
+	}
+	free(path);
+	return added;
+}
+
+/* Find the mailboxes in a folder copy of a check */
+/*   Runs in the check thread, and the main loop adds the ones not listed yet */
+
+static void
+scan_folder(struct check_job *job, int folder)
+{
+	struct found_mailbox *found;
+	struct dirent *de;
+	const char *folder_name;
+	char *path;
+	DIR *dir;
+	int max_found;
+
+	folder_name = job->folders[ folder ].name;
+	dir = opendir(folder_name);
+	if (dir == NULL) {
+		return;
+	}
+	job->folders[ folder ].scanned = TRUE;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+		path = malloc(strlen(folder_name) + strlen(de->d_name) + 2);
+		if (path == NULL) {
+			break;
+		}
+		sprintf(path, "%s/%s", folder_name, de->d_name);
+		if (!is_mailbox_path(path, de->d_type)) {
+			free(path);
+			continue;
+		}
+		if (job->num_found >= job->max_found) {
+			max_found = (job->max_found > 0? 2 * job->max_found: MIN_MAILBOXES);
+			found = realloc(job->found, max_found * sizeof(*found));
+			if (found == NULL) {
+				free(path);
+				break;
+			}
+			job->found = found;
+			job->max_found = max_found;
+		}
+		job->found[ job->num_found ].name = path;
+		job->found[ job->num_found ].folder = folder;
+		job->num_found++;
+	}
+	closedir(dir);
+}
+
+/* Drop the mailboxes found in a folder whose file or maildir is gone */
+/*   Runs in the main loop after a scan of the folder read the directory */
+
+static void
+drop_gone_mailboxes(const char *folder_name)
+{
+	struct mailbox *mb;
+	int dropped;
+	int i;
+
+	dropped = 0;
+	i = 0;
+	while (i < num_mailboxes) {
+		mb = &mailboxes[i];
+		if (!mb->in_folder || !mb->missing || mb->busy || !is_in_folder(mb->name, folder_name)) {
+			i++;
+			continue;
+		}
+		if (debug && log_file != NULL) {
+			fprintf(log_file, "Dropped mailbox '%s'.\n", mb->name);
+		}
+		/* the directory watch is shared with the other mbox files in it */
+		if (inotify_fd != -1) {
+			if (mb->file_wd != -1) {
+				inotify_rm_watch(inotify_fd, mb->file_wd);
+			}
+			if (mb->new_wd != -1) {
+				inotify_rm_watch(inotify_fd, mb->new_wd);
+			}
+			if (mb->cur_wd != -1) {
+				inotify_rm_watch(inotify_fd, mb->cur_wd);
+			}
+		}
+		free(mb->name);
+		free(mb->mbox.messages);
+		memmove(mb, mb + 1, (num_mailboxes - i - 1) * sizeof(*mb));
+		num_mailboxes--;
+		dropped++;
+	}
+	if (dropped > 0) {
+		note_poll_change();
+		if (log_file != NULL) {
+			fprintf(log_file, "Dropped %d mailboxes from folder '%s'.\n", dropped, folder_name);
+		}
+	}
+}
+
+/* Add a folder directory from the setup file */
+
+static void
+add_folder(const char *name)
+{
+	struct mailbox *mb;
+	char *str;
+	int len;
+	int i;
+
+	if (num_folders >= MAX_FOLDERS) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Too many folder directories, ignoring '%s'.\n", name);
+		}
+		return;
+	}
+	str = strdup(name);
+	if (str == NULL) {
+		return;
+	}
+	len = strlen(str);
+	while (len > 1 && str[ len - 1 ] == '/') {
+		str[ --len ] = '\0';
+	}
+	folders[ num_folders ].name = str;
+	folders[ num_folders ].wd = -1;
+	folders[ num_folders ].probe = FALSE;
+	folders[ num_folders ].local = FALSE;
+	num_folders++;
+
+	/* keep the mailboxes found in it before, the check thread looks for new ones */
+	for (i = 0; i < num_old_mailboxes; i++) {
+		if (old_mailboxes[i].name != NULL && is_in_folder(old_mailboxes[i].name, str)) {
+			mb = add_mailbox(old_mailboxes[i].name);
+			if (mb != NULL) {
+				mb->in_folder = TRUE;
+			}
+		}
+	}
+	folders_dirty = TRUE;
+	if (log_file != NULL) {
+		fprintf(log_file, "Added folder '%s'.\n", str);
+	}
+}
+
+/* Stop watching the mailboxes */
+
+static void
+stop_inotify()
+{
+	int i;
+
+	if (inotify_watch != 0) {
+		g_source_remove(inotify_watch);
+		inotify_watch = 0;
+	}
+	if (inotify_fd != -1) {
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+	for (i = 0; i < num_mailboxes; i++) {
+		mailboxes[i].dir_wd = -1;
+		mailboxes[i].file_wd = -1;
+		mailboxes[i].new_wd = -1;
+		mailboxes[i].cur_wd = -1;
+		mailboxes[i].watched = (mailboxes[i].imap != NULL);
+		mailboxes[i].probe = FALSE;
+		mailboxes[i].local = FALSE;
+		mailboxes[i].retry = FALSE;
+	}
+	for (i = 0; i < num_folders; i++) {
+		folders[i].wd = -1;
+		folders[i].probe = FALSE;
+		folders[i].local = FALSE;
+	}
+}
+
+/* Return TRUE if a file name is the dotlock of a mail file */
+
+static gboolean
+is_dotlock_name(const char *name, const char *mail_name)
+{
+	size_t len;
+
+	len = strlen(mail_name);
+	return (strncmp(name, mail_name, len) == 0 && strcmp(name + len, ".lock") == 0);
+}
+
+/* Apply an inotify event to the mailbox it belongs to */
+/*   Returns TRUE if a mailbox needs to be checked */
+
+static gboolean
+mailbox_event(const struct inotify_event *event)
+{
+	struct mailbox *mb;
+	int i;
+
+	for (i = 0; i < num_mailboxes; i++) {
+		mb = &mailboxes[i];
+		if (event->wd == mb->new_wd || event->wd == mb->cur_wd) {
+			if (event->mask & IN_IGNORED) {
+				/* the maildir went away, poll until it is back */
+				if (event->wd == mb->new_wd && mb->cur_wd != -1) {
+					inotify_rm_watch(inotify_fd, mb->cur_wd);
+				} else if (event->wd == mb->cur_wd && mb->new_wd != -1) {
+					inotify_rm_watch(inotify_fd, mb->new_wd);
+				}
+				mb->new_wd = -1;
+				mb->cur_wd = -1;
+				mb->watched = FALSE;
+				mb->retry = TRUE;
+			} else if (event->len > 0) {
+				maildir_event(&mb->maildir, mb->name, event->wd == mb->cur_wd, event->mask, event->name);
+			}
+			mb->dirty = TRUE;
+			return TRUE;
+		} else if (event->wd == mb->dir_wd) {
+			/* mbox files in one directory share its watch */
+			if (event->len > 0 && strcmp(event->name, mb->short_name) == 0) {
+				if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+					watch_mailbox(mb);
+				}
+				mb->dirty = TRUE;
+				return TRUE;
+			}
+			if (event->len > 0 && mb->lock_start != 0 && (event->mask & (IN_DELETE | IN_MOVED_FROM)) &&
+			    is_dotlock_name(event->name, mb->short_name)) {
+				/* the delivery is done */
+				mb->dirty = TRUE;
+				return TRUE;
+			}
+		} else if (event->wd == mb->file_wd) {
+			if (mb->lock_start != 0 && (event->mask & ~IN_CLOSE_NOWRITE) == 0) {
+				/* the lock probe closing the file, a writer closes it with IN_CLOSE_WRITE */
+				return FALSE;
+			}
+			if (event->mask & IN_MOVE_SELF) {
+				inotify_rm_watch(inotify_fd, mb->file_wd);
+				mb->file_wd = -1;
+			} else if (event->mask & IN_IGNORED) {
+				mb->file_wd = -1;
+			}
+			mb->dirty = TRUE;
+			return TRUE;
+		}
+	}
+
+	/* a new mbox file or maildir in a folder directory */
+	if (event->len > 0 && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+		for (i = 0; i < num_folders; i++) {
+			if (event->wd == folders[i].wd && add_folder_entry(i, event->name, DT_UNKNOWN)) {
+				/* everything in it is new mail */
+				mailboxes[ num_mailboxes - 1 ].checked = TRUE;
+				return TRUE;
+			}
+		}
+	}
+	return FALSE;
+}
+
+/* Handle inotify events */
+/*   Read every queued event, then check the changed mailboxes once */
+
+static gboolean
+on_inotify(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	enum inotify_enum { EVENT_BUF_LEN = 4096 };
+	char buf[ EVENT_BUF_LEN ] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	gboolean changed;
+	ssize_t len;
+	char *p;
+	int i;
 
-static int interval = 0;		/* time between mail checks */
-static int debug = 0;			/* enable debug messages to the log file */
-static char *home_dir = NULL;		/* user's home directory */
-static FILE *log_file = NULL;		/* file for log messages */
-static char *mail_name = NULL;		/* name of the mail spool file */
-static char *sound_name = NULL;		/* name of the sound file for new messages */
-static int do_beep = 0;			/* beep on new messages */
-static off_t last_size = 0;		/* last size of the mail spool file */
-static time_t last_mtime = 0;		/* last modification time of the mail spool file */
-static char *setup_name = NULL;		/* name of the config file */
-static gint timer_handle = 0;		/* handle to change the mate timer */
+	changed = FALSE;
 
-enum mail_state_enum {
-	INIT_MAIL = 0,	/* nothing displayed yet */
-	NO_MAIL,	/* mailbox is empty */
-	OLD_MAIL,	/* mailbox has read mail */
-	UNREAD_MAIL,	/* mailbox has unread mail */
-	NEW_MAIL,	/* mailbox has new mail since the last check */
-	NUM_MAIL_STATES
-};
+	for (;;) {
+		len = read(inotify_fd, buf, EVENT_BUF_LEN);
+		if (len <= 0) {
+			if (len < 0 && errno != EAGAIN && errno != EINTR) {
+				if (log_file != NULL) {
+					fprintf(log_file, "inotify read failed, errno %d, polling every %d seconds.\n", errno, interval);
+				}
+				inotify_watch = 0;
+				stop_inotify();
+				reset_timer(GTK_WIDGET(data));
+				return FALSE;
+			}
+			break;
+		}
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *) p;
+			if (event->mask & IN_Q_OVERFLOW) {
+				/* events were lost, check everything */
+				for (i = 0; i < num_mailboxes; i++) {
+					mailboxes[i].dirty = TRUE;
+					mailboxes[i].maildir.valid = FALSE;
+				}
+				changed = TRUE;
+			} else if (mailbox_event(event)) {
+				changed = TRUE;
+			}
+			if (debug > 1 && log_file != NULL) {
+				fprintf(log_file, "inotify wd %d mask 0x%x name '%s'\n", event->wd, event->mask, (event->len > 0? event->name: ""));
+			}
+		}
+	}
 
-static const char *mail_state_name[ NUM_MAIL_STATES ] =
-	{ NULL, "No mail", "Mail", "New mail", NULL };
+	if (changed) {
+		open_window(GTK_EVENT_BOX(data));
+		/* a maildir may have lost its watch */
+		reset_timer(GTK_WIDGET(data));
+	}
+	return TRUE;
+}
 
-/* Return a time stamp */
+/* Start watching the mailboxes and folder directories */
+/*   Returns TRUE if inotify started.  The check thread finds which mailboxes */
+/*   and folders it can watch, and the rest are polled. */
 
-static char *show_time(void)
+static gboolean
+start_inotify(GtkEventBox *event_box)
 {
-	enum time_buf_enum { TIME_BUF_LEN = 100 };
-	static char buf[ TIME_BUF_LEN ];
-	struct tm *tm_ptr;
-	time_t time_val;
+	GIOChannel *channel;
+	int i;
 
-	time_val = time(NULL);
-	tm_ptr = localtime(&time_val);
+	stop_inotify();
 
-	buf[0] = '\0';
+	if (!do_watch || num_mailboxes == 0) {
+		return FALSE;
+	}
 
-	strftime(buf, TIME_BUF_LEN, "%e %b %Y %H:%M:%S", tm_ptr);
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd == -1) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Could not start inotify, errno %d.\n", errno);
+		}
+		return FALSE;
+	}
 
-	buf[ TIME_BUF_LEN - 1 ] = '\0';
+	for (i = 0; i < num_folders; i++) {
+		folders[i].probe = TRUE;
+	}
+	for (i = 0; i < num_mailboxes; i++) {
+		watch_mailbox(&mailboxes[i]);
+		if (mailboxes[i].imap == NULL) {
+			mailboxes[i].probe = TRUE;
+			mailboxes[i].dirty = TRUE;
+		}
+	}
 
-	return buf;
+	channel = g_io_channel_unix_new(inotify_fd);
+	inotify_watch = g_io_add_watch(channel, G_IO_IN, on_inotify, event_box);
+	g_io_channel_unref(channel);
+
+	return TRUE;
 }
 
-/* Exit after a serious error */
+/* Return TRUE if the timer has to poll some mailboxes */
 
-static void
-exit_mailcheck(void)
+static gboolean
+is_polling()
 {
-	if (log_file != NULL) {
-		fprintf(log_file, "Exiting at %s.\n", show_time());
-		fclose(log_file);
-		log_file = NULL;
-	}
+	int i;
 
-	exit(1);
+	if (inotify_fd == -1) {
+		return TRUE;
+	}
+	for (i = 0; i < num_mailboxes; i++) {
+		if (!mailboxes[i].watched) {
+			return TRUE;
+		}
+	}
+	return FALSE;
 }
 
-/* Find the current state of the mail spool file */
+/* Return the time between timed checks */
+/*   The timer is only a safety net while inotify watches every mailbox */
 
-static enum mail_state_enum
-check_mail_state()
+static int
+check_interval()
 {
-	enum mail_state_enum result;
-	struct stat stat_buf;
-
-	if (!mail_name) {
-		exit_mailcheck();
-	}
+	return (is_polling()? poll_interval: safety_interval);
+}
 
-	result = NO_MAIL;
+/* Back off the polling while nothing changes */
+/*   The time between checks doubles after each check that found no change, */
+/*   up to max_interval, and goes back to interval after a change or a click */
 
-	if (stat(mail_name, &stat_buf) != 0) {
-		/* mail file does not exist, so there is no mail */
-		last_size = 0;
-		last_mtime = 0;
-	} else if (stat_buf.st_size > 0) {
-		if (stat_buf.st_size != last_size || stat_buf.st_mtime != last_mtime) {
-			result = NEW_MAIL;
-		} else {
-			result = (stat_buf.st_mtime >= stat_buf.st_atime? UNREAD_MAIL: OLD_MAIL);
-		}
-		last_size = stat_buf.st_size;
-		last_mtime = stat_buf.st_mtime;
-	}
-	if (debug && log_file != NULL) {
-		fprintf(log_file, "%s size %ld time %ld result %d\n", mail_name, (long)last_size, (long)last_mtime, result);
-		fflush(log_file);
+static void
+adapt_poll_interval()
+{
+	if (!is_polling() || poll_changed) {
+		poll_interval = interval;
+	} else if (poll_interval < max_interval) {
+		poll_interval = (poll_interval < max_interval / 2? 2 * poll_interval: max_interval);
 	}
-	return result;
+	poll_changed = FALSE;
 }
 
 /* Read the setup file */
@@ -130,6 +4246,7 @@ check_mail_state()
 static void
 read_setup_file()
 {
+	struct mailbox *mb;
 	FILE *setup_file;
 	enum setup_enum { ID_LEN = 50, BUF_LEN = 1024 };
 	char id[ ID_LEN ];
@@ -137,6 +4254,7 @@ read_setup_file()
 	int len;
 	int ch;
 	char *str;
+	int i;
 
 	setup_file = fopen(setup_name, "r");
 
@@ -144,9 +4262,15 @@ read_setup_file()
 		if (log_file != NULL) {
 			fprintf(log_file, "Could not open setup file %s.\n", setup_name);
 		}
+		if (num_mailboxes == 0) {
+			begin_mailboxes();
+			end_mailboxes();
+		}
 		return;
 	}
 
+	begin_mailboxes();
+
 	ch = fgetc(setup_file);
 
 	while (ch != EOF) {
@@ -178,14 +4302,20 @@ read_setup_file()
 			if (len == 0) {
 				if (log_file != NULL)
 					fprintf(log_file, "Setup file '%s' has 'mail' without file name.\n", setup_name);
+			} else if ((mb = add_mailbox(buf)) != NULL) {
+				/* a listed mailbox stays when its file is gone */
+				mb->in_folder = FALSE;
+				if (log_file != NULL)
+					fprintf(log_file, "Add 'mail' '%s'.\n", buf);
+			}
+		} else if (strcmp(id, "imap") == 0) {
+			add_imap_account(buf);
+		} else if (strcmp(id, "folder") == 0) {
+			if (len == 0) {
+				if (log_file != NULL)
+					fprintf(log_file, "Setup file '%s' has 'folder' without directory name.\n", setup_name);
 			} else {
-				str = strdup(buf);
-				if (str != NULL) {
-					free(mail_name);
-					mail_name = str;
-					if (log_file != NULL)
-						fprintf(log_file, "Set 'mail' to '%s'.\n", mail_name);
-				}
+				add_folder(buf);
 			}
 		} else if (strcmp(id, "sound") == 0) {
 			int i;
@@ -235,6 +4365,70 @@ read_setup_file()
 				if (interval > 1000) interval = 1000;
 				if (log_file != NULL) fprintf(log_file, "Set 'interval' to %d seconds.\n", interval);
 			}
+		} else if (strcmp(id, "maxinterval") == 0) {
+			if (len == 0 || !isdigit(buf[0])) {
+				if (log_file != NULL)
+					fprintf(log_file, "Setup file '%s' has 'maxinterval' without numeric value.\n", setup_name);
+			} else {
+				max_interval = atoi(buf);
+				if (max_interval < 1) max_interval = 1;
+				if (max_interval > 86400) max_interval = 86400;
+				if (log_file != NULL) fprintf(log_file, "Set 'maxinterval' to %d seconds.\n", max_interval);
+			}
+		} else if (strcmp(id, "watch") == 0) {
+			do_watch =
+				((len == 0 ||
+				  (isdigit(buf[0]) && atoi(buf) > 0) ||
+				  (buf[0] == 'y' || buf[0] == 't'))? 1: 0);
+			if (log_file != NULL)
+				fprintf(log_file, "Set 'watch' to %d.\n", do_watch);
+		} else if (strcmp(id, "safetyinterval") == 0) {
+			if (len == 0 || !isdigit(buf[0])) {
+				if (log_file != NULL)
+					fprintf(log_file, "Setup file '%s' has 'safetyinterval' without numeric value.\n", setup_name);
+			} else {
+				safety_interval = atoi(buf);
+				if (safety_interval < 1) safety_interval = 1;
+				if (safety_interval > 86400) safety_interval = 86400;
+				if (log_file != NULL) fprintf(log_file, "Set 'safetyinterval' to %d seconds.\n", safety_interval);
+			}
+		} else if (strcmp(id, "deadline") == 0) {
+			if (len == 0 || !isdigit(buf[0])) {
+				if (log_file != NULL)
+					fprintf(log_file, "Setup file '%s' has 'deadline' without numeric value.\n", setup_name);
+			} else {
+				deadline = atoi(buf);
+				if (deadline < 1) deadline = 1;
+				if (deadline > 1000) deadline = 1000;
+				if (log_file != NULL) fprintf(log_file, "Set 'deadline' to %d seconds.\n", deadline);
+			}
+		} else if (strcmp(id, "settle") == 0) {
+			if (len == 0 || !isdigit(buf[0])) {
+				if (log_file != NULL)
+					fprintf(log_file, "Setup file '%s' has 'settle' without numeric value.\n", setup_name);
+			} else {
+				settle_time = atoi(buf);
+				if (settle_time > 600) settle_time = 600;
+				if (log_file != NULL) fprintf(log_file, "Set 'settle' to %d seconds.\n", settle_time);
+			}
+		} else if (strcmp(id, "maxdelay") == 0) {
+			if (len == 0 || !isdigit(buf[0])) {
+				if (log_file != NULL)
+					fprintf(log_file, "Setup file '%s' has 'maxdelay' without numeric value.\n", setup_name);
+			} else {
+				max_delay = atoi(buf);
+				if (max_delay > 600) max_delay = 600;
+				if (log_file != NULL) fprintf(log_file, "Set 'maxdelay' to %d seconds.\n", max_delay);
+			}
+		} else if (strcmp(id, "summary") == 0) {
+			if (len == 0 || !isdigit(buf[0])) {
+				if (log_file != NULL)
+					fprintf(log_file, "Setup file '%s' has 'summary' without numeric value.\n", setup_name);
+			} else {
+				show_summaries = atoi(buf);
+				if (show_summaries > MAX_SUMMARIES) show_summaries = MAX_SUMMARIES;
+				if (log_file != NULL) fprintf(log_file, "Set 'summary' to %d messages.\n", show_summaries);
+			}
 		} else if (strcmp(id, "debug") == 0) {
 			if (len == 0 || !isdigit(buf[0])) {
 				if (log_file != NULL)
@@ -251,17 +4445,190 @@ read_setup_file()
 
 	fclose(setup_file);
 
+	end_mailboxes();
+
+	if (max_interval < interval) {
+		max_interval = interval;
+	}
+	poll_interval = interval;
+
 	if (log_file != NULL) {
 		fprintf(log_file, "Read setup file '%s' at %s.\n", setup_name, show_time());
-		fprintf(log_file, " mail '%s'\n", mail_name);
-		fprintf(log_file, " interval %d seconds\n", interval);
+		fprintf(log_file, " %d mailboxes, %d folder directories\n", num_mailboxes, num_folders);
+		for (i = 0; i < num_mailboxes && (debug || i < TOOLTIP_MAILBOXES); i++) {
+			fprintf(log_file, " mail '%s'\n", mailboxes[i].name);
+		}
+		fprintf(log_file, " interval %d seconds, up to %d seconds while nothing changes\n", interval, max_interval);
+		fprintf(log_file, " watch %d, safety interval %d seconds\n", do_watch, safety_interval);
+		fprintf(log_file, " deadline %d seconds\n", deadline);
+		fprintf(log_file, " settle %d seconds, max delay %d seconds\n", settle_time, max_delay);
 		fprintf(log_file, " play sound '%s'\n", (sound_name? sound_name: "<none>"));
 		fprintf(log_file, " beep '%d'\n", do_beep);
+		fprintf(log_file, " summary %d messages\n", show_summaries);
 		fprintf(log_file, " debug level %d\n", debug);
 		fflush(log_file);
 	}
 }
 
+/* Show the busiest mailboxes and the newest messages in the tooltip */
+/*   The summaries are only formatted when the ring changes, */
+/*   and the tooltip is only replaced when its text changes */
+
+static void
+update_tooltip(GtkWidget *widget)
+{
+	enum tooltip_enum { TOOLTIP_LEN = 1024 + SUMMARY_TEXT_LEN };
+	static char last_tooltip[ TOOLTIP_LEN ];
+	static char summary_text[ SUMMARY_TEXT_LEN ];
+	static unsigned last_generation = 0;
+	char tooltip[ TOOLTIP_LEN ];
+	int busiest[ TOOLTIP_MAILBOXES ];
+	int num_busiest;
+	int len;
+	int i;
+	int j;
+
+	if (unread_count == 0) {
+		/* everything was read */
+		clear_summaries();
+	}
+	if (summary_generation != last_generation) {
+		last_generation = summary_generation;
+		format_summaries(summary_text, SUMMARY_TEXT_LEN);
+	} else if (num_mailboxes < 2) {
+		return;
+	}
+
+	/* keep a short list sorted by unread messages */
+	num_busiest = 0;
+	for (i = 0; i < num_mailboxes && num_mailboxes >= 2; i++) {
+		if (mailboxes[i].unread_count == 0) {
+			continue;
+		}
+		for (j = num_busiest; j > 0 && mailboxes[ busiest[ j - 1 ] ].unread_count < mailboxes[i].unread_count; j--) {
+			if (j < TOOLTIP_MAILBOXES) {
+				busiest[j] = busiest[ j - 1 ];
+			}
+		}
+		if (j < TOOLTIP_MAILBOXES) {
+			busiest[j] = i;
+			if (num_busiest < TOOLTIP_MAILBOXES) {
+				num_busiest++;
+			}
+		}
+	}
+
+	len = 0;
+	tooltip[0] = '\0';
+	if (num_mailboxes >= 2) {
+		len = snprintf(tooltip, TOOLTIP_LEN, "%ld unread, %ld new in %d mailboxes",
+			unread_count, new_message_count, num_mailboxes);
+	}
+	for (i = 0; i < num_busiest && len < TOOLTIP_LEN; i++) {
+		len += snprintf(tooltip + len, TOOLTIP_LEN - len, "\n%s: %ld unread, %ld new",
+			mailboxes[ busiest[i] ].short_name, mailboxes[ busiest[i] ].unread_count,
+			mailboxes[ busiest[i] ].new_count);
+	}
+	if (summary_text[0] != '\0' && len < TOOLTIP_LEN) {
+		snprintf(tooltip + len, TOOLTIP_LEN - len, "%s%s", (len > 0? "\n\n": ""), summary_text);
+	}
+
+	if (strcmp(tooltip, last_tooltip) != 0) {
+		strcpy(last_tooltip, tooltip);
+		gtk_widget_set_tooltip_text(widget, (tooltip[0] != '\0'? tooltip: NULL));
+	}
+}
+
+/* Note that a sound player finished */
+
+static void
+on_player_exit(GPid pid, gint status, gpointer data)
+{
+	g_spawn_close_pid(pid);
+	player_pid = 0;
+}
+
+/* Play the new mail sound */
+/*   A sound that would start while the last one is still playing is skipped */
+
+static void
+play_sound()
+{
+	gchar *argv[] = { "play", "-q", sound_name, NULL };
+	GError *error = NULL;
+
+	if (sound_name == NULL) {
+		return;
+	}
+	if (player_pid != 0) {
+		if (debug && log_file != NULL) {
+			fprintf(log_file, "sound player %d is still running\n", (int) player_pid);
+		}
+		return;
+	}
+	if (!g_spawn_async(NULL, argv, NULL,
+			G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+			NULL, NULL, &player_pid, &error)) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Could not play '%s': %s\n", sound_name, (error != NULL? error->message: "unknown error"));
+		}
+		g_clear_error(&error);
+		player_pid = 0;
+		return;
+	}
+	g_child_watch_add(player_pid, on_player_exit, NULL);
+}
+
+/* Notify once that a burst of mail arrived */
+
+static gboolean
+on_burst_settled(gpointer data)
+{
+	GtkWidget *widget = GTK_WIDGET(data);
+
+	if (log_file != NULL) {
+		fprintf(log_file, "New mail, %ld messages in %ld seconds, at %s.\n",
+			burst_count, (long) (time(NULL) - burst_start), show_time());
+		fflush(log_file);
+	}
+	if (do_beep) {
+		XBell( GDK_DISPLAY_XDISPLAY( gtk_widget_get_display( widget ) ), 0 );
+	}
+	play_sound();
+
+	burst_timer = 0;
+	burst_count = 0;
+	return FALSE;
+}
+
+/* Add arrivals to the current burst */
+/*   The notification waits until no mail arrived for settle_time seconds, */
+/*   but no more than max_delay seconds after the first arrival */
+
+static void
+add_to_burst(GtkEventBox *event_box, long arrived)
+{
+	time_t now;
+	long wait;
+
+	now = time(NULL);
+	if (burst_timer == 0) {
+		burst_start = now;
+	} else {
+		g_source_remove(burst_timer);
+	}
+	burst_count += arrived;
+
+	wait = settle_time;
+	if (now + wait > burst_start + max_delay) {
+		wait = burst_start + max_delay - now;
+	}
+	if (wait < 0) {
+		wait = 0;
+	}
+	burst_timer = g_timeout_add(wait * 1000, on_burst_settled, event_box);
+}
+
 /* Update the status displayed in the panel */
 
 static gboolean
@@ -269,9 +4636,20 @@ open_window (GtkEventBox *event_box)
 {
 	static GtkWidget *last_label = NULL;
 	static enum mail_state_enum last_mail_state = INIT_MAIL;
+	static long last_count = 0;
+	static long last_new_count = 0;
 	enum mail_state_enum mail_state;
+	enum label_enum { LABEL_LEN = 64 };
+	char label[ LABEL_LEN ];
+	long count;
 
-	mail_state = check_mail_state();
+	mail_state = check_mail_state(event_box);
+	if (mail_state != NEW_MAIL && is_check_slow()) {
+		mail_state = SLOW_MAIL;
+	}
+
+	/* unread messages, otherwise all messages */
+	count = (mail_state == OLD_MAIL? message_count: unread_count);
 
 	if (debug && log_file != NULL) {
 		fprintf(log_file, "old state %d %s new state %d %s at %s\n",
@@ -280,7 +4658,9 @@ open_window (GtkEventBox *event_box)
 			show_time());
 	}
 
-	if (mail_state != last_mail_state) {
+	update_tooltip(GTK_WIDGET(event_box));
+
+	if (mail_state != last_mail_state || count != last_count || new_message_count != last_new_count) {
 		if (last_label != NULL) {
 			gtk_container_remove (GTK_CONTAINER (event_box), last_label);
 			if (debug && log_file != NULL) {
@@ -288,27 +4668,29 @@ open_window (GtkEventBox *event_box)
 			}
 		}
 
-		if (mail_state == NEW_MAIL || (mail_state > NO_MAIL && last_mail_state == INIT_MAIL)) {
+		if (mail_state == NEW_MAIL ||
+		    (mail_state > NO_MAIL && mail_state != SLOW_MAIL && last_mail_state == INIT_MAIL && !checkpoint_loaded)) {
 			if (debug && log_file != NULL) {
 				fprintf(log_file, "new mail\n");
 			}
 			mail_state = UNREAD_MAIL;
-			if (do_beep) {
-				XBell( GDK_DISPLAY_XDISPLAY( gtk_widget_get_display( GTK_WIDGET( event_box ) ) ), 0 );
-			}
-			if (sound_name != NULL) {
-				char *cmd;
-				cmd = malloc(strlen(sound_name) + 20);
-				if (cmd != NULL) {
-					sprintf(cmd, "play -q '%s' &", sound_name);
-					system(cmd);
-					free(cmd);
-				}
-			}
+			add_to_burst(event_box, (arrived_count > 0? arrived_count: 1));
 		}
 
 		last_mail_state = mail_state;
-		last_label = (mail_state_name[ mail_state ]? gtk_label_new (mail_state_name[ mail_state ]): NULL);
+		last_count = count;
+		last_new_count = new_message_count;
+		last_label = NULL;
+		if (mail_state_name[ mail_state ] != NULL) {
+			if (mail_state == UNREAD_MAIL && new_message_count > 0 && new_message_count != count) {
+				snprintf(label, LABEL_LEN, "%s (%ld, %ld new)", mail_state_name[ mail_state ], count, new_message_count);
+			} else if (count > 0 && mail_state > NO_MAIL) {
+				snprintf(label, LABEL_LEN, "%s (%ld)", mail_state_name[ mail_state ], count);
+			} else {
+				snprintf(label, LABEL_LEN, "%s", mail_state_name[ mail_state ]);
+			}
+			last_label = gtk_label_new (label);
+		}
 
 		if (last_label != NULL) {
 			gtk_container_add (GTK_CONTAINER (event_box), last_label);
@@ -351,6 +4733,28 @@ open_window (GtkEventBox *event_box)
 
 static gint on_timer (gpointer data);
 
+/* Restart the timer if the time between checks changed */
+/*   Returns TRUE if the timer was replaced */
+
+static gboolean
+reset_timer(GtkWidget *event_box)
+{
+	int last_interval;
+
+	if (check_interval() == timer_interval) {
+		return FALSE;
+	}
+	last_interval = timer_interval;
+	timer_interval = check_interval();
+	g_source_remove(timer_handle);
+	timer_handle = g_timeout_add (timer_interval * 1000, on_timer, event_box);
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "Resetting timer from %d to %d seconds, %d wakeups per hour.\n",
+			last_interval, timer_interval, 3600 / timer_interval);
+	}
+	return TRUE;
+}
+
 /* Handle a left click on the panel */
 /*   Reload the setup file and update the panel */
 
@@ -359,25 +4763,22 @@ on_button_press (GtkWidget      *event_box,
 		GdkEventButton  *event,
 		gpointer	 data)
 {
-	int last_interval;
-
 	/* Don't react to anything other than the left mouse button;
 	   return FALSE so the event is passed to the default handler */
 
 	if (event->button != 1)
 		return FALSE;
 
-	last_interval = interval;
-
 	read_setup_file();
 
-	if (interval != last_interval) {
-		g_source_remove(timer_handle);
-		timer_handle = g_timeout_add (interval * 1000, on_timer, event_box);
-		if (debug && log_file != NULL) {
-			fprintf(log_file, "Resetting timer from %d to %d seconds.\n", last_interval, interval);
-		}
-	}
+	start_inotify(GTK_EVENT_BOX(event_box));
+
+	start_imap(GTK_EVENT_BOX(event_box));
+
+	/* stop backing off */
+	poll_interval = interval;
+
+	reset_timer(event_box);
 
 	return open_window( GTK_EVENT_BOX(event_box) );
 }
@@ -388,7 +4789,47 @@ on_button_press (GtkWidget      *event_box,
 static gint
 on_timer (gpointer data)
 {
-	return open_window(data);
+	struct mailbox *mb;
+	gboolean full;
+	time_t now;
+	int i;
+
+	/* check everything when inotify is not watching or the safety interval passed */
+	now = time(NULL);
+	full = (!is_polling() || now - last_full_check >= safety_interval);
+
+	timer_wakeups++;
+	if (now - wakeup_start >= 3600) {
+		if (debug && log_file != NULL && wakeup_start != 0) {
+			fprintf(log_file, "%d timer wakeups in the last hour, checking every %d seconds at %s.\n",
+				timer_wakeups, timer_interval, show_time());
+			fflush(log_file);
+		}
+		timer_wakeups = 0;
+		wakeup_start = now;
+	}
+	if (full) {
+		last_full_check = now;
+		folders_dirty = TRUE;
+	}
+	for (i = 0; i < num_mailboxes; i++) {
+		mb = &mailboxes[i];
+		if (mb->retry) {
+			/* the directory was missing, probe it again in the thread */
+			mb->probe = TRUE;
+		}
+		if (full || !mb->watched) {
+			mb->dirty = TRUE;
+		}
+		if (full) {
+			/* recount a maildir in case an event was missed */
+			mb->maildir.valid = FALSE;
+		}
+	}
+	open_window(data);
+	adapt_poll_interval();
+	/* inotify may have started or stopped */
+	return !reset_timer(GTK_WIDGET(data));
 }
 
 /* Main entry point of the applet */
@@ -412,6 +4853,20 @@ mailcheck_applet_fill (MatePanelApplet *applet,
 
 	interval = DEFAULT_INTERVAL;
 
+	max_interval = DEFAULT_MAX_INTERVAL;
+
+	poll_interval = interval;
+
+	safety_interval = DEFAULT_SAFETY_INTERVAL;
+
+	show_summaries = DEFAULT_SUMMARIES;
+
+	deadline = DEFAULT_DEADLINE;
+
+	settle_time = DEFAULT_SETTLE;
+
+	max_delay = DEFAULT_MAX_DELAY;
+
 	home_dir = getenv("HOME");
 	if (home_dir == NULL) {
 		home_dir = "/tmp";
@@ -442,6 +4897,14 @@ mailcheck_applet_fill (MatePanelApplet *applet,
 
 	sprintf(setup_name, "%s/.%src", home_dir, BASE_NAME);
 
+	state_name = malloc(setup_len + 6);
+	if (!state_name) {
+		fprintf(log_file, "Could not allocate checkpoint name.\n");
+		exit_mailcheck();
+	}
+
+	sprintf(state_name, "%s/.%s.state", home_dir, BASE_NAME);
+
 	mail_name = getenv("MAIL");
 	if (mail_name != NULL) mail_name = strdup(mail_name);
 
@@ -461,17 +4924,30 @@ mailcheck_applet_fill (MatePanelApplet *applet,
 
 	read_setup_file();
 
-	if (!mail_name) {
+	if (num_mailboxes == 0) {
 		fprintf(log_file, "You must set MAIL to your mail file.\n");
 		exit_mailcheck();
 	}
 
+	load_checkpoint();
+
 	free(log_name);
 	log_name = NULL;
 
 	event_box = (GtkEventBox *) gtk_event_box_new ();
 
+	/* the first check finds which mailboxes inotify can watch */
+	if (start_inotify(event_box)) {
+		fprintf(log_file, "Started inotify for %d mailboxes, checking every %d seconds.\n", num_mailboxes, check_interval());
+	} else {
+		fprintf(log_file, "Checking %d mailboxes every %d seconds.\n", num_mailboxes, interval);
+	}
+	last_full_check = time(NULL);
+
+	start_imap(event_box);
+
 	open_window(event_box);
+	fflush(log_file);
 
 	gtk_container_add (GTK_CONTAINER (applet), GTK_WIDGET (event_box) );
 	gtk_widget_show_all (GTK_WIDGET (applet));
@@ -481,12 +4957,17 @@ mailcheck_applet_fill (MatePanelApplet *applet,
 			G_CALLBACK (on_button_press),
 			NULL);
 
-	timer_handle = g_timeout_add (interval * 1000, on_timer, event_box);
+	timer_interval = check_interval();
+	timer_handle = g_timeout_add (timer_interval * 1000, on_timer, event_box);
 
 	return TRUE;
 }
 
 /* Factory to interface with the server */
+/*   mailcheck_bench.c and mailcheck_imaptest.c include this file with MAILCHECK_BENCH */
+/*   or MAILCHECK_IMAPTEST and have their own main */
+
+#if !defined(MAILCHECK_BENCH) && !defined(MAILCHECK_IMAPTEST)
 
 #if 1
 
@@ -523,3 +5004,11 @@ MATE_PANEL_APPLET_MATECOMPONENT_FACTORY ("OAFIID:MailCheck_Factory",
 			     NULL);
 
 #endif
+
+#else
+
+/* the test programs have no factory to call the fill function */
+
+static gboolean mailcheck_applet_fill (MatePanelApplet *applet, const gchar *iid, gpointer data) G_GNUC_UNUSED;
+
+#endif
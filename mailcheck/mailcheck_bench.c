@@ -0,0 +1,540 @@
+/* mailcheck_bench -- time the mailcheck scans on a large synthetic mbox
+ *
+ * make bench
+ * make bench BENCH_ARGS="-n 400000 -s 16384"	(about 6.5 GB)
+ *
+ * Writes a synthetic mbox file, then calls check_mail_state() without a panel for
+ *	a cold full scan, with the file dropped from the page cache
+ *	a warm full scan
+ *	appends of 1, 100, and 10000 messages
+ *	a truncate and rewrite, as a mail reader does when it expunges
+ * and prints the times as JSON, with MB/s and the system calls made during each check.
+ *
+ * The system calls are counted by a parent process that traces the benchmark with ptrace,
+ * so the count has every call the kernel sees, including the stdio of the log and checkpoint
+ * and the calls inside libc.  Each traced call stops the benchmark twice, which adds a few
+ * microseconds per call to the times.  Where ptrace is not allowed, the count is null.
+ *
+ * Options
+ *	-n messages	messages in the mbox file, default 20000
+ *	-s bytes	mean message size, default 8192, sizes are log-normal
+ *	-m percent	messages with a MIME attachment, default 20
+ *	-q percent	messages with body lines starting "From ", quoted as ">From ", default 5
+ *	-c percent	messages with a Content-Length: header and unquoted "From " lines, default 0
+ *	-u percent	unread messages, default 10
+ *	-r seed		random seed, default 1
+ *	-o file		mbox file, default /tmp/mailcheck_bench.mbox
+ *	-g		only write the mbox file
+ *	-k		keep the mbox file
+ *
+ * 19Oct26 wb initial version
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/unistd.h>
+#include <sys/resource.h>
+#include <sys/ptrace.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#define	MAILCHECK_BENCH
+
+#include "mailcheck.c"
+
+#define	DEFAULT_BENCH_FILE	"/tmp/mailcheck_bench.mbox"
+
+/* Signal that turns the counting of system calls on and off */
+#define	COUNT_SIGNAL		SIGUSR2
+
+enum bench_enum {
+	LINE_LEN = 72,			/* text line length */
+	BASE64_LINE_LEN = 76,
+	MIN_MESSAGE_SIZE = 300,
+	MAX_MESSAGE_SCALE = 64		/* largest message, in mean sizes */
+};
+
+struct bench_options {
+	long messages;
+	long mean_size;
+	int mime_percent;
+	int from_percent;
+	int content_length_percent;
+	int unread_percent;
+	unsigned long seed;
+	const char *file_name;
+	int generate_only;
+	int keep;
+};
+
+/* Shared by the tracer and the benchmark */
+
+struct syscall_count {
+	volatile int traced;		/* the tracer has attached */
+	volatile long count;		/* system calls entered while counting */
+};
+
+static struct syscall_count *syscall_count = NULL;
+
+static uint64_t random_state = 1;	/* xorshift state */
+static long message_number = 0;	/* number of the next generated message */
+
+/* Return a random 64 bit number */
+
+static uint64_t
+next_random()
+{
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+	return random_state;
+}
+
+/* Return TRUE with the given chance */
+
+static int
+random_percent(int percent)
+{
+	return (int) (next_random() % 100) < percent;
+}
+
+/* Return a message size with a log-normal distribution around the mean */
+
+static long
+random_size(long mean_size)
+{
+	const double sigma = 1.0;
+	double u1;
+	double u2;
+	double normal;
+	long size;
+
+	u1 = ((next_random() >> 11) + 1.0) / 9007199254740993.0;
+	u2 = (next_random() >> 11) / 9007199254740992.0;
+	normal = sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+	size = (long) (mean_size * exp(sigma * normal - sigma * sigma / 2.0));
+	if (size < MIN_MESSAGE_SIZE) size = MIN_MESSAGE_SIZE;
+	if (size > MAX_MESSAGE_SCALE * mean_size) size = MAX_MESSAGE_SCALE * mean_size;
+	return size;
+}
+
+/* Write text lines until the body has len bytes */
+/*   Some lines start with "From ", which is quoted unless the message has a Content-Length: */
+
+static void
+write_text(char *body, long *pos, long len, int from_lines, int quote)
+{
+	static const char words[] = "the quick brown fox jumps over the lazy dog and then some more words ";
+	int line_len;
+	int i;
+
+	while (*pos < len) {
+		line_len = (len - *pos - 1 < LINE_LEN? (int) (len - *pos - 1): LINE_LEN);
+		if (line_len <= 0) {
+			body[ (*pos)++ ] = '\n';
+			continue;
+		}
+		i = 0;
+		if (from_lines && line_len > 10 && random_percent(10)) {
+			if (quote) {
+				body[ *pos + i++ ] = '>';
+			}
+			memcpy(&body[ *pos + i ], "From ", 5);
+			i += 5;
+		}
+		for (; i < line_len; i++) {
+			body[ *pos + i ] = words[ (*pos + i) % (sizeof(words) - 1) ];
+		}
+		body[ *pos + line_len ] = '\n';
+		*pos += line_len + 1;
+	}
+}
+
+/* Write base64 lines of random bytes until the body has len bytes */
+
+static void
+write_base64(char *body, long *pos, long len)
+{
+	static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint64_t bits;
+	int line_len;
+	int i;
+
+	while (*pos < len) {
+		line_len = (len - *pos - 1 < BASE64_LINE_LEN? (int) (len - *pos - 1): BASE64_LINE_LEN);
+		bits = 0;
+		for (i = 0; i < line_len; i++) {
+			if (i % 10 == 0) {
+				bits = next_random();
+			}
+			body[ *pos + i ] = digits[ bits & 63 ];
+			bits >>= 6;
+		}
+		body[ *pos + (line_len > 0? line_len: 0) ] = '\n';
+		*pos += (line_len > 0? line_len: 0) + 1;
+	}
+}
+
+/* Append one message to the mbox file */
+/*   Returns the bytes written */
+
+static long
+write_message(FILE *mbox, const struct bench_options *options, int unread)
+{
+	enum message_enum { HEADER_LEN = 1024 };
+	static char *body = NULL;
+	static long body_max = 0;
+	char header[ HEADER_LEN ];
+	long number;
+	long size;
+	long body_len;
+	long pos;
+	int header_len;
+	int mime;
+	int from_lines;
+	int content_length;
+
+	number = message_number++;
+	size = random_size(options->mean_size);
+	mime = random_percent(options->mime_percent);
+	from_lines = random_percent(options->from_percent);
+	content_length = random_percent(options->content_length_percent);
+
+	header_len = snprintf(header, HEADER_LEN,
+		"From sender%ld@example.com Mon Oct 19 12:%02ld:%02ld 2026\n"
+		"Return-Path: <sender%ld@example.com>\n"
+		"From: Sender %ld <sender%ld@example.com>\n"
+		"To: me@example.com\n"
+		"Subject: %s message %ld\n"
+		"Date: Mon, 19 Oct 2026 12:%02ld:%02ld +0000\n"
+		"Message-ID: <%ld.bench@example.com>\n"
+		"%s",
+		number % 1000, (number / 60) % 60, number % 60,
+		number % 1000,
+		number % 1000, number % 1000,
+		(number % 7 == 0? "=?UTF-8?B?R3LDvMOfZQ==?=": "Test"), number,
+		(number / 60) % 60, number % 60,
+		number,
+		(unread? "": "Status: RO\n"));
+	if (mime) {
+		header_len += snprintf(&header[ header_len ], HEADER_LEN - header_len,
+			"MIME-Version: 1.0\n"
+			"Content-Type: multipart/mixed; boundary=\"b%ld\"\n", number);
+	}
+
+	body_len = (size > header_len + 2? size - header_len - 1: 1);
+	if (body_len + 256 > body_max) {
+		body_max = 2 * (body_len + 256);
+		body = realloc(body, body_max);
+		if (body == NULL) {
+			fprintf(stderr, "mailcheck_bench: out of memory\n");
+			exit(1);
+		}
+	}
+
+	pos = 0;
+	if (mime) {
+		pos += sprintf(&body[ pos ], "--b%ld\nContent-Type: text/plain\n\n", number);
+		write_text(body, &pos, pos + (body_len - pos) / 4, from_lines, !content_length);
+		pos += sprintf(&body[ pos ], "--b%ld\nContent-Type: application/octet-stream\n"
+			"Content-Transfer-Encoding: base64\n\n", number);
+		write_base64(body, &pos, body_len - 16);
+		pos += sprintf(&body[ pos ], "--b%ld--\n", number);
+	} else {
+		write_text(body, &pos, body_len, from_lines, !content_length);
+	}
+	/* a blank line before the next separator */
+	body[ pos++ ] = '\n';
+
+	if (content_length) {
+		header_len += snprintf(&header[ header_len ], HEADER_LEN - header_len, "Content-Length: %ld\n", pos);
+	}
+	header[ header_len++ ] = '\n';
+
+	if (fwrite(header, 1, header_len, mbox) != (size_t) header_len || fwrite(body, 1, pos, mbox) != (size_t) pos) {
+		fprintf(stderr, "mailcheck_bench: write failed\n");
+		exit(1);
+	}
+	return header_len + pos;
+}
+
+/* Write count messages to the mbox file, appending or starting over */
+/*   Returns the bytes written */
+
+static long long
+write_messages(const struct bench_options *options, long count, int unread_percent, const char *mode)
+{
+	FILE *mbox;
+	long long bytes;
+	long i;
+
+	mbox = fopen(options->file_name, mode);
+	if (mbox == NULL) {
+		perror(options->file_name);
+		exit(1);
+	}
+	bytes = 0;
+	for (i = 0; i < count; i++) {
+		bytes += write_message(mbox, options, random_percent(unread_percent));
+	}
+	if (fflush(mbox) != 0 || fsync(fileno(mbox)) != 0 || fclose(mbox) != 0) {
+		perror(options->file_name);
+		exit(1);
+	}
+	return bytes;
+}
+
+/* Drop the mbox file from the page cache */
+
+static void
+drop_cache(const char *file_name)
+{
+	int fd;
+
+	fd = open(file_name, O_RDONLY);
+	if (fd != -1) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+/* Trace the benchmark from a parent process and count its system calls */
+/*   Returns in the child, which runs the benchmark, and exits in the parent */
+/*   with the status of the child */
+
+static void
+start_syscall_count()
+{
+	pid_t pid;
+	int status;
+	int counting;
+	int entering;
+	int sig;
+
+	syscall_count = mmap(NULL, sizeof(*syscall_count), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (syscall_count == MAP_FAILED) {
+		syscall_count = NULL;
+		return;
+	}
+	fflush(stdout);
+	pid = fork();
+	if (pid == -1) {
+		return;
+	}
+	if (pid == 0) {
+		/* stop until the tracer has set its options */
+		if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == 0) {
+			raise(SIGSTOP);
+		}
+		return;
+	}
+
+	if (waitpid(pid, &status, 0) != pid) {
+		exit(1);
+	}
+	if (WIFSTOPPED(status) && ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *) (PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL)) == 0) {
+		syscall_count->traced = TRUE;
+	}
+	/* only stop at each system call while counting */
+	counting = FALSE;
+	entering = TRUE;
+	sig = 0;
+	for (;;) {
+		if (WIFEXITED(status)) {
+			exit(WEXITSTATUS(status));
+		}
+		if (WIFSIGNALED(status)) {
+			exit(128 + WTERMSIG(status));
+		}
+		if (WIFSTOPPED(status)) {
+			sig = WSTOPSIG(status);
+			if (sig == (SIGTRAP | 0x80)) {
+				if (entering) {
+					syscall_count->count++;
+				}
+				entering = !entering;
+				sig = 0;
+			} else if (sig == COUNT_SIGNAL) {
+				counting = !counting;
+				entering = TRUE;
+				sig = 0;
+			} else if (sig == SIGSTOP) {
+				sig = 0;
+			}
+			ptrace((counting? PTRACE_SYSCALL: PTRACE_CONT), pid, NULL, (void *) (long) sig);
+		}
+		if (waitpid(pid, &status, 0) != pid) {
+			exit(1);
+		}
+	}
+}
+
+/* Turn the counting of system calls on or off */
+/*   The signal stops the benchmark after the kill, so the kill is not counted */
+
+static void
+count_syscalls()
+{
+	if (syscall_count != NULL && syscall_count->traced) {
+		raise(COUNT_SIGNAL);
+	}
+}
+
+/* Time one check of the mailbox and print it as JSON */
+
+static void
+time_check(const char *name, long long bytes, int first)
+{
+	struct timespec start;
+	struct timespec end;
+	struct rusage usage_start;
+	struct rusage usage_end;
+	enum mail_state_enum state;
+	double seconds;
+	long syscalls_start;
+	long syscalls_end;
+	char syscalls[ 32 ];
+
+	mailboxes[0].dirty = TRUE;
+	getrusage(RUSAGE_SELF, &usage_start);
+	count_syscalls();
+	syscalls_start = (syscall_count != NULL? syscall_count->count: 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	state = check_mail_state(NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	syscalls_end = (syscall_count != NULL? syscall_count->count: 0);
+	count_syscalls();
+	getrusage(RUSAGE_SELF, &usage_end);
+
+	if (syscall_count != NULL && syscall_count->traced) {
+		snprintf(syscalls, sizeof(syscalls), "%ld", syscalls_end - syscalls_start);
+	} else {
+		strcpy(syscalls, "null");
+	}
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%s    {\"case\": \"%s\", \"bytes\": %lld, \"seconds\": %.6f, \"mb_per_s\": %.1f, "
+		"\"syscalls\": %s, \"minor_faults\": %ld, \"major_faults\": %ld, "
+		"\"state\": \"%s\", \"messages\": %ld, \"unread\": %ld}",
+		(first? "": ",\n"), name, bytes, seconds,
+		(seconds > 0? bytes / 1e6 / seconds: 0.0),
+		syscalls, usage_end.ru_minflt - usage_start.ru_minflt, usage_end.ru_majflt - usage_start.ru_majflt,
+		(mail_state_name[ state ] != NULL? mail_state_name[ state ]: "new mail"),
+		message_count, unread_count);
+	fflush(stdout);
+}
+
+/* Print how to run the benchmark */
+
+static void
+usage()
+{
+	fprintf(stderr, "usage: mailcheck_bench [-n messages] [-s mean-size] [-m mime-%%] [-q from-%%]\n"
+		"\t[-c content-length-%%] [-u unread-%%] [-r seed] [-o file] [-g] [-k]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const long appends[] = { 1, 100, 10000 };
+	struct bench_options options;
+	struct stat stat_buf;
+	char name[ 64 ];
+	long long bytes;
+	long long size;
+	int ch;
+	int i;
+
+	memset(&options, 0, sizeof(options));
+	options.messages = 20000;
+	options.mean_size = 8192;
+	options.mime_percent = 20;
+	options.from_percent = 5;
+	options.content_length_percent = 0;
+	options.unread_percent = 10;
+	options.seed = 1;
+	options.file_name = DEFAULT_BENCH_FILE;
+
+	while ((ch = getopt(argc, argv, "n:s:m:q:c:u:r:o:gk")) != -1) {
+		switch (ch) {
+		case 'n': options.messages = atol(optarg); break;
+		case 's': options.mean_size = atol(optarg); break;
+		case 'm': options.mime_percent = atoi(optarg); break;
+		case 'q': options.from_percent = atoi(optarg); break;
+		case 'c': options.content_length_percent = atoi(optarg); break;
+		case 'u': options.unread_percent = atoi(optarg); break;
+		case 'r': options.seed = strtoul(optarg, NULL, 10); break;
+		case 'o': options.file_name = optarg; break;
+		case 'g': options.generate_only = 1; break;
+		case 'k': options.keep = 1; break;
+		default: usage();
+		}
+	}
+	if (optind != argc || options.messages < 1 || options.mean_size < MIN_MESSAGE_SIZE) {
+		usage();
+	}
+	random_state = (options.seed != 0? options.seed: 1) * 0x9E3779B97F4A7C15ULL;
+
+	if (!options.generate_only) {
+		start_syscall_count();
+	}
+
+	size = write_messages(&options, options.messages, options.unread_percent, "w");
+	if (options.generate_only) {
+		printf("{\"file\": \"%s\", \"messages\": %ld, \"bytes\": %lld}\n", options.file_name, options.messages, size);
+		return 0;
+	}
+
+	/* one watched mailbox, so check_mail_state() scans in the caller */
+	log_file = NULL;
+	show_summaries = DEFAULT_SUMMARIES;
+	begin_mailboxes();
+	add_mailbox(options.file_name);
+	end_mailboxes();
+	mailboxes[0].watched = TRUE;
+
+	printf("{\n  \"mbox\": {\"file\": \"%s\", \"messages\": %ld, \"bytes\": %lld, \"mean_size\": %ld, "
+		"\"mime_percent\": %d, \"from_percent\": %d, \"content_length_percent\": %d, "
+		"\"unread_percent\": %d, \"seed\": %lu},\n  \"results\": [\n",
+		options.file_name, options.messages, size, options.mean_size,
+		options.mime_percent, options.from_percent, options.content_length_percent,
+		options.unread_percent, options.seed);
+
+	drop_cache(options.file_name);
+	time_check("cold full scan", size, 1);
+
+	/* forget the scan, keep the page cache */
+	reset_mbox_scan(&mailboxes[0].mbox);
+	mailboxes[0].last_size = 0;
+	mailboxes[0].last_mtime = 0;
+	time_check("warm full scan", size, 0);
+
+	for (i = 0; i < (int) (sizeof(appends) / sizeof(appends[0])); i++) {
+		bytes = write_messages(&options, appends[i], 100, "a");
+		snprintf(name, sizeof(name), "append %ld", appends[i]);
+		time_check(name, bytes, 0);
+	}
+
+	/* a mail reader writes the file again without the deleted messages */
+	bytes = write_messages(&options, options.messages - options.messages / 10, 0, "w");
+	time_check("truncate and rewrite", bytes, 0);
+
+	/* nothing changed */
+	time_check("unchanged", 0, 0);
+
+	printf("\n  ]\n}\n");
+
+	if (!options.keep && stat(options.file_name, &stat_buf) == 0) {
+		unlink(options.file_name);
+	}
+	return 0;
+}
@@ -0,0 +1,356 @@
+/* mailcheck_imaptest -- run the IMAP client against a scripted stand-in server
+ *
+ * make imaptest
+ *
+ * Listens on a port of 127.0.0.1 and answers each connection of the client from
+ * a script, then checks that the client
+ *	logs in after the greeting, opens the mailbox with EXAMINE, and counts with SEARCH
+ *	counts again after an EXISTS pushed in IDLE
+ *	sends DONE for an EXISTS that comes before the IDLE continuation
+ *	connects again after BYE, with a delay that doubles after each failure
+ *	asks for CAPABILITY, and checks with NOOP, on a server without IDLE
+ *	checks with NOOP when the server refuses IDLE
+ * The server fails a check when the client sends a command the script does not expect.
+ * Prints one line per check and exits with 1 if any check failed.
+ *
+ * Options
+ *	-v		log the IMAP lines to stderr
+ *
+ * 19Oct26 wb initial version
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define	MAILCHECK_IMAPTEST
+
+#include "mailcheck.c"
+
+enum imaptest_enum {
+	IMAPTEST_LINE_LEN = 256,
+	IMAPTEST_TAG_LEN = 32,
+	IMAPTEST_WAIT = 10000,		/* milliseconds to wait for a check */
+	IMAPTEST_CONNECTIONS = 4
+};
+
+/* Scripts of the connections, one line per step */
+/*	S text	send a line, with $T replaced by the tag of the last command */
+/*	C word	read a command, which has to be word */
+/*	P ms	pause */
+/*	X	close the connection */
+
+static const char *imaptest_idle_script[] = {
+	"S * OK [CAPABILITY IMAP4rev1 IDLE] stand-in ready",
+	"C LOGIN", "S $T OK [CAPABILITY IMAP4rev1 IDLE] logged in",
+	"C EXAMINE", "S * 5 EXISTS", "S * 0 RECENT", "S $T OK [READ-ONLY] examined",
+	"C SEARCH", "S * SEARCH 2 5", "S $T OK searched",
+	"C IDLE", "S + idling",
+	"P 300", "S * 6 EXISTS",
+	"C DONE", "S $T OK idle done",
+	"C SEARCH", "S * SEARCH 2 5 6", "S $T OK searched",
+	/* a change before the continuation */
+	"C IDLE", "P 300", "S * 7 EXISTS", "S + idling",
+	"C DONE", "S $T OK idle done",
+	"C SEARCH", "S * SEARCH 2 5 6 7", "S $T OK searched",
+	"C IDLE", "S + idling",
+	"P 300", "S * BYE stand-in shutting down", "X",
+	NULL
+};
+
+static const char *imaptest_noop_script[] = {
+	"S * OK stand-in ready",
+	"C LOGIN", "S $T OK logged in",
+	"C CAPABILITY", "S * CAPABILITY IMAP4rev1", "S $T OK capability",
+	"C EXAMINE", "S * 7 EXISTS", "S $T OK [READ-ONLY] examined",
+	"C SEARCH", "S * SEARCH 5 6 7", "S $T OK searched",
+	"C NOOP", "S * 8 EXISTS", "S $T OK noop",
+	"C SEARCH", "S * SEARCH 5 6 7 8", "S $T OK searched",
+	"C NOOP", "S $T OK noop",
+	"C NOOP", "X",
+	NULL
+};
+
+static const char *imaptest_refused_script[] = {
+	"X",
+	NULL
+};
+
+static const char *imaptest_bad_idle_script[] = {
+	"S * OK [CAPABILITY IMAP4rev1] stand-in ready",
+	"C LOGIN", "S $T OK [CAPABILITY IMAP4rev1 IDLE] logged in",
+	"C EXAMINE", "S * 8 EXISTS", "S $T OK [READ-ONLY] examined",
+	"C SEARCH", "S * SEARCH 8", "S $T OK searched",
+	"C IDLE", "S $T BAD unknown command",
+	"C NOOP", "S $T OK noop",
+	"C NOOP", "S * BYE done", "X",
+	NULL
+};
+
+static const char **imaptest_scripts[ IMAPTEST_CONNECTIONS ] = {
+	imaptest_idle_script, imaptest_noop_script, imaptest_refused_script, imaptest_bad_idle_script
+};
+
+static int imaptest_listen_fd = -1;
+static int imaptest_failures = 0;
+
+/* Shared with the server thread */
+
+static pthread_mutex_t imaptest_lock = PTHREAD_MUTEX_INITIALIZER;
+static int imaptest_connections = 0;	/* connections accepted */
+static int imaptest_finished = 0;	/* scripts run to the end */
+static int imaptest_unexpected = 0;	/* commands the scripts did not expect */
+static gint64 imaptest_accept_time[ IMAPTEST_CONNECTIONS ];
+static gint64 imaptest_close_time[ IMAPTEST_CONNECTIONS ];
+
+/* Report a check */
+
+static void
+imaptest_check(gboolean ok, const char *what)
+{
+	printf("%s %s\n", (ok? "ok  ": "FAIL"), what);
+	if (!ok) {
+		imaptest_failures++;
+	}
+}
+
+/* Read a line from the client, without the CRLF */
+/*   Returns FALSE at the end of the connection */
+
+static gboolean
+imaptest_read_line(int fd, char *line, int line_len)
+{
+	int len;
+	char ch;
+
+	len = 0;
+	for (;;) {
+		if (read(fd, &ch, 1) != 1) {
+			return FALSE;
+		}
+		if (ch == '\n') {
+			break;
+		}
+		if (ch != '\r' && len < line_len - 1) {
+			line[ len++ ] = ch;
+		}
+	}
+	line[ len ] = '\0';
+	return TRUE;
+}
+
+/* Run a script on a connection */
+/*   Returns FALSE if the client sent a command the script did not expect */
+
+static gboolean
+imaptest_run_script(int fd, const char **script)
+{
+	char line[ IMAPTEST_LINE_LEN ];
+	char out[ IMAPTEST_LINE_LEN ];
+	char tag[ IMAPTEST_TAG_LEN ];
+	const char *command;
+	const char *dollar;
+	int len;
+	int i;
+
+	tag[0] = '\0';
+	for (i = 0; script[i] != NULL; i++) {
+		switch (script[i][0]) {
+		case 'S':
+			dollar = strstr(script[i] + 2, "$T");
+			if (dollar != NULL) {
+				snprintf(out, IMAPTEST_LINE_LEN, "%.*s%s%s\r\n", (int) (dollar - (script[i] + 2)), script[i] + 2, tag, dollar + 2);
+			} else {
+				snprintf(out, IMAPTEST_LINE_LEN, "%s\r\n", script[i] + 2);
+			}
+			len = strlen(out);
+			if (write(fd, out, len) != len) {
+				return TRUE;
+			}
+			break;
+		case 'C':
+			if (!imaptest_read_line(fd, line, IMAPTEST_LINE_LEN)) {
+				fprintf(stderr, "server: the client closed, expected %s\n", script[i] + 2);
+				return FALSE;
+			}
+			if (strcmp(line, "DONE") == 0) {
+				command = line;
+			} else {
+				command = strchr(line, ' ');
+				if (command == NULL) {
+					command = line;
+				} else {
+					snprintf(tag, IMAPTEST_TAG_LEN, "%.*s", (int) (command - line), line);
+					command++;
+				}
+			}
+			if (strncmp(command, script[i] + 2, strlen(script[i] + 2)) != 0) {
+				fprintf(stderr, "server: got '%s', expected %s\n", (strncmp(command, "LOGIN", 5) == 0? "LOGIN": line), script[i] + 2);
+				return FALSE;
+			}
+			break;
+		case 'P':
+			usleep(atoi(script[i] + 2) * 1000);
+			break;
+		case 'X':
+			return TRUE;
+		}
+	}
+	return TRUE;
+}
+
+/* Answer the connections of the client from the scripts */
+
+static void *
+imaptest_server(void *data)
+{
+	int fd;
+	int i;
+
+	for (i = 0; i < IMAPTEST_CONNECTIONS; i++) {
+		fd = accept(imaptest_listen_fd, NULL, NULL);
+		if (fd == -1) {
+			break;
+		}
+		pthread_mutex_lock(&imaptest_lock);
+		imaptest_accept_time[i] = g_get_monotonic_time();
+		imaptest_connections++;
+		pthread_mutex_unlock(&imaptest_lock);
+
+		if (!imaptest_run_script(fd, imaptest_scripts[i])) {
+			pthread_mutex_lock(&imaptest_lock);
+			imaptest_unexpected++;
+			pthread_mutex_unlock(&imaptest_lock);
+		}
+		close(fd);
+
+		pthread_mutex_lock(&imaptest_lock);
+		imaptest_close_time[i] = g_get_monotonic_time();
+		imaptest_finished++;
+		pthread_mutex_unlock(&imaptest_lock);
+	}
+	return NULL;
+}
+
+/* Return the number of scripts run to the end */
+
+static int
+imaptest_scripts_finished()
+{
+	int finished;
+
+	pthread_mutex_lock(&imaptest_lock);
+	finished = imaptest_finished;
+	pthread_mutex_unlock(&imaptest_lock);
+	return finished;
+}
+
+/* Run the main loop until the account has a number of unseen messages */
+/* after a number of scripts ran to the end */
+/*   Returns FALSE if it did not in IMAPTEST_WAIT milliseconds */
+
+static gboolean
+imaptest_wait_unseen(struct imap_account *imap, long unseen, int scripts)
+{
+	gint64 end;
+
+	end = g_get_monotonic_time() + IMAPTEST_WAIT * 1000LL;
+	while (g_get_monotonic_time() < end) {
+		if (imap->known && imap->unseen == unseen && imaptest_scripts_finished() >= scripts) {
+			return TRUE;
+		}
+		g_main_context_iteration(NULL, FALSE);
+		usleep(1000);
+	}
+	return FALSE;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sockaddr_in addr;
+	socklen_t addr_len;
+	struct imap_account *imap;
+	pthread_t server;
+	char line[ IMAPTEST_LINE_LEN ];
+	char password_name[] = "/tmp/mailcheck_imaptest.XXXXXX";
+	int password_fd;
+	gint64 delay;
+	gint64 end;
+
+	if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+		log_file = stderr;
+		debug = 2;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr_len = sizeof(addr);
+	imaptest_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (imaptest_listen_fd == -1 || bind(imaptest_listen_fd, (struct sockaddr *) &addr, addr_len) != 0 ||
+	    listen(imaptest_listen_fd, 1) != 0 || getsockname(imaptest_listen_fd, (struct sockaddr *) &addr, &addr_len) != 0) {
+		perror("mailcheck_imaptest");
+		return 1;
+	}
+	/* a new file, so a link planted in /tmp or another run cannot change it */
+	password_fd = mkstemp(password_name);
+	if (password_fd == -1) {
+		perror(password_name);
+		return 1;
+	}
+	if (write(password_fd, "secret\n", 7) != 7) {
+		perror(password_name);
+		unlink(password_name);
+		return 1;
+	}
+	close(password_fd);
+	pthread_create(&server, NULL, imaptest_server, NULL);
+
+	/* one IMAP mailbox, without a panel, checked with NOOP every second without IDLE */
+	interval = 1;
+	begin_mailboxes();
+	snprintf(line, IMAPTEST_LINE_LEN, "imap://me@127.0.0.1:%d/INBOX %s", ntohs(addr.sin_port), password_name);
+	add_imap_account(line);
+	end_mailboxes();
+	imap = mailboxes[0].imap;
+	start_imap(NULL);
+
+	imaptest_check(imaptest_wait_unseen(imap, 2, 0) && imap->exists == 5,
+		"greeting, LOGIN, EXAMINE, and SEARCH count 2 unseen");
+	imaptest_check(check_mail_state(NULL) == UNREAD_MAIL, "the mailbox has unread mail");
+	imaptest_check(imaptest_wait_unseen(imap, 3, 0) && imap->exists == 6 && check_mail_state(NULL) == NEW_MAIL,
+		"EXISTS pushed in IDLE is new mail, 3 unseen");
+	imaptest_check(imaptest_wait_unseen(imap, 4, 0) && imap->exists == 7,
+		"EXISTS before the IDLE continuation is counted, 4 unseen");
+
+	imaptest_check(imaptest_wait_unseen(imap, 3, 1) && imaptest_connections == 2,
+		"connects again after BYE, and asks for CAPABILITY without IDLE, 3 unseen");
+	imaptest_check(imaptest_wait_unseen(imap, 4, 1) && imap->exists == 8,
+		"NOOP without IDLE finds a new message, 4 unseen");
+
+	imaptest_check(imaptest_wait_unseen(imap, 1, 3), "NOOP after the server refused IDLE, 1 unseen");
+	end = g_get_monotonic_time() + IMAPTEST_WAIT * 1000LL;
+	while (imaptest_scripts_finished() < IMAPTEST_CONNECTIONS && g_get_monotonic_time() < end) {
+		g_main_context_iteration(NULL, FALSE);
+		usleep(1000);
+	}
+	imaptest_check(imaptest_scripts_finished() == IMAPTEST_CONNECTIONS && imaptest_unexpected == 0,
+		"every command was the one the scripts expected");
+
+	/* the first failure waits 1 second, and the next one without a count 2 */
+	delay = imaptest_accept_time[1] - imaptest_close_time[0];
+	imaptest_check(delay >= 1000000 && delay < 2000000, "first retry after 1 second");
+	delay = imaptest_accept_time[3] - imaptest_close_time[2];
+	imaptest_check(delay >= 2000000 && delay < 3000000, "second retry in a row after 2 seconds");
+
+	unlink(password_name);
+	printf("%s\n", (imaptest_failures == 0? "all IMAP checks passed": "some IMAP checks failed"));
+	return (imaptest_failures == 0? 0: 1);
+}
@@ -19,6 +19,18 @@
  * 09Nov22 wb add unicode option
  * 17Jul24 wb add nvme ssd
  * 03Jun26 wb add malloc check
+ * 19Oct26 wb add sampling profiles for ac and battery power
+ * 19Oct26 wb add format option for the label
+ * 19Oct26 wb skip reads within the update interval of hwmon chips
+ * 19Oct26 wb add sata drive temperatures from drivetemp
+ * 19Oct26 wb log the processes using the most cpu on high temperature warnings
+ * 19Oct26 wb update sensors from hotplug uevents
+ * 19Oct26 wb add optional fan curve control
+ * 19Oct26 wb add optional cgroup cpu.max throttling governor
+ * 19Oct26 wb add loadable sensor plugins
+ * 19Oct26 wb add command sensors that talk to a long running helper
+ * 19Oct26 wb add pressure stall information triggers
+ * 19Oct26 wb add remote sources that stream sensor lines
  */
 
 #include <sys/types.h>
@@ -29,6 +41,18 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/netlink.h>
+#include <dlfcn.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <netdb.h>
 
 #include <mate-panel-applet.h>
 
@@ -37,7 +61,9 @@
 #include <gtk/gtkbox.h>
 #include <gdk/gdkx.h>
 
-#define VERSION		"03Jun26"
+#include "temperature_plugin.h"
+
+#define VERSION		"19Oct26"
 
 #define BASE_NAME	"temperature"
 
@@ -48,6 +74,11 @@
 #define DEFAULT_WARNING_INTERVAL	(5 * DEFAULT_INTERVAL)
 #define DEFAULT_FAN_CHECK_INTERVAL	((3 * DEFAULT_TEMPERATURE_INTERVAL) / 2)
 #define MAX_INTERVAL			1000
+#define DEFAULT_HOT_PROCESS_COUNT	5
+#define DEFAULT_DRIVE_IDLE_TIME		60
+#define DEFAULT_FAN_KP			0.0
+#define DEFAULT_FAN_KI			0.25
+#define DEFAULT_FAN_KD			0.0
 
 static int interval = 0;		/* time between temperature checks */
 static int debug = 0;			/* enable debug messages to the log file */
@@ -61,8 +92,11 @@ static int fan_check_interval = 0;	/* interval to check fan */
 static int gpu_temp_interval = 0;	/* interval to check gpu */
 static int ssd_temp_interval = 0;	/* interval to check ssd */
 static int ssd_hide_temperature = 0;	/* hide low ssd temperatures */
+static int drive_hide_temperature = 0;	/* hide low sata drive temperatures */
+static int drive_idle_time = 0;		/* do not read drives without io for this many seconds */
 static int warning_temperature = 0;	/* temperature to show a warning */
 static int warning_interval = 0;	/* interval to repeat a warning */
+static int hot_process_count = 0;	/* number of top cpu processes to show on warnings */
 static char *setup_name = NULL;		/* name of the config file */
 static time_t setup_mtime = 0;		/* mtime of config file */
 static time_t setup_check_time = 0;	/* time of last check of config file */
@@ -70,7 +104,12 @@ static gint timer_handle = 0;		/* handle to change the mate timer */
 static const char *temp_text = NULL;	/* text to show temperature */
 static const char *gpu_text = NULL;	/* text to show gpu */
 static const char *ssd_text = NULL;	/* test to show ssd */
+static const char *drive_text = NULL;	/* text to show sata drives */
+static const char *plugin_text = NULL;	/* text to show plugin sensors */
+static const char *remote_text = NULL;	/* text to show remote hosts */
 static const char *fan_text = NULL;	/* text to show fan */
+static int uevent_fd = -1;		/* netlink socket for kernel uevents */
+static int on_ac_power = 1;		/* running on mains power, or no power supply info */
 
 /* Return a time stamp */
 
@@ -119,30 +158,308 @@ enum check_temperature_enum {
 	THINKPAD_TEMP_IND_POS = THINKPAD_HWMON_IND_POS + 6
 };
 
+/* Table of sensor values for the format option */
+/*   Each discovered sensor has a slot with a name like cpu, core0, gpu, nvme0, or fan1. */
+/*   The generation changes when slots are added, so formats can refresh their matches. */
+
+enum sensor_value_enum { MAX_SENSOR_VALUES = 64, SENSOR_NAME_LEN = 16 };
+
+enum sensor_kind_enum { SENSOR_TEMP, SENSOR_FAN };
+
+struct sensor_value {
+	char name[ SENSOR_NAME_LEN ];	/* name in format placeholders */
+	enum sensor_kind_enum kind;	/* temperature in degrees C or fan in rpm */
+	const char **icon;		/* text for the {name.icon} placeholder */
+	int value;			/* current value, 0 or less when not available */
+	gboolean external;		/* from a plugin, command, or remote */
+};
+
+static struct sensor_value sensor_values[ MAX_SENSOR_VALUES ];
+static int num_sensor_values = 0;
+static int sensor_values_generation = 0;
+
+/* Find or add the slot for a sensor */
+/*   Returns -1 if the table is full */
+
+static int
+sensor_value_slot(const char *name, enum sensor_kind_enum kind, const char **icon)
+{
+	int i;
+	struct sensor_value *sv;
+
+	for (i = 0; i < num_sensor_values; i++) {
+		if (strcmp(sensor_values[i].name, name) == 0) {
+			return i;
+		}
+	}
+	if (num_sensor_values >= MAX_SENSOR_VALUES) {
+		return -1;
+	}
+	sv = &sensor_values[ num_sensor_values ];
+	memset(sv, 0, sizeof(*sv));
+	strncpy(sv->name, name, SENSOR_NAME_LEN - 1);
+	sv->kind = kind;
+	sv->icon = icon;
+	sensor_values_generation++;
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "sensor value slot %d is '%s'\n", num_sensor_values, sv->name);
+	}
+	return num_sensor_values++;
+}
+
+/* Names of the sensors the applet finds itself, not allowed for external sensors */
+
+static const char *builtin_sensor_patterns[] = {
+	"cpu", "gpu", "drive", "core[0-9]*", "fan[0-9]*", "nvme[0-9]*", "sd[a-z]", "sd[a-z][a-z]", "hwmon[0-9]*", NULL
+};
+
+/* Find or add the slot for a plugin, command, or remote sensor */
+/*   Returns -1 if the name is one of a built-in sensor, */
+/*   so an external value never overwrites a built-in reading */
+
+static int
+external_sensor_slot(const char *name, enum sensor_kind_enum kind, const char **icon, const char *source)
+{
+	int slot;
+	int i;
+
+	for (i = 0; builtin_sensor_patterns[i] != NULL; i++) {
+		if (fnmatch(builtin_sensor_patterns[i], name, 0) == 0) {
+			break;
+		}
+	}
+	for (slot = 0; slot < num_sensor_values; slot++) {
+		if (strcmp(sensor_values[slot].name, name) == 0) {
+			break;
+		}
+	}
+	if (builtin_sensor_patterns[i] != NULL || (slot < num_sensor_values && !sensor_values[slot].external)) {
+		if (log_file != NULL) {
+			fprintf(log_file, "%s sensor '%s' has the name of a built-in sensor, not used.\n", source, name);
+		}
+		return -1;
+	}
+
+	slot = sensor_value_slot(name, kind, icon);
+	if (slot >= 0) {
+		sensor_values[ slot ].external = TRUE;
+	}
+	return slot;
+}
+
+/* Set the value of a sensor slot */
+
+static void
+set_sensor_value(int slot, int value)
+{
+	if (slot >= 0 && slot < num_sensor_values) {
+		sensor_values[ slot ].value = value;
+	}
+}
+
+/* hwmon chips */
+/*   Many chips only refresh their values every update_interval ms, */
+/*   so a read inside that window returns the value from the last read. */
+
+struct hwmon_chip {
+	int dir_fd;			/* path descriptor of the hwmon# directory */
+	int update_interval;		/* ms between chip refreshes, 0 if not known */
+	int hwmon_num;			/* # from the hwmon# name, to match uevents */
+};
+
+struct hwmon_reading {
+	gint64 read_time;		/* monotonic time of the last read in usec, 0 if none */
+	int value;			/* raw value of the last read */
+};
+
+static struct hwmon_chip thinkpad_chip = { -1, 0, -1 };
+static struct hwmon_chip coretemp_chip = { -1, 0, -1 };
+static struct hwmon_chip gpu_chip = { -1, 0, -1 };
+static long hwmon_reads = 0;		/* number of sensor file reads */
+static long hwmon_reads_avoided = 0;	/* number of reads answered from the last value */
+
+/* Set up a chip from an open hwmon directory */
+
+static void
+init_hwmon_chip(struct hwmon_chip *chip, int dir_fd, int hwmon_num)
+{
+	char buf[ MAX_BUF ];
+	int fd;
+	int len;
+
+	chip->dir_fd = dir_fd;
+	chip->update_interval = 0;
+	chip->hwmon_num = hwmon_num;
+
+	fd = openat(dir_fd, "update_interval", O_RDONLY);
+	if (fd != -1) {
+		len = read(fd, buf, MAX_BUF - 1);
+		if (len > 0) {
+			buf[ len ] = '\0';
+			chip->update_interval = atoi(buf);
+			if (chip->update_interval < 0) chip->update_interval = 0;
+		}
+		close(fd);
+	}
+
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "hwmon%d chip fd %d update interval %d ms\n", hwmon_num, dir_fd, chip->update_interval);
+	}
+}
+
+/* Read a small sysfs file relative to a directory */
+/*   Returns the length read, or -1 */
+
+static int
+read_sys_file(int dir_fd, const char *path, char *buf, int buf_len)
+{
+	int fd;
+	int len;
+
+	fd = openat(dir_fd, path, O_RDONLY);
+	if (fd == -1) {
+		return -1;
+	}
+	len = read(fd, buf, buf_len - 1);
+	close(fd);
+	if (len < 0) {
+		return -1;
+	}
+	buf[ len ] = '\0';
+	return len;
+}
+
+/* Write a string to a file in a directory */
+/*   Only uses async signal safe calls, for the signal handler */
+
+static gboolean
+write_sys_file(int dir_fd, const char *path, const char *value, int len)
+{
+	int fd;
+	int written;
+
+	fd = openat(dir_fd, path, O_WRONLY | O_TRUNC);
+	if (fd == -1) {
+		return FALSE;
+	}
+	written = write(fd, value, len);
+	close(fd);
+	return (written == len);
+}
+
+/* Functions that give hardware settings back on exit */
+/*   They run from signal handlers, so they may only use async signal safe calls */
+
+enum restore_enum { MAX_RESTORE_FUNCTIONS = 4 };
+
+static void (*restore_functions[ MAX_RESTORE_FUNCTIONS ])(void);
+static int num_restore_functions = 0;
+
+/* Run the restore functions */
+
+static void
+run_restore_functions(void)
+{
+	int i;
+
+	for (i = 0; i < num_restore_functions; i++) {
+		(*restore_functions[i])();
+	}
+}
+
+/* Restore settings when the applet is killed or crashes */
+
+static void
+on_restore_signal(int sig)
+{
+	run_restore_functions();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+/* Add a restore function, installing the exit and signal handlers the first time */
+
+static void
+add_restore_function(void (*restore_function)(void))
+{
+	static const int signals[] = { SIGTERM, SIGINT, SIGHUP, SIGQUIT, SIGSEGV, SIGBUS, SIGABRT, SIGFPE };
+	int i;
+
+	for (i = 0; i < num_restore_functions; i++) {
+		if (restore_functions[i] == restore_function) {
+			return;
+		}
+	}
+	if (num_restore_functions >= MAX_RESTORE_FUNCTIONS) {
+		return;
+	}
+	if (num_restore_functions == 0) {
+		atexit(run_restore_functions);
+		for (i = 0; i < (int) (sizeof(signals) / sizeof(signals[0])); i++) {
+			signal(signals[i], on_restore_signal);
+		}
+	}
+	restore_functions[ num_restore_functions++ ] = restore_function;
+}
+
+/* Read a value from a hwmon chip */
+/*   Returns TRUE and sets *value_ptr if the value is available */
+
+static gboolean
+read_hwmon_value(const struct hwmon_chip *chip, const char *path, struct hwmon_reading *reading, int *value_ptr)
+{
+	char buf[ MAX_BUF ];
+	gint64 now;
+	int fd;
+	int len;
+
+	now = g_get_monotonic_time();
+
+	if (chip->update_interval > 0 && reading->read_time != 0 &&
+	    now - reading->read_time < (gint64) chip->update_interval * 1000) {
+		hwmon_reads_avoided++;
+		*value_ptr = reading->value;
+		return TRUE;
+	}
+
+	fd = openat(chip->dir_fd, path, O_RDONLY);
+	if (fd == -1) {
+		return FALSE;
+	}
+	len = read(fd, buf, MAX_BUF - 1);
+	close(fd);
+	hwmon_reads++;
+	if (len <= 0) {
+		return FALSE;
+	}
+	buf[ len ] = '\0';
+
+	reading->value = atoi(buf);
+	reading->read_time = now;
+	*value_ptr = reading->value;
+
+	return TRUE;
+}
+
 /* Find the current fan speed */
 
 static const char *hwmon_fan_speed_path = NULL;
-static int hwmon_fan_speed_dir_fd = -1;
+static const struct hwmon_chip *hwmon_fan_speed_chip = NULL;
+static struct hwmon_reading fan_speed_reading;
+static int fan_speed_slot = -1;
 
 static int
 check_fan_speed()
 {
 	int result = -1;
+	int value;
 
-	if (hwmon_fan_speed_path != NULL) {
-		int fd = openat(hwmon_fan_speed_dir_fd, hwmon_fan_speed_path, O_RDONLY);
-		if (fd != -1) {
-			char buf[ MAX_BUF ];
-			int len = read(fd, buf, MAX_BUF - 1);
-			if (len > 0) {
-				if (len > MAX_BUF - 1) len = MAX_BUF - 1;
-				buf[ len ] = '\0';
-				result = (atoi(buf) + 50) / 100;
-				if (debug && log_file != NULL) {
-					fprintf(log_file, "hwmon CPU fan speed %d\n", result);
-				}
-			}
-			close(fd);
+	if (hwmon_fan_speed_path != NULL &&
+	    read_hwmon_value(hwmon_fan_speed_chip, hwmon_fan_speed_path, &fan_speed_reading, &value)) {
+		result = (value + 50) / 100;
+		set_sensor_value(fan_speed_slot, value);
+		if (debug && log_file != NULL) {
+			fprintf(log_file, "hwmon CPU fan speed %d\n", result);
 		}
 	}
 	return result;
@@ -151,164 +468,634 @@ check_fan_speed()
 /* Find the current gpu temperature */
 
 static char *hwmon_gpu_temp_path = NULL;
-static int hwmon_gpu_temp_dir_fd = -1;
+static const struct hwmon_chip *hwmon_gpu_temp_chip = NULL;
+static struct hwmon_reading gpu_temp_reading;
+static int gpu_temp_slot = -1;
 
 static int
 check_gpu_temp()
 {
 	int result = 0;
+	int value;
 
 	if (hwmon_gpu_temp_path != NULL) {
-		int fd = openat(hwmon_gpu_temp_dir_fd, hwmon_gpu_temp_path, O_RDONLY);
-		if (fd != -1) {
-			char buf[ MAX_BUF ];
-			int len = read(fd, buf, MAX_BUF - 1);
-			if (len > 0) {
-				if (len > MAX_BUF - 1) len = MAX_BUF - 1;
-				buf[ len ] = '\0';
-				result = atoi(buf) / 1000;
-				if (debug && log_file != NULL) {
-					fprintf(log_file, "hwmon GPU temp %d\n", result);
-				}
+		if (read_hwmon_value(hwmon_gpu_temp_chip, hwmon_gpu_temp_path, &gpu_temp_reading, &value)) {
+			result = value / 1000;
+			if (debug && log_file != NULL) {
+				fprintf(log_file, "hwmon GPU temp %d\n", result);
 			}
-			close(fd);
 		}
 		if (result <= 0) {
 			if (debug && log_file != NULL) {
 				fprintf(log_file, "hwmon GPU temp N/A\n");
 			}
 		}
+		set_sensor_value(gpu_temp_slot, result);
 	}
 	return result;
 }
 
-/* Find the current ssd temperature */
+/* NVMe ssd temperatures */
+/*   Each nvme controller with a hwmon directory is tracked, such as nvme0 */
+/*   inside a laptop and nvme1 in a Thunderbolt enclosure.  The label shows */
+/*   the hottest one. */
+
+enum ssd_enum { MAX_SSDS = 8, SSD_PATH_LEN = 20 };
+
+struct ssd {
+	char name[ SENSOR_NAME_LEN ];	/* controller name, like nvme0 */
+	struct hwmon_chip chip;		/* nvme hwmon directory */
+	struct hwmon_reading reading;	/* last temperature read */
+	char temp_path[ SSD_PATH_LEN ];	/* temp#_input of the Composite or first Sensor item */
+	int slot;			/* sensor value slot */
+};
+
+static struct ssd ssds[ MAX_SSDS ];
+static int num_ssds = 0;
 
-static char *hwmon_ssd_temp_path = NULL;
-static int hwmon_ssd_temp_dir_fd = -1;
+/* Find the hottest ssd temperature */
 
 static int
 check_ssd_temp()
 {
+	struct ssd *ssd;
 	int result = 0;
+	int temp;
+	int value;
+	int i;
 
-	if (hwmon_ssd_temp_path != NULL) {
-		int fd = openat(hwmon_ssd_temp_dir_fd, hwmon_ssd_temp_path, O_RDONLY);
-		if (fd != -1) {
-			char buf[ MAX_BUF ];
-			int len = read(fd, buf, MAX_BUF - 1);
-			if (len > 0) {
-				if (len > MAX_BUF - 1) len = MAX_BUF - 1;
-				buf[ len ] = '\0';
-				result = atoi(buf) / 1000;
-				if (debug && log_file != NULL) {
-					fprintf(log_file, "hwmon ssd temp %d\n", result);
-				}
+	for (i = 0; i < num_ssds; i++) {
+		ssd = &ssds[i];
+		temp = 0;
+		if (read_hwmon_value(&ssd->chip, ssd->temp_path, &ssd->reading, &value)) {
+			temp = value / 1000;
+			if (debug && log_file != NULL) {
+				fprintf(log_file, "hwmon ssd %s temp %d\n", ssd->name, temp);
 			}
-			close(fd);
 		}
-		if (result <= 0) {
+		if (temp <= 0) {
 			if (debug && log_file != NULL) {
-				fprintf(log_file, "hwmon ssd temp N/A\n");
+				fprintf(log_file, "hwmon ssd %s temp N/A\n", ssd->name);
 			}
 		}
+		set_sensor_value(ssd->slot, temp);
+		if (result < temp) {
+			result = temp;
+		}
 	}
 	return result;
 }
 
-/* Find the current cpu temperature */
+/* Add a nvme hwmon directory to the ssds */
+/*   Scan temp#_label for the Composite item, or else the first Sensor item. */
+/*   Returns FALSE if the directory has neither or the list is full. */
 
-static int
-check_temperature()
+static gboolean
+attach_ssd_chip(int dir_fd, int hwmon_num, const char *name)
 {
-	enum check_temperature_source_enum { SENSORS_SOURCE, SYS_DEV_SOURCE, THINKPAD_SOURCE, NO_SOURCE };
-	FILE *f;
+	struct ssd *ssd;
+	char path[ 20 ];
 	char buf[ MAX_BUF ];
+	int ssd_ind = 0;
+	int ssd_sensor_ind = 0;
 	int i;
-	int temp;
-	int result;
-	char *path;
-	char *ssd_hwmon_path;
-	int ssd_hwmon_dir_fd;
-	struct stat stat_buf;
-	static enum check_temperature_source_enum source = NO_SOURCE;
-	static char *hwmon_path = NULL;
-	static char *hwmon_path2 = NULL;
-	static int generic_hwmon_dir_fd = -1;
-	static int thinkpad_hwmon_dir_fd = -1;
-	static uint64_t temp_set = 0;
-	static int temp_min_ind = 0;
-	static int temp_max_ind = -1;
-	static const char *temperature_source_names[] = { "sensors", "generic hwmon", "thinkpad hwmon", "no" };
 
-	result = 0;
+	if (num_ssds >= MAX_SSDS) {
+		if (log_file != NULL) {
+			fprintf(log_file, "ssd %s skipped, already using %d ssds\n", name, num_ssds);
+		}
+		return FALSE;
+	}
 
-	/* one-time initialization */
+	for (i = 1; i < 10; i++) {
+		sprintf(path, "temp%d_label", i);
+		if (read_sys_file(dir_fd, path, buf, MAX_BUF) <= 0) {
+			continue;
+		}
+		if (strncmp(buf, "Comp", 4) == 0) {
+			ssd_ind = i;
+			if (debug && log_file != NULL) {
+				fprintf(log_file, "found ssd composite %d with %s\n", i, buf);
+			}
+		} else if (ssd_sensor_ind <= 0 && strncmp(buf, "Sens", 4) == 0) {
+			ssd_sensor_ind = i;
+			if (debug && log_file != NULL) {
+				fprintf(log_file, "found ssd sensor %d with %s\n", i, buf);
+			}
+		}
+	}
+	if (ssd_ind <= 0) {
+		ssd_ind = ssd_sensor_ind;
+	}
+	if (ssd_ind <= 0) {
+		if (debug && log_file != NULL) {
+			fprintf(log_file, "did not find good hmon ssd temp item\n");
+		}
+		return FALSE;
+	}
 
-	if (source == NO_SOURCE) {
+	ssd = &ssds[ num_ssds ];
+	memset(ssd, 0, sizeof(*ssd));
+	init_hwmon_chip(&ssd->chip, dir_fd, hwmon_num);
+	strncpy(ssd->name, name, SENSOR_NAME_LEN - 1);
+	sprintf(ssd->temp_path, "temp%d_input", ssd_ind);
+	ssd->slot = sensor_value_slot(ssd->name, SENSOR_TEMP, &ssd_text);
+	num_ssds++;
+	if (log_file != NULL) {
+		fprintf(log_file, " ssd %s using hwmon%d %s\n", ssd->name, hwmon_num, ssd->temp_path);
+	}
+	return TRUE;
+}
 
-		/* scan for the thinkpad item */
+/* Remove a ssd after its hwmon directory went away */
+/*   The other ssds keep their open directories */
 
-		strcpy(buf, "/sys/devices/platform/thinkpad_hwmon/hwmon/hwmon#/temp1_label");
+static gboolean
+detach_ssd_chip(int hwmon_num)
+{
+	int i;
 
-		for (i = 0; i < 10; i++) {
-			buf[ THINKPAD_HWMON_IND_POS ] = (char) ('0' + i);
-			if (debug && log_file != NULL) {
-				fprintf(log_file, "hwmon scan, checking for '%s'\n", buf);
-			}
-			if (stat(buf, &stat_buf) == 0) {
-				source = THINKPAD_SOURCE;
-				hwmon_path = malloc(strlen(buf) + 10);
-				if (hwmon_path == NULL) {
-					if (log_file != NULL) {
-						fprintf(log_file, "could not allocate hwmon path\n");
-					}
-					exit_temperature();
-				}
-				strcpy(hwmon_path, buf);
-				buf[ THINKPAD_HWMON_IND_POS + 1 ] = '\0';
-				thinkpad_hwmon_dir_fd = open(buf, O_DIRECTORY | __O_PATH);
-				if (thinkpad_hwmon_dir_fd == -1) {
-					if (log_file != NULL) {
-						fprintf(log_file, "path open of fan dir %s failed\n", buf);
-					}
-					exit_temperature();
-				}
-				hwmon_fan_speed_dir_fd = thinkpad_hwmon_dir_fd;
-				hwmon_gpu_temp_dir_fd = thinkpad_hwmon_dir_fd;
-				break;
+	for (i = 0; i < num_ssds; i++) {
+		if (ssds[i].chip.hwmon_num == hwmon_num) {
+			if (log_file != NULL) {
+				fprintf(log_file, "ssd %s hwmon%d removed at %s\n", ssds[i].name, hwmon_num, show_time());
 			}
+			set_sensor_value(ssds[i].slot, 0);
+			close(ssds[i].chip.dir_fd);
+			num_ssds--;
+			memmove(&ssds[i], &ssds[i+1], (num_ssds - i) * sizeof(struct ssd));
+			return TRUE;
 		}
+	}
+	return FALSE;
+}
 
-		/* scan temp#_label with the CPU item */
+/* Use a graphics driver hwmon directory for the gpu temperature */
 
-		if (source == THINKPAD_SOURCE) {
-			int thinkpad_cpu_ind = -1;
-			int thinkpad_gpu_ind = -1;
-			for (i = 1; i < 10; i++) {
-				hwmon_path[ THINKPAD_TEMP_IND_POS ] = (char) ('0' + i);
-				if (debug && log_file != NULL) {
-					fprintf(log_file, "temp scan, checking for '%s'\n", hwmon_path);
-				}
-				f = fopen(hwmon_path, "r");
-				if (f == NULL) {
-					continue;
-				}
-				if (fgets(buf, MAX_BUF, f) != NULL) {
-					if (thinkpad_cpu_ind < 0 && strncmp(buf, "CPU", 3) == 0) {
-						thinkpad_cpu_ind = i;
-						if (debug && log_file != NULL) {
-							fprintf(log_file, "using CPU temp %d with %s\n", i, buf);
-						}
-					} else if (thinkpad_gpu_ind < 0 && strncmp(buf, "GPU", 3) == 0) {
-						thinkpad_gpu_ind = i;
-						if (debug && log_file != NULL) {
-							fprintf(log_file, "using GPU temp %d with %s\n", i, buf);
-						}
-					}
-				}
-				fclose(f);
-				if (thinkpad_cpu_ind >= 0 && thinkpad_gpu_ind >= 0) {
+static void
+attach_gpu_chip(int dir_fd, int hwmon_num)
+{
+	static char gpu_temp_path[] = "temp1_input";
+
+	init_hwmon_chip(&gpu_chip, dir_fd, hwmon_num);
+	memset(&gpu_temp_reading, 0, sizeof(gpu_temp_reading));
+	hwmon_gpu_temp_chip = &gpu_chip;
+	hwmon_gpu_temp_path = gpu_temp_path;
+	gpu_temp_slot = sensor_value_slot("gpu", SENSOR_TEMP, &gpu_text);
+	if (log_file != NULL) {
+		fprintf(log_file, " gpu using hwmon%d at %s\n", hwmon_num, show_time());
+	}
+}
+
+/* Stop using the gpu hwmon directory */
+
+static void
+detach_gpu_chip()
+{
+	if (log_file != NULL) {
+		fprintf(log_file, "gpu hwmon%d removed at %s\n", gpu_chip.hwmon_num, show_time());
+	}
+	set_sensor_value(gpu_temp_slot, 0);
+	hwmon_gpu_temp_path = NULL;
+	hwmon_gpu_temp_chip = NULL;
+	close(gpu_chip.dir_fd);
+	gpu_chip.dir_fd = -1;
+	gpu_chip.hwmon_num = -1;
+}
+
+/* SATA drive temperatures from the drivetemp driver */
+/*   One drive is read per call, in turn, so a tick never touches every disk. */
+/*   Drives that are not running, are runtime suspended, or have had no io */
+/*   for drive_idle_time seconds are skipped because reading the temperature */
+/*   could spin them up.  They keep their last value.  A drive is idle until */
+/*   the applet sees its io count change, so a drive in standby is not read */
+/*   at startup or after it is hotplugged. */
+
+enum drive_enum { MAX_DRIVES = 32, DRIVE_NAME_LEN = 16 };
+
+struct drive {
+	char name[ DRIVE_NAME_LEN ];	/* block device name, like sda */
+	struct hwmon_chip chip;		/* drivetemp hwmon directory */
+	struct hwmon_reading reading;	/* last temp1_input value */
+	int slot;			/* sensor value slot */
+	int temp;			/* last temperature in degrees, 0 if not known */
+	unsigned long long io_count;	/* reads plus writes from the block stat file */
+	gboolean io_known;		/* io_count has been read */
+	time_t io_change_time;		/* time when io_count last changed, 0 if it has not */
+};
+
+static struct drive drives[ MAX_DRIVES ];
+static int num_drives = 0;
+static int next_drive = 0;		/* next drive to sample */
+static int drive_slot = -1;		/* sensor value slot for the hottest drive */
+
+/* Find the block device name of a drive */
+/*   A hotplugged drive may not have its block device yet, */
+/*   so this is tried again until it works */
+
+static gboolean
+find_drive_name(struct drive *drive)
+{
+	DIR *dir;
+	struct dirent *ent;
+	int fd;
+	gboolean found = FALSE;
+
+	fd = openat(drive->chip.dir_fd, "device/block", O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		return FALSE;
+	}
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		close(fd);
+		return FALSE;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] != '.' && strlen(ent->d_name) < DRIVE_NAME_LEN) {
+			strcpy(drive->name, ent->d_name);
+			drive->slot = sensor_value_slot(drive->name, SENSOR_TEMP, &drive_text);
+			found = TRUE;
+			break;
+		}
+	}
+	closedir(dir);
+
+	return found;
+}
+
+/* Add a drivetemp hwmon directory */
+
+static void
+add_drive(int dir_fd, int hwmon_num)
+{
+	struct drive *drive;
+
+	if (num_drives >= MAX_DRIVES) {
+		close(dir_fd);
+		return;
+	}
+
+	drive = &drives[ num_drives ];
+	memset(drive, 0, sizeof(*drive));
+	init_hwmon_chip(&drive->chip, dir_fd, hwmon_num);
+	drive->slot = -1;
+	if (!find_drive_name(drive)) {
+		sprintf(drive->name, "hwmon%d", hwmon_num);
+	}
+	num_drives++;
+
+	if (drive_slot < 0) {
+		drive_slot = sensor_value_slot("drive", SENSOR_TEMP, &drive_text);
+	}
+
+	if (log_file != NULL) {
+		fprintf(log_file, " sata drive %s using drivetemp hwmon%d\n", drive->name, hwmon_num);
+	}
+}
+
+/* Remove a drive after its hwmon directory went away */
+/*   The other drives keep their open directories */
+
+static gboolean
+remove_drive(int hwmon_num)
+{
+	int i;
+
+	for (i = 0; i < num_drives; i++) {
+		if (drives[i].chip.hwmon_num == hwmon_num) {
+			if (log_file != NULL) {
+				fprintf(log_file, "sata drive %s removed at %s\n", drives[i].name, show_time());
+			}
+			set_sensor_value(drives[i].slot, 0);
+			close(drives[i].chip.dir_fd);
+			num_drives--;
+			memmove(&drives[i], &drives[i+1], (num_drives - i) * sizeof(struct drive));
+			if (next_drive >= num_drives) {
+				next_drive = 0;
+			}
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* Check if a hwmon directory is already in use */
+
+static gboolean
+hwmon_in_use(int hwmon_num)
+{
+	int i;
+
+	if (thinkpad_chip.hwmon_num == hwmon_num || coretemp_chip.hwmon_num == hwmon_num ||
+	    gpu_chip.hwmon_num == hwmon_num) {
+		return TRUE;
+	}
+	for (i = 0; i < num_drives; i++) {
+		if (drives[i].chip.hwmon_num == hwmon_num) {
+			return TRUE;
+		}
+	}
+	for (i = 0; i < num_ssds; i++) {
+		if (ssds[i].chip.hwmon_num == hwmon_num) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* Find the drivetemp hwmon directories that are not in use yet */
+
+static void
+scan_drives()
+{
+	DIR *dir;
+	struct dirent *ent;
+	char path[ MAX_BUF ];
+	char buf[ MAX_BUF ];
+	int dir_fd;
+
+	dir = opendir("/sys/class/hwmon");
+	if (dir == NULL) {
+		return;
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		if (strncmp(ent->d_name, "hwmon", 5) != 0 || strlen(ent->d_name) > MAX_BUF - 10 ||
+		    hwmon_in_use(atoi(&ent->d_name[5]))) {
+			continue;
+		}
+		sprintf(path, "%s/name", ent->d_name);
+		if (read_sys_file(dirfd(dir), path, buf, MAX_BUF) <= 0 || strncmp(buf, "drivetemp", 9) != 0) {
+			continue;
+		}
+		dir_fd = openat(dirfd(dir), ent->d_name, O_DIRECTORY | __O_PATH);
+		if (dir_fd != -1) {
+			add_drive(dir_fd, atoi(&ent->d_name[5]));
+		}
+	}
+
+	closedir(dir);
+}
+
+/* Find the nvme hwmon directories that are not in use yet */
+/*   nvme0 is found first by the one-time scan, this adds the other controllers */
+
+static void
+scan_ssds()
+{
+	DIR *dir;
+	DIR *ctrl_dir;
+	struct dirent *ent;
+	struct dirent *hwmon_ent;
+	int ctrl_fd;
+	int dir_fd;
+
+	dir = opendir("/sys/class/nvme");
+	if (dir == NULL) {
+		return;
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		if (strncmp(ent->d_name, "nvme", 4) != 0 || strlen(ent->d_name) >= SENSOR_NAME_LEN) {
+			continue;
+		}
+		ctrl_fd = openat(dirfd(dir), ent->d_name, O_RDONLY | O_DIRECTORY);
+		if (ctrl_fd == -1) {
+			continue;
+		}
+		ctrl_dir = fdopendir(ctrl_fd);
+		if (ctrl_dir == NULL) {
+			close(ctrl_fd);
+			continue;
+		}
+		while ((hwmon_ent = readdir(ctrl_dir)) != NULL) {
+			if (strncmp(hwmon_ent->d_name, "hwmon", 5) != 0 || !isdigit(hwmon_ent->d_name[5]) ||
+			    hwmon_in_use(atoi(&hwmon_ent->d_name[5]))) {
+				continue;
+			}
+			dir_fd = openat(ctrl_fd, hwmon_ent->d_name, O_DIRECTORY | __O_PATH);
+			if (dir_fd != -1 && !attach_ssd_chip(dir_fd, atoi(&hwmon_ent->d_name[5]), ent->d_name)) {
+				close(dir_fd);
+			}
+		}
+		closedir(ctrl_dir);
+	}
+
+	closedir(dir);
+}
+
+/* Check if a drive may be spun down */
+
+static gboolean
+drive_is_idle(struct drive *drive, time_t current_time)
+{
+	char path[ MAX_BUF ];
+	char buf[ MAX_BUF ];
+	unsigned long long rd_ios, rd_merges, rd_sectors, rd_ticks, wr_ios;
+	unsigned long long io_count;
+
+	if (read_sys_file(drive->chip.dir_fd, "device/state", buf, MAX_BUF) > 0 && strncmp(buf, "running", 7) != 0) {
+		return TRUE;
+	}
+	if (read_sys_file(drive->chip.dir_fd, "device/power/runtime_status", buf, MAX_BUF) > 0 && strncmp(buf, "suspended", 9) == 0) {
+		return TRUE;
+	}
+
+	sprintf(path, "device/block/%s/stat", drive->name);
+	if (read_sys_file(drive->chip.dir_fd, path, buf, MAX_BUF) > 0 &&
+	    sscanf(buf, "%llu %llu %llu %llu %llu", &rd_ios, &rd_merges, &rd_sectors, &rd_ticks, &wr_ios) == 5) {
+		io_count = rd_ios + wr_ios;
+		if (!drive->io_known) {
+			drive->io_known = TRUE;
+			drive->io_count = io_count;
+		} else if (io_count != drive->io_count) {
+			drive->io_count = io_count;
+			drive->io_change_time = current_time;
+		}
+	}
+
+	return (drive_idle_time > 0 &&
+		(drive->io_change_time == 0 || current_time - drive->io_change_time >= drive_idle_time));
+}
+
+/* Read the next drive and return the hottest drive temperature */
+
+static int
+check_drive_temp(time_t current_time)
+{
+	struct drive *drive;
+	int result = 0;
+	int value;
+	int i;
+
+	for (i = 0; i < num_drives; i++) {
+		drive = &drives[ next_drive ];
+		next_drive = (next_drive + 1) % num_drives;
+		if (drive->slot < 0) {
+			find_drive_name(drive);
+		}
+		if (drive_is_idle(drive, current_time)) {
+			if (debug && log_file != NULL) {
+				fprintf(log_file, "drive %s is idle, not reading\n", drive->name);
+			}
+			continue;
+		}
+		if (read_hwmon_value(&drive->chip, "temp1_input", &drive->reading, &value)) {
+			drive->temp = value / 1000;
+			set_sensor_value(drive->slot, drive->temp);
+			if (debug && log_file != NULL) {
+				fprintf(log_file, "drive %s temp %d\n", drive->name, drive->temp);
+			}
+		}
+		break;
+	}
+
+	for (i = 0; i < num_drives; i++) {
+		if (result < drives[i].temp) {
+			result = drives[i].temp;
+		}
+	}
+	set_sensor_value(drive_slot, result);
+
+	return result;
+}
+
+/* Find the temp#_label items of the coretemp chip that map to CPU cores */
+/*   Cores that are offline have no items */
+
+static gboolean rescan_cores = FALSE;	/* cpus went online or offline */
+
+static void
+scan_core_labels(uint64_t *temp_set_ptr, int *temp_min_ind_ptr, int *temp_max_ind_ptr, int *core_temp_slot)
+{
+	char path[ 20 ];
+	char buf[ MAX_BUF ];
+	char core_name[ SENSOR_NAME_LEN ];
+	int i;
+
+	*temp_set_ptr = 0;
+	*temp_min_ind_ptr = 0;
+	*temp_max_ind_ptr = -1;
+
+	for (i = 1; i < 64; i++) {
+		sprintf(path, "temp%d_label", i);
+		if (debug && log_file != NULL) {
+			fprintf(log_file, "temp scan, checking for '%s'\n", path);
+		}
+		if (read_sys_file(coretemp_chip.dir_fd, path, buf, MAX_BUF) <= 0 || strncmp(buf, "Core", 4) != 0) {
+			continue;
+		}
+		if (*temp_set_ptr == 0) {
+			*temp_min_ind_ptr = i;
+		}
+		*temp_max_ind_ptr = i;
+		*temp_set_ptr |= (1ull << i);
+		sprintf(core_name, "core%d", atoi(&buf[4]) % 1000);
+		core_temp_slot[i] = sensor_value_slot(core_name, SENSOR_TEMP, &temp_text);
+		if (debug && log_file != NULL) {
+			fprintf(log_file, "using temp %d with %s", i, buf);
+		}
+	}
+}
+
+/* Find the current cpu temperature */
+
+static int
+check_temperature()
+{
+	enum check_temperature_source_enum { SENSORS_SOURCE, SYS_DEV_SOURCE, THINKPAD_SOURCE, NO_SOURCE };
+	FILE *f;
+	char buf[ MAX_BUF ];
+	int i;
+	int temp;
+	int result;
+	char *path;
+	char *ssd_hwmon_path;
+	int ssd_hwmon_dir_fd;
+	struct stat stat_buf;
+	static enum check_temperature_source_enum source = NO_SOURCE;
+	static char *hwmon_path = NULL;
+	static char *hwmon_path2 = NULL;
+	static int generic_hwmon_dir_fd = -1;
+	static int thinkpad_hwmon_dir_fd = -1;
+	static struct hwmon_reading thinkpad_cpu_reading;
+	static struct hwmon_reading core_reading[ 64 ];
+	static uint64_t temp_set = 0;
+	static int temp_min_ind = 0;
+	static int temp_max_ind = -1;
+	static int cpu_temp_slot = -1;
+	static int core_temp_slot[ 64 ];
+	static const char *temperature_source_names[] = { "sensors", "generic hwmon", "thinkpad hwmon", "no" };
+
+	result = 0;
+
+	/* one-time initialization */
+
+	if (source == NO_SOURCE) {
+
+		/* scan for the thinkpad item */
+
+		strcpy(buf, "/sys/devices/platform/thinkpad_hwmon/hwmon/hwmon#/temp1_label");
+
+		for (i = 0; i < 10; i++) {
+			buf[ THINKPAD_HWMON_IND_POS ] = (char) ('0' + i);
+			if (debug && log_file != NULL) {
+				fprintf(log_file, "hwmon scan, checking for '%s'\n", buf);
+			}
+			if (stat(buf, &stat_buf) == 0) {
+				source = THINKPAD_SOURCE;
+				hwmon_path = malloc(strlen(buf) + 10);
+				if (hwmon_path == NULL) {
+					if (log_file != NULL) {
+						fprintf(log_file, "could not allocate hwmon path\n");
+					}
+					exit_temperature();
+				}
+				strcpy(hwmon_path, buf);
+				buf[ THINKPAD_HWMON_IND_POS + 1 ] = '\0';
+				thinkpad_hwmon_dir_fd = open(buf, O_DIRECTORY | __O_PATH);
+				if (thinkpad_hwmon_dir_fd == -1) {
+					if (log_file != NULL) {
+						fprintf(log_file, "path open of fan dir %s failed\n", buf);
+					}
+					exit_temperature();
+				}
+				init_hwmon_chip(&thinkpad_chip, thinkpad_hwmon_dir_fd, i);
+				hwmon_fan_speed_chip = &thinkpad_chip;
+				hwmon_gpu_temp_chip = &thinkpad_chip;
+				break;
+			}
+		}
+
+		/* scan temp#_label with the CPU item */
+
+		if (source == THINKPAD_SOURCE) {
+			int thinkpad_cpu_ind = -1;
+			int thinkpad_gpu_ind = -1;
+			for (i = 1; i < 10; i++) {
+				hwmon_path[ THINKPAD_TEMP_IND_POS ] = (char) ('0' + i);
+				if (debug && log_file != NULL) {
+					fprintf(log_file, "temp scan, checking for '%s'\n", hwmon_path);
+				}
+				f = fopen(hwmon_path, "r");
+				if (f == NULL) {
+					continue;
+				}
+				if (fgets(buf, MAX_BUF, f) != NULL) {
+					if (thinkpad_cpu_ind < 0 && strncmp(buf, "CPU", 3) == 0) {
+						thinkpad_cpu_ind = i;
+						if (debug && log_file != NULL) {
+							fprintf(log_file, "using CPU temp %d with %s\n", i, buf);
+						}
+					} else if (thinkpad_gpu_ind < 0 && strncmp(buf, "GPU", 3) == 0) {
+						thinkpad_gpu_ind = i;
+						if (debug && log_file != NULL) {
+							fprintf(log_file, "using GPU temp %d with %s\n", i, buf);
+						}
+					}
+				}
+				fclose(f);
+				if (thinkpad_cpu_ind >= 0 && thinkpad_gpu_ind >= 0) {
 					break;
 				}
 			}
@@ -324,12 +1111,15 @@ check_temperature()
 				}
 				if (check_fan_speed() < 0) {
 					hwmon_fan_speed_path = NULL;
+				} else {
+					fan_speed_slot = sensor_value_slot("fan1", SENSOR_FAN, &fan_text);
 				}
 				if (thinkpad_gpu_ind > 0) {
 					hwmon_gpu_temp_path = (char *) malloc(20);
 					if (hwmon_gpu_temp_path != NULL) {
 						strcpy(hwmon_gpu_temp_path, "temp#_input");
 						hwmon_gpu_temp_path[ 4 ] = (char) ('0' + thinkpad_gpu_ind);
+						gpu_temp_slot = sensor_value_slot("gpu", SENSOR_TEMP, &gpu_text);
 						if (debug && log_file != NULL) {
 							fprintf(log_file, "using gpu temp %s\n", hwmon_gpu_temp_path);
 						}
@@ -379,6 +1169,7 @@ check_temperature()
 						}
 						exit_temperature();
 					}
+					init_hwmon_chip(&coretemp_chip, generic_hwmon_dir_fd, i);
 					break;
 				}
 			}
@@ -387,34 +1178,7 @@ check_temperature()
 		/* scan for the list of temp#_label items that map to CPU cores */
 
 		if (source == SYS_DEV_SOURCE) {
-			for (i = 1; i < 64; i++) {
-				if (i < 10) {
-					path = hwmon_path;
-					path[ TEMP_IND_POS ] = (char) ('0' + i);
-				} else {
-					path = hwmon_path2;
-					path[ TEMP_IND_POS ] = (char) ('0' + i/10);
-					path[ TEMP_IND_POS+1 ] = (char) ('0' + i%10);
-				}
-				if (debug && log_file != NULL) {
-					fprintf(log_file, "temp scan, checking for '%s'\n", path);
-				}
-				f = fopen(path, "r");
-				if (f == NULL) {
-					continue;
-				}
-				if (fgets(buf, MAX_BUF, f) != NULL && strncmp(buf, "Core", 4) == 0) {
-					if (temp_set == 0) {
-						temp_min_ind = i;
-					}
-					temp_max_ind = i;
-					temp_set |= (1ull << i);
-					if (debug && log_file != NULL) {
-						fprintf(log_file, "using temp %d with %s\n", i, buf);
-					}
-				}
-				fclose(f);
-			}
+			scan_core_labels(&temp_set, &temp_min_ind, &temp_max_ind, core_temp_slot);
 
 			/* change the end of the path from "label" to "input" to read the values */
 
@@ -467,77 +1231,26 @@ check_temperature()
 		/* scan temp#_label with the Composite item */
 
 		if (ssd_hwmon_path != NULL && ssd_hwmon_dir_fd != -1) {
-			int ssd_ind = 0;
-			int ssd_sensor_ind = 0;
-			for (i = 1; i < 10; i++) {
-				ssd_hwmon_path[ DEV_NVME_HWMON_TEMP_IND_POS ] = (char) ('0' + i);
-				if (debug && log_file != NULL) {
-					fprintf(log_file, "temp scan, checking for '%s'\n", ssd_hwmon_path);
-				}
-				f = fopen(ssd_hwmon_path, "r");
-				if (f == NULL) {
-					continue;
-				}
-				if (fgets(buf, MAX_BUF, f) != NULL) {
-					if (strncmp(buf, "Comp", 4) == 0) {
-						ssd_ind = i;
-						if (debug && log_file != NULL) {
-							fprintf(log_file, "found ssd composite %d with %s\n", i, buf);
-						}
-						/* break; */ /* XXX */
-					} else if (ssd_sensor_ind <= 0 && strncmp(buf, "Sens", 4) == 0) {
-						ssd_sensor_ind = i;
-						if (debug && log_file != NULL) {
-							fprintf(log_file, "found ssd sensor %d with %s\n", i, buf);
-						}
-					}
-				}
-				fclose(f);
-			}
-			if (ssd_ind <= 0) {
-				ssd_ind = ssd_sensor_ind;
-			}
-			if (ssd_ind > 0) {
-				/* found the ssd temperature item */
-				/* change the end of the path from "label" to "input" to read the values */
-				ssd_hwmon_path[ DEV_NVME_HWMON_TEMP_IND_POS ] = (char) ('0' + ssd_ind);
-				strcpy(&ssd_hwmon_path[ DEV_NVME_HWMON_TEMP_IND_POS+2 ], "input");
-				if (debug && log_file != NULL) {
-					fprintf(log_file, "using ssd %s\n", ssd_hwmon_path);
-				}
-				hwmon_ssd_temp_path = ssd_hwmon_path;
-				if (check_ssd_temp() < 0) {
-					hwmon_ssd_temp_path = NULL;
-				}
-				if (ssd_ind > 0) {
-					hwmon_ssd_temp_path = (char *) malloc(20);
-					if (hwmon_ssd_temp_path != NULL) {
-						strcpy(hwmon_ssd_temp_path, "temp#_input");
-						hwmon_ssd_temp_path[ 4 ] = (char) ('0' + ssd_ind);
-						if (debug && log_file != NULL) {
-							fprintf(log_file, "using ssd temp %s\n", hwmon_ssd_temp_path);
-						}
-					}
-				}
-			}
-
-			/* check that we found something */
-
-			if (ssd_ind <= 0) {
-				if (debug && log_file != NULL) {
-					fprintf(log_file, "did not find good hmon ssd temp item\n");
-				}
+			if (!attach_ssd_chip(ssd_hwmon_dir_fd, i, "nvme0")) {
+				close(ssd_hwmon_dir_fd);
 			}
+			free(ssd_hwmon_path);
+			ssd_hwmon_path = NULL;
 		}
 
-		hwmon_ssd_temp_dir_fd = ssd_hwmon_dir_fd;
-
 		/* fall back to using the sensors utility */
 
 		if (source == NO_SOURCE) {
 			source = SENSORS_SOURCE;
 		}
 
+		cpu_temp_slot = sensor_value_slot("cpu", SENSOR_TEMP, &temp_text);
+
+		/* scan for other nvme ssds and sata drives */
+
+		scan_ssds();
+		scan_drives();
+
 		/* log the source */
 
 		if (log_file != NULL) {
@@ -546,28 +1259,35 @@ check_temperature()
 		}
 	}
 
+	/* rescan the cores after cpus went online or offline */
+
+	if (rescan_cores) {
+		rescan_cores = FALSE;
+		if (source == SYS_DEV_SOURCE) {
+			for (i = temp_min_ind; i <= temp_max_ind; i++) {
+				if (((1ull << i) & temp_set) != 0) {
+					set_sensor_value(core_temp_slot[i], 0);
+				}
+			}
+			scan_core_labels(&temp_set, &temp_min_ind, &temp_max_ind, core_temp_slot);
+			memset(core_reading, 0, sizeof(core_reading));
+		}
+	}
+
 	/* read the core temperatures using sys dev files */
 
 	if (source == THINKPAD_SOURCE) {
-		int fd = openat(thinkpad_hwmon_dir_fd, &hwmon_path[ THINKPAD_HWMON_IND_POS + 2 ], O_RDONLY);
-		if (fd != -1) {
-			int len = read(fd, buf, MAX_BUF - 1);
-			if (len > 0) {
-				if (len > MAX_BUF - 1) len = MAX_BUF - 1;
-				buf[ len ] = '\0';
-				result = atoi(buf) / 1000;
-				if (debug && log_file != NULL) {
-					fprintf(log_file, "read thinkpad CPU temp value %d\n", result);
-				}
+		if (read_hwmon_value(&thinkpad_chip, &hwmon_path[ THINKPAD_HWMON_IND_POS + 2 ], &thinkpad_cpu_reading, &temp)) {
+			result = temp / 1000;
+			if (debug && log_file != NULL) {
+				fprintf(log_file, "read thinkpad CPU temp value %d\n", result);
 			}
-			close(fd);
 		}
+		set_sensor_value(cpu_temp_slot, result);
 		return result;
 	}
 
 	if (source == SYS_DEV_SOURCE) {
-		int fd;
-		int len;
 		for (i = temp_min_ind; i <= temp_max_ind; i++) {
 			if (((1ull << i) & temp_set) != 0) {
 				if (i < 10) {
@@ -578,24 +1298,19 @@ check_temperature()
 					path[ TEMP_IND_POS ] = (char) ('0' + i/10);
 					path[ TEMP_IND_POS+1 ] = (char) ('0' + i%10);
 				}
-				fd = openat(generic_hwmon_dir_fd, &path[ HWMON_IND_POS + 2 ], O_RDONLY);
-				if (fd != -1) {
-					len = read(fd, buf, MAX_BUF - 1);
-					if (len > 0) {
-						if (len > MAX_BUF - 1) len = MAX_BUF - 1;
-						buf[ len ] = '\0';
-						temp = atoi(buf) / 1000;
-						if (result < temp) {
-							result = temp;
-						}
-						if (debug && log_file != NULL) {
-							fprintf(log_file, "temp ind %d value %d\n", i, temp);
-						}
+				if (read_hwmon_value(&coretemp_chip, &path[ HWMON_IND_POS + 2 ], &core_reading[i], &temp)) {
+					temp /= 1000;
+					if (result < temp) {
+						result = temp;
+					}
+					set_sensor_value(core_temp_slot[i], temp);
+					if (debug && log_file != NULL) {
+						fprintf(log_file, "temp ind %d value %d\n", i, temp);
 					}
-					close(fd);
 				}
 			}
 		}
+		set_sensor_value(cpu_temp_slot, result);
 		return result;
 	}
 
@@ -659,70 +1374,2538 @@ check_temperature()
 
 	pclose(f);
 
+	set_sensor_value(cpu_temp_slot, result);
+
 	return result;
 }
 
-/* Read an interval */
-/*   return TRUE and read the value if id matches the name */
-/*   return FALSE otherwise */
+/* Label format */
+/*   The format option is compiled once into a list of ops. */
+/*   Text ops copy a literal, the other ops look up sensor values. */
+/*   Placeholders are {pattern}, {pattern.max}, {pattern.min}, {pattern.avg}, */
+/*   {pattern.icon} and {pattern.unit}, where the pattern can use * to match */
+/*   several sensors, and {{ is a literal brace. */
+
+enum format_enum { MAX_FORMAT_OPS = 32, FORMAT_POOL_LEN = 512 };
+
+enum format_op_type_enum { FORMAT_TEXT, FORMAT_MAX, FORMAT_MIN, FORMAT_AVG, FORMAT_ICON, FORMAT_UNIT };
+
+struct format_op {
+	enum format_op_type_enum type;	/* what to show */
+	unsigned short pos;		/* offset of the text or pattern in format_pool */
+	unsigned short len;		/* length of the text */
+	int generation;			/* sensor generation of the matches */
+	uint64_t matches;		/* sensor slots that match the pattern */
+	int value;			/* value from the last render */
+	int shown_value;		/* value in the label */
+};
+
+static struct format_op format_ops[ MAX_FORMAT_OPS ];
+static int num_format_ops = 0;
+static char format_pool[ FORMAT_POOL_LEN ];	/* literals and nul terminated patterns */
+static int format_pool_len = 0;
+static int format_generation = 0;		/* changes when the setup file is read */
+
+/* Add a string to the format pool */
+/*   Returns the offset, or -1 if the pool is full */
+
+static int
+add_format_pool(const char *str, int len)
+{
+	int pos;
+
+	if (format_pool_len + len + 1 > FORMAT_POOL_LEN) {
+		return -1;
+	}
+	pos = format_pool_len;
+	memcpy(&format_pool[ pos ], str, len);
+	format_pool[ pos + len ] = '\0';
+	format_pool_len += len + 1;
+	return pos;
+}
+
+/* Add an op to the format */
 
 static gboolean
-check_read_interval(const char *setup_name, const char *id, const char *interval_name, int *interval_ptr, int min_val, int max_val, const char *units, const char *buf, int len)
+add_format_op(enum format_op_type_enum type, const char *str, int len)
+{
+	struct format_op *op;
+	int pos;
+
+	if (len <= 0 && type == FORMAT_TEXT) {
+		return TRUE;
+	}
+	if (num_format_ops >= MAX_FORMAT_OPS || (pos = add_format_pool(str, len)) < 0) {
+		return FALSE;
+	}
+	op = &format_ops[ num_format_ops++ ];
+	memset(op, 0, sizeof(*op));
+	op->type = type;
+	op->pos = (unsigned short) pos;
+	op->len = (unsigned short) len;
+	op->generation = -1;
+	op->value = op->shown_value = -1;
+	return TRUE;
+}
+
+/* Compile a format string */
+/*   An empty format restores the built in label */
+
+static void
+compile_format(const char *format)
+{
+	static const struct { const char *suffix; enum format_op_type_enum type; } suffixes[] = {
+		{ ".max", FORMAT_MAX }, { ".min", FORMAT_MIN }, { ".avg", FORMAT_AVG },
+		{ ".icon", FORMAT_ICON }, { ".unit", FORMAT_UNIT }
+	};
+	const char *p;
+	const char *start;
+	const char *close_brace;
+	enum format_op_type_enum type;
+	int name_len;
+	int suffix_len;
+	int i;
+	gboolean ok = TRUE;
+
+	num_format_ops = 0;
+	format_pool_len = 0;
+	format_generation++;
+
+	start = format;
+	for (p = format; *p != '\0' && ok; p++) {
+		if (*p != '{') {
+			continue;
+		}
+		if (p[1] == '{') {
+			/* {{ is a literal brace */
+			ok = add_format_op(FORMAT_TEXT, start, p + 1 - start);
+			start = p + 2;
+			p++;
+			continue;
+		}
+		close_brace = strchr(p, '}');
+		if (close_brace == NULL) {
+			break;
+		}
+		ok = add_format_op(FORMAT_TEXT, start, p - start);
+		name_len = close_brace - (p + 1);
+		type = FORMAT_MAX;
+		for (i = 0; i < (int) (sizeof(suffixes) / sizeof(suffixes[0])); i++) {
+			suffix_len = strlen(suffixes[i].suffix);
+			if (name_len > suffix_len && strncmp(close_brace - suffix_len, suffixes[i].suffix, suffix_len) == 0) {
+				type = suffixes[i].type;
+				name_len -= suffix_len;
+				break;
+			}
+		}
+		if (ok) {
+			ok = add_format_op(type, p + 1, name_len);
+		}
+		start = close_brace + 1;
+		p = close_brace;
+	}
+	if (ok) {
+		ok = add_format_op(FORMAT_TEXT, start, strlen(start));
+	}
+
+	if (!ok) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Format '%s' is too long, using the default label.\n", format);
+		}
+		num_format_ops = 0;
+	}
+
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "Compiled format '%s' to %d ops.\n", format, num_format_ops);
+	}
+}
+
+/* Append a string to a buffer */
+
+static int
+append_text(char *buf, int pos, int buf_len, const char *str, int len)
+{
+	if (pos + len > buf_len - 1) {
+		len = buf_len - 1 - pos;
+	}
+	if (len > 0) {
+		memcpy(&buf[ pos ], str, len);
+		pos += len;
+	}
+	return pos;
+}
+
+/* Append a number to a buffer */
+
+static int
+append_number(char *buf, int pos, int buf_len, int value)
+{
+	char digits[ 12 ];
+	int len = sizeof(digits);
+	unsigned int n = (unsigned int) (value < 0? -value: value);
+
+	do {
+		digits[ --len ] = (char) ('0' + n % 10);
+		n /= 10;
+	} while (n > 0 && len > 1);
+	if (value < 0) {
+		digits[ --len ] = '-';
+	}
+	return append_text(buf, pos, buf_len, &digits[ len ], sizeof(digits) - len);
+}
+
+/* Render the format into a buffer */
+/*   Returns a bit mask of the ops whose value changed since the label was last shown */
+
+static uint64_t
+render_format(char *buf, int buf_len)
+{
+	struct format_op *op;
+	const struct sensor_value *sv;
+	const char *str;
+	uint64_t changed = 0;
+	uint64_t m;
+	int pos = 0;
+	int i;
+	int slot;
+	int count;
+	int value;
+	int v;
+
+	for (i = 0; i < num_format_ops; i++) {
+		op = &format_ops[i];
+		if (op->type == FORMAT_TEXT) {
+			pos = append_text(buf, pos, buf_len, &format_pool[ op->pos ], op->len);
+			continue;
+		}
+
+		/* refresh the matches after sensors were discovered */
+
+		if (op->generation != sensor_values_generation) {
+			op->matches = 0;
+			for (slot = 0; slot < num_sensor_values; slot++) {
+				if (fnmatch(&format_pool[ op->pos ], sensor_values[ slot ].name, 0) == 0) {
+					op->matches |= (1ull << slot);
+				}
+			}
+			op->generation = sensor_values_generation;
+			changed |= (1ull << i);
+		}
+
+		if (op->matches == 0) {
+			continue;
+		}
+
+		if (op->type == FORMAT_ICON || op->type == FORMAT_UNIT) {
+			sv = &sensor_values[ __builtin_ctzll(op->matches) ];
+			if (op->type == FORMAT_ICON) {
+				str = (sv->icon != NULL && *sv->icon != NULL? *sv->icon: "");
+				while (*str == ' ') str++;
+			} else if (sv->kind == SENSOR_FAN) {
+				str = "rpm";
+			} else {
+				str = (do_unicode? "\xC2\xB0" "C": "C");
+			}
+			pos = append_text(buf, pos, buf_len, str, strlen(str));
+			continue;
+		}
+
+		/* aggregate the available values */
+
+		count = 0;
+		value = 0;
+		for (m = op->matches, slot = 0; m != 0; m >>= 1, slot++) {
+			v = sensor_values[ slot ].value;
+			if ((m & 1) == 0 || v <= 0) {
+				continue;
+			}
+			if (count == 0) {
+				value = v;
+			} else if (op->type == FORMAT_AVG) {
+				value += v;
+			} else if (op->type == FORMAT_MAX? v > value: v < value) {
+				value = v;
+			}
+			count++;
+		}
+		if (count == 0) {
+			value = -1;
+		} else if (op->type == FORMAT_AVG) {
+			value = (value + count / 2) / count;
+		}
+
+		op->value = value;
+		if (value != op->shown_value) {
+			changed |= (1ull << i);
+		}
+		if (value >= 0) {
+			pos = append_number(buf, pos, buf_len, value);
+		}
+	}
+
+	buf[ pos ] = '\0';
+
+	return changed;
+}
+
+/* Remember the values shown in the label */
+
+static void
+mark_format_shown()
+{
+	int i;
+
+	for (i = 0; i < num_format_ops; i++) {
+		format_ops[i].shown_value = format_ops[i].value;
+	}
+}
+
+/* Sensor plugins */
+/*   Shared objects in plugindir export a struct temperature_plugin, see temperature_plugin.h. */
+/*   Their sensors get slots in the sensor value table next to the built-in sensors, */
+/*   and every interval each plugin fills its part of one sample array. */
+
+enum plugin_enum { MAX_PLUGINS = 8, MAX_PLUGIN_SENSORS = 32, PLUGIN_TEXT_LEN = 512 };
+
+struct loaded_plugin {
+	void *handle;			/* from dlopen */
+	const struct temperature_plugin *plugin;
+	int first_sensor;		/* index in plugin_sensors */
+	int num_sensors;
+};
+
+static char *plugin_dir = NULL;		/* plugindir from the setup file */
+static struct loaded_plugin plugins[ MAX_PLUGINS ];
+static int num_plugins = 0;
+static struct temperature_plugin_sensor plugin_sensors[ MAX_PLUGIN_SENSORS ];
+static struct temperature_plugin_sample plugin_samples[ MAX_PLUGIN_SENSORS ];
+static int plugin_sensor_slots[ MAX_PLUGIN_SENSORS ];
+static int num_plugin_sensors = 0;
+static int plugin_hot_sensor = -1;	/* sensor at or above its warning level, -1 if none */
+static char plugin_tooltip_text[ PLUGIN_TEXT_LEN ];	/* plugin readings for the tooltip */
+
+/* Unload the plugins */
+
+static void
+unload_plugins()
+{
+	int i;
+
+	for (i = 0; i < num_plugins; i++) {
+		if (plugins[i].plugin->fini != NULL) {
+			(*plugins[i].plugin->fini)();
+		}
+		if (plugins[i].handle != NULL) {
+			dlclose(plugins[i].handle);
+		}
+	}
+	for (i = 0; i < num_plugin_sensors; i++) {
+		set_sensor_value(plugin_sensor_slots[i], 0);
+	}
+	num_plugins = 0;
+	num_plugin_sensors = 0;
+	plugin_hot_sensor = -1;
+	plugin_tooltip_text[0] = '\0';
+}
+
+/* Add a plugin and its sensors */
+/*   handle is NULL for plugins built into the applet */
+
+static void
+add_plugin(void *handle, const struct temperature_plugin *plugin, const char *path)
+{
+	struct loaded_plugin *lp;
+	int count;
+	int i;
+
+	memset(&plugin_sensors[ num_plugin_sensors ], 0, (MAX_PLUGIN_SENSORS - num_plugin_sensors) * sizeof(plugin_sensors[0]));
+	count = (*plugin->init)(&plugin_sensors[ num_plugin_sensors ], MAX_PLUGIN_SENSORS - num_plugin_sensors);
+	if (count <= 0 || count > MAX_PLUGIN_SENSORS - num_plugin_sensors) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Plugin '%s' init returned %d sensors.\n", path, count);
+		}
+		if (count > 0 && plugin->fini != NULL) {
+			(*plugin->fini)();
+		}
+		if (handle != NULL) {
+			dlclose(handle);
+		}
+		return;
+	}
+
+	lp = &plugins[ num_plugins++ ];
+	lp->handle = handle;
+	lp->plugin = plugin;
+	lp->first_sensor = num_plugin_sensors;
+	lp->num_sensors = count;
+
+	for (i = num_plugin_sensors; i < num_plugin_sensors + count; i++) {
+		plugin_sensors[i].name[ TEMPERATURE_PLUGIN_NAME_LEN - 1 ] = '\0';
+		plugin_sensor_slots[i] = external_sensor_slot(plugin_sensors[i].name,
+			(plugin_sensors[i].kind == TEMPERATURE_PLUGIN_FAN? SENSOR_FAN: SENSOR_TEMP),
+			(plugin_sensors[i].kind == TEMPERATURE_PLUGIN_FAN? &fan_text: &plugin_text),
+			(handle == NULL? "Command": "Plugin"));
+	}
+	num_plugin_sensors += count;
+
+	if (log_file != NULL) {
+		fprintf(log_file, "Loaded plugin '%s' (%s) with %d sensors.\n",
+			path, (plugin->name? plugin->name: "?"), count);
+	}
+}
+
+/* Load one plugin */
+
+static void
+load_plugin(const char *path)
+{
+	void *handle;
+	const struct temperature_plugin *plugin;
+
+	handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (handle == NULL) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Could not load plugin '%s': %s\n", path, dlerror());
+		}
+		return;
+	}
+	plugin = (const struct temperature_plugin *) dlsym(handle, TEMPERATURE_PLUGIN_SYMBOL);
+	if (plugin == NULL || plugin->abi_version != TEMPERATURE_PLUGIN_ABI_VERSION ||
+	    plugin->init == NULL || plugin->sample == NULL) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Plugin '%s' has no '%s' with abi version %d.\n",
+				path, TEMPERATURE_PLUGIN_SYMBOL, TEMPERATURE_PLUGIN_ABI_VERSION);
+		}
+		dlclose(handle);
+		return;
+	}
+
+	add_plugin(handle, plugin, path);
+}
+
+/* Command sensors */
+/*   Each command sensor starts "sh -c command" once and keeps it running. */
+/*   Every interval the applet writes a line "sample" to the helper's stdin, */
+/*   and the helper answers with a line holding the temperature in degrees C. */
+/*   Replies are read from the main loop, so a slow helper never blocks the panel. */
+/*   A helper that exits, does not reply within commandtimeout ms, or sends */
+/*   a line longer than the buffer is killed and restarted after a delay */
+/*   that doubles up to 5 minutes.  Each helper runs in its own process group, */
+/*   so the kill reaches every process of a pipeline, not just the shell. */
+/*   The sensors are served by a built-in plugin. */
+
+enum command_sensor_enum {
+	MAX_COMMAND_SENSORS = 8,
+	COMMAND_REPLY_LEN = 128,
+	MAX_COMMAND_RESTART_DELAY = 300,
+	DEFAULT_COMMAND_TIMEOUT = 2000
+};
+
+struct command_sensor {
+	char name[ TEMPERATURE_PLUGIN_NAME_LEN ];	/* sensor name */
+	char *command;			/* shell command of the helper */
+	pid_t pid;			/* helper process, 0 if not running */
+	int to_fd;			/* helper's stdin */
+	int from_fd;			/* helper's stdout */
+	guint watch;			/* main loop watch on from_fd */
+	guint timeout;			/* pending reply timeout */
+	char reply[ COMMAND_REPLY_LEN ];	/* partial reply line */
+	int reply_len;
+	int value;			/* last reply in millidegrees */
+	gboolean have_value;		/* value is from the running helper */
+	int failures;			/* consecutive failures */
+	time_t restart_time;		/* do not start before this time */
+};
+
+static struct command_sensor command_sensors[ MAX_COMMAND_SENSORS ];
+static int num_command_sensors = 0;
+static int command_timeout = DEFAULT_COMMAND_TIMEOUT;	/* ms to wait for a reply */
+
+/* Stop a helper */
+
+static void
+stop_command_sensor(struct command_sensor *cs)
+{
+	if (cs->watch != 0) {
+		g_source_remove(cs->watch);
+		cs->watch = 0;
+	}
+	if (cs->timeout != 0) {
+		g_source_remove(cs->timeout);
+		cs->timeout = 0;
+	}
+	if (cs->to_fd != -1) {
+		close(cs->to_fd);
+		cs->to_fd = -1;
+	}
+	if (cs->from_fd != -1) {
+		close(cs->from_fd);
+		cs->from_fd = -1;
+	}
+	if (cs->pid > 0) {
+		kill(-cs->pid, SIGTERM);
+		cs->pid = 0;
+	}
+	cs->reply_len = 0;
+	cs->have_value = FALSE;
+}
+
+/* Stop a helper after a failure and schedule the restart */
+
+static void
+fail_command_sensor(struct command_sensor *cs, const char *reason)
+{
+	int delay;
+
+	stop_command_sensor(cs);
+	if (cs->failures < 16) {
+		cs->failures++;
+	}
+	delay = 1 << (cs->failures - 1);
+	if (delay > MAX_COMMAND_RESTART_DELAY) {
+		delay = MAX_COMMAND_RESTART_DELAY;
+	}
+	cs->restart_time = time(NULL) + delay;
+	if (log_file != NULL) {
+		fprintf(log_file, "Command sensor '%s' %s at %s, restart in %d seconds.\n", cs->name, reason, show_time(), delay);
+		fflush(log_file);
+	}
+}
+
+/* Reap an exited helper */
+
+static void
+on_command_exit(GPid pid, gint status, gpointer data)
+{
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "command sensor helper %d exited with status %d\n", (int) pid, status);
+	}
+	g_spawn_close_pid(pid);
+}
+
+/* Give up on a reply */
+
+static gboolean
+on_command_timeout(gpointer data)
+{
+	struct command_sensor *cs = (struct command_sensor *) data;
+
+	cs->timeout = 0;
+	fail_command_sensor(cs, "did not reply");
+	return FALSE;
+}
+
+/* Read a reply from a helper */
+
+static gboolean
+on_command_reply(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	struct command_sensor *cs = (struct command_sensor *) data;
+	char *nl;
+	char *line;
+	char *end;
+	double degrees;
+	int len;
+
+	len = read(cs->from_fd, &cs->reply[ cs->reply_len ], COMMAND_REPLY_LEN - 1 - cs->reply_len);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return TRUE;
+	}
+	if (len <= 0) {
+		cs->watch = 0;
+		fail_command_sensor(cs, "exited");
+		return FALSE;
+	}
+	cs->reply_len += len;
+	cs->reply[ cs->reply_len ] = '\0';
+
+	nl = strrchr(cs->reply, '\n');
+	if (nl == NULL) {
+		if (cs->reply_len >= COMMAND_REPLY_LEN - 1) {
+			cs->watch = 0;
+			fail_command_sensor(cs, "sent a reply that is too long");
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	/* use the last complete line */
+	*nl = '\0';
+	line = strrchr(cs->reply, '\n');
+	line = (line? line + 1: cs->reply);
+	degrees = strtod(line, &end);
+	cs->have_value = (end != line && degrees > 0);
+	cs->value = (int) (degrees * 1000.0);
+	cs->reply_len = strlen(nl + 1);
+	memmove(cs->reply, nl + 1, cs->reply_len + 1);
+
+	if (cs->timeout != 0) {
+		g_source_remove(cs->timeout);
+		cs->timeout = 0;
+	}
+	cs->failures = 0;
+	return TRUE;
+}
+
+/* Put a helper in its own process group, in the child before exec */
+
+static void
+on_command_child_setup(gpointer data)
+{
+	setpgid(0, 0);
+}
+
+/* Start a helper */
+
+static gboolean
+start_command_sensor(struct command_sensor *cs)
+{
+	gchar *argv[] = { "/bin/sh", "-c", cs->command, NULL };
+	GIOChannel *channel;
+	GError *error = NULL;
+	GPid pid;
+	int to_fd;
+	int from_fd;
+
+	if (!g_spawn_async_with_pipes(NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+			on_command_child_setup, NULL, &pid, &to_fd, &from_fd, NULL, &error)) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Could not start command sensor '%s': %s\n", cs->name, (error != NULL? error->message: "unknown error"));
+		}
+		g_clear_error(&error);
+		return FALSE;
+	}
+
+	/* a helper that exits must not kill the applet with SIGPIPE */
+	signal(SIGPIPE, SIG_IGN);
+
+	fcntl(from_fd, F_SETFL, O_NONBLOCK);
+	cs->pid = pid;
+	cs->to_fd = to_fd;
+	cs->from_fd = from_fd;
+	cs->reply_len = 0;
+	g_child_watch_add(pid, on_command_exit, NULL);
+
+	channel = g_io_channel_unix_new(cs->from_fd);
+	cs->watch = g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR, on_command_reply, cs);
+	g_io_channel_unref(channel);
+
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "started command sensor '%s' pid %d: %s\n", cs->name, (int) pid, cs->command);
+	}
+	return TRUE;
+}
+
+/* Declare the command sensors and start their helpers */
+
+static int
+command_plugin_init(struct temperature_plugin_sensor *sensors, int max_sensors)
+{
+	struct command_sensor *cs;
+	int i;
+
+	for (i = 0; i < num_command_sensors && i < max_sensors; i++) {
+		cs = &command_sensors[i];
+		strcpy(sensors[i].name, cs->name);
+		sensors[i].kind = TEMPERATURE_PLUGIN_TEMP;
+		cs->restart_time = 0;
+		cs->failures = 0;
+		if (!start_command_sensor(cs)) {
+			fail_command_sensor(cs, "could not start");
+		}
+	}
+	return i;
+}
+
+/* Ask each helper for a sample and report the last replies */
+
+static int
+command_plugin_sample(struct temperature_plugin_sample *samples, int num_samples)
+{
+	struct command_sensor *cs;
+	static const char request[] = "sample\n";
+	int i;
+
+	for (i = 0; i < num_samples; i++) {
+		cs = &command_sensors[i];
+		samples[i].value = cs->value;
+		samples[i].valid = cs->have_value;
+		if (cs->pid == 0) {
+			if (time(NULL) < cs->restart_time || !start_command_sensor(cs)) {
+				continue;
+			}
+		}
+		if (cs->timeout != 0) {
+			/* still waiting for the last reply */
+			continue;
+		}
+		if (write(cs->to_fd, request, sizeof(request) - 1) != sizeof(request) - 1) {
+			fail_command_sensor(cs, "did not accept a request");
+			continue;
+		}
+		cs->timeout = g_timeout_add(command_timeout, on_command_timeout, cs);
+	}
+	return 0;
+}
+
+/* Stop the helpers */
+
+static void
+command_plugin_fini(void)
+{
+	int i;
+
+	for (i = 0; i < num_command_sensors; i++) {
+		stop_command_sensor(&command_sensors[i]);
+	}
+}
+
+static const struct temperature_plugin command_plugin = {
+	TEMPERATURE_PLUGIN_ABI_VERSION,
+	"command sensors",
+	command_plugin_init,
+	command_plugin_sample,
+	command_plugin_fini
+};
+
+/* Forget the command sensors from the setup file */
+
+static void
+clear_command_sensors()
+{
+	int i;
+
+	for (i = 0; i < num_command_sensors; i++) {
+		free(command_sensors[i].command);
+	}
+	num_command_sensors = 0;
+	command_timeout = DEFAULT_COMMAND_TIMEOUT;
+}
+
+/* Read a command sensor setting, "name shell command" */
+
+static void
+read_command_sensor(const char *setup_name, const char *buf)
+{
+	struct command_sensor *cs;
+	const char *p;
+	int len;
+
+	p = buf;
+	while (*p != '\0' && !isspace(*p)) p++;
+	len = p - buf;
+	while (isspace(*p)) p++;
+	if (len == 0 || len >= TEMPERATURE_PLUGIN_NAME_LEN || *p == '\0' || num_command_sensors >= MAX_COMMAND_SENSORS) {
+		if (log_file != NULL)
+			fprintf(log_file, "Setup file '%s' has bad or too many 'command' '%s'.\n", setup_name, buf);
+		return;
+	}
+	cs = &command_sensors[ num_command_sensors ];
+	memset(cs, 0, sizeof(*cs));
+	memcpy(cs->name, buf, len);
+	cs->command = strdup(p);
+	cs->to_fd = -1;
+	cs->from_fd = -1;
+	if (cs->command != NULL) {
+		num_command_sensors++;
+		if (debug && log_file != NULL) fprintf(log_file, "Set command sensor '%s' to '%s'.\n", cs->name, cs->command);
+	}
+}
+
+/* Load the plugins in plugindir and the command sensors */
+
+static void
+load_plugins()
+{
+	enum load_plugins_enum { PLUGIN_PATH_LEN = 512 };
+	char path[ PLUGIN_PATH_LEN ];
+	DIR *dir;
+	struct dirent *de;
+	size_t len;
+
+	unload_plugins();
+
+	if (plugin_dir != NULL) {
+		dir = opendir(plugin_dir);
+		if (dir == NULL) {
+			if (log_file != NULL) {
+				fprintf(log_file, "Could not open plugin directory '%s'.\n", plugin_dir);
+			}
+		} else {
+			while ((de = readdir(dir)) != NULL && num_plugins < MAX_PLUGINS - 1 && num_plugin_sensors < MAX_PLUGIN_SENSORS) {
+				len = strlen(de->d_name);
+				if (len < 4 || strcmp(&de->d_name[ len - 3 ], ".so") != 0) {
+					continue;
+				}
+				snprintf(path, PLUGIN_PATH_LEN, "%s/%s", plugin_dir, de->d_name);
+				load_plugin(path);
+			}
+			closedir(dir);
+		}
+	}
+
+	if (num_command_sensors > 0 && num_plugin_sensors < MAX_PLUGIN_SENSORS) {
+		add_plugin(NULL, &command_plugin, "command");
+	}
+
+	if (log_file != NULL) {
+		fflush(log_file);
+	}
+}
+
+/* Sample the plugin sensors */
+/*   Returns the hottest plugin temperature, sets plugin_hot_sensor, */
+/*   and returns TRUE in *changed if the tooltip text changed */
+
+static int
+sample_plugins(gboolean *changed)
+{
+	const struct loaded_plugin *lp;
+	const struct temperature_plugin_sensor *ps;
+	const struct temperature_plugin_sample *sample;
+	char text[ PLUGIN_TEXT_LEN ];
+	int hottest;
+	int hot_value;
+	int value;
+	int warn;
+	int pos;
+	int i;
+	int j;
+
+	*changed = FALSE;
+	if (num_plugins == 0) {
+		return 0;
+	}
+
+	hottest = 0;
+	hot_value = 0;
+	plugin_hot_sensor = -1;
+	pos = 0;
+	text[0] = '\0';
+
+	for (i = 0; i < num_plugins; i++) {
+		lp = &plugins[i];
+		for (j = lp->first_sensor; j < lp->first_sensor + lp->num_sensors; j++) {
+			plugin_samples[j].valid = 0;
+		}
+		if ((*lp->plugin->sample)(&plugin_samples[ lp->first_sensor ], lp->num_sensors) != 0) {
+			for (j = lp->first_sensor; j < lp->first_sensor + lp->num_sensors; j++) {
+				set_sensor_value(plugin_sensor_slots[j], 0);
+			}
+			continue;
+		}
+		for (j = lp->first_sensor; j < lp->first_sensor + lp->num_sensors; j++) {
+			ps = &plugin_sensors[j];
+			sample = &plugin_samples[j];
+			value = 0;
+			if (sample->valid) {
+				value = (ps->kind == TEMPERATURE_PLUGIN_FAN? sample->value: sample->value / 1000);
+			}
+			set_sensor_value(plugin_sensor_slots[j], value);
+			if (!sample->valid) {
+				continue;
+			}
+			if (pos < PLUGIN_TEXT_LEN) {
+				pos += snprintf(&text[ pos ], PLUGIN_TEXT_LEN - pos, "%s%s %d%s",
+					(pos > 0? "\n": ""), ps->name, value, (ps->kind == TEMPERATURE_PLUGIN_FAN? " rpm": "\xC2\xB0" "C"));
+			}
+			if (ps->kind == TEMPERATURE_PLUGIN_FAN) {
+				continue;
+			}
+			if (value > hottest) {
+				hottest = value;
+			}
+			warn = (ps->warn > 0? ps->warn: warning_temperature);
+			if (value >= warn && (plugin_hot_sensor < 0 || value > hot_value)) {
+				plugin_hot_sensor = j;
+				hot_value = value;
+			}
+		}
+	}
+
+	if (strcmp(text, plugin_tooltip_text) != 0) {
+		strcpy(plugin_tooltip_text, text);
+		*changed = TRUE;
+	}
+
+	return hottest;
+}
+
+/* Hot processes */
+/*   When a warning fires, /proc is read with getdents64 and each /proc/[pid]/stat */
+/*   is read into a reusable buffer.  The cpu ticks are compared with the snapshot */
+/*   from the previous warning, or with one taken an interval later, to find the */
+/*   processes that used the most cpu. */
+
+enum hot_process_enum {
+	MAX_HOT_PROCESSES = 10,
+	HOT_COMM_LEN = 16,
+	DENTS_BUF_LEN = 32768,
+	PROC_STAT_BUF_LEN = 1024,
+	HOT_PROCESS_TEXT_LEN = 512
+};
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct proc_sample {
+	pid_t pid;			/* process id */
+	unsigned long long ticks;	/* user plus system clock ticks */
+};
+
+struct proc_snapshot {
+	struct proc_sample *samples;	/* samples sorted by pid */
+	int num_samples;
+	int max_samples;		/* allocated size, kept between snapshots */
+	gint64 time;			/* monotonic time in usec, 0 if not taken */
+};
+
+struct hot_process {
+	pid_t pid;
+	unsigned long long ticks;	/* ticks used between the snapshots */
+	char comm[ HOT_COMM_LEN ];	/* command name */
+};
+
+static struct proc_snapshot proc_snapshots[2];
+static int last_proc_snapshot = 0;	/* index of the newest snapshot */
+static struct hot_process hot_processes[ MAX_HOT_PROCESSES ];
+static int num_hot_processes = 0;
+static char hot_process_text[ HOT_PROCESS_TEXT_LEN ];	/* report for the tooltip */
+static guint hot_process_timer = 0;	/* pending follow up snapshot */
+
+/* Compare samples by pid */
+
+static int
+compare_proc_samples(const void *a, const void *b)
+{
+	pid_t pid_a = ((const struct proc_sample *) a)->pid;
+	pid_t pid_b = ((const struct proc_sample *) b)->pid;
+
+	return (pid_a < pid_b? -1: (pid_a > pid_b? 1: 0));
+}
+
+/* Add a process to the top list if it used enough cpu */
+
+static void
+add_hot_process(pid_t pid, unsigned long long ticks, const char *comm, int comm_len)
+{
+	int i;
+
+	if (ticks == 0 || hot_process_count <= 0) {
+		return;
+	}
+	for (i = num_hot_processes; i > 0 && hot_processes[i-1].ticks < ticks; i--) {
+		if (i < hot_process_count) {
+			hot_processes[i] = hot_processes[i-1];
+		}
+	}
+	if (i >= hot_process_count) {
+		return;
+	}
+	hot_processes[i].pid = pid;
+	hot_processes[i].ticks = ticks;
+	if (comm_len > HOT_COMM_LEN - 1) comm_len = HOT_COMM_LEN - 1;
+	memcpy(hot_processes[i].comm, comm, comm_len);
+	hot_processes[i].comm[ comm_len ] = '\0';
+	if (num_hot_processes < hot_process_count) {
+		num_hot_processes++;
+	}
+}
+
+/* Read the cpu ticks of every process */
+/*   If old is not NULL, also find the processes that used the most cpu since old */
+
+static gboolean
+take_proc_snapshot(struct proc_snapshot *snap, const struct proc_snapshot *old)
+{
+	static int proc_fd = -1;
+	static char dents_buf[ DENTS_BUF_LEN ];
+	static char stat_buf[ PROC_STAT_BUF_LEN ];
+	struct linux_dirent64 *ent;
+	struct proc_sample *sample;
+	const struct proc_sample *old_sample;
+	char path[ 32 ];
+	char *p;
+	char *comm;
+	char *rparen;
+	long nread;
+	long pos;
+	int old_ind = 0;
+	int fd;
+	int len;
+	int field;
+	pid_t pid;
+	pid_t last_pid = 0;
+	gboolean sorted = TRUE;
+	unsigned long long utime;
+	unsigned long long stime;
+
+	if (proc_fd == -1) {
+		proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (proc_fd == -1) {
+			return FALSE;
+		}
+	} else if (lseek(proc_fd, 0, SEEK_SET) != 0) {
+		return FALSE;
+	}
+
+	snap->num_samples = 0;
+	snap->time = g_get_monotonic_time();
+	num_hot_processes = 0;
+
+	while ((nread = syscall(SYS_getdents64, proc_fd, dents_buf, DENTS_BUF_LEN)) > 0) {
+		for (pos = 0; pos < nread; pos += ent->d_reclen) {
+			ent = (struct linux_dirent64 *) &dents_buf[ pos ];
+			if (ent->d_name[0] < '1' || ent->d_name[0] > '9') {
+				continue;
+			}
+			pid = (pid_t) atoi(ent->d_name);
+			snprintf(path, sizeof(path), "%s/stat", ent->d_name);
+			fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+			if (fd == -1) {
+				continue;
+			}
+			len = read(fd, stat_buf, PROC_STAT_BUF_LEN - 1);
+			close(fd);
+			if (len <= 0) {
+				continue;
+			}
+			stat_buf[ len ] = '\0';
+
+			/* "pid (comm) state ppid ... utime stime", where comm may have spaces and parens */
+
+			comm = strchr(stat_buf, '(');
+			rparen = strrchr(stat_buf, ')');
+			if (comm == NULL || rparen == NULL || rparen < comm) {
+				continue;
+			}
+			comm++;
+			p = rparen + 1;
+			for (field = 3; field < 14 && *p != '\0'; field++) {
+				while (*p == ' ') p++;
+				while (*p != ' ' && *p != '\0') p++;
+			}
+			utime = strtoull(p, &p, 10);
+			stime = strtoull(p, &p, 10);
+
+			if (snap->num_samples >= snap->max_samples) {
+				int new_max = (snap->max_samples > 0? 2 * snap->max_samples: 1024);
+				sample = realloc(snap->samples, new_max * sizeof(struct proc_sample));
+				if (sample == NULL) {
+					return FALSE;
+				}
+				snap->samples = sample;
+				snap->max_samples = new_max;
+			}
+			sample = &snap->samples[ snap->num_samples++ ];
+			sample->pid = pid;
+			sample->ticks = utime + stime;
+			if (pid < last_pid) {
+				sorted = FALSE;
+			}
+			last_pid = pid;
+
+			if (old != NULL) {
+				old_sample = NULL;
+				if (sorted) {
+					/* /proc lists processes by pid, so walk the old snapshot in step */
+					while (old_ind < old->num_samples && old->samples[ old_ind ].pid < pid) {
+						old_ind++;
+					}
+					if (old_ind < old->num_samples && old->samples[ old_ind ].pid == pid) {
+						old_sample = &old->samples[ old_ind ];
+					}
+				} else {
+					/* out of order, but the old snapshot was sorted */
+					old_sample = bsearch(sample, old->samples, old->num_samples, sizeof(struct proc_sample), compare_proc_samples);
+				}
+				if (old_sample != NULL && sample->ticks > old_sample->ticks) {
+					add_hot_process(pid, sample->ticks - old_sample->ticks, comm, rparen - comm);
+				}
+			}
+		}
+	}
+
+	if (!sorted) {
+		qsort(snap->samples, snap->num_samples, sizeof(struct proc_sample), compare_proc_samples);
+	}
+
+	return TRUE;
+}
+
+/* Take a snapshot and report the processes that used the most cpu */
+
+static void
+report_hot_processes()
+{
+	struct proc_snapshot *old;
+	struct proc_snapshot *snap;
+	gint64 start_time;
+	double elapsed;
+	long ticks_per_sec;
+	int pos;
+	int i;
+
+	old = &proc_snapshots[ last_proc_snapshot ];
+	snap = &proc_snapshots[ 1 - last_proc_snapshot ];
+
+	start_time = g_get_monotonic_time();
+	if (!take_proc_snapshot(snap, old)) {
+		return;
+	}
+	last_proc_snapshot = 1 - last_proc_snapshot;
+
+	elapsed = (double) (snap->time - old->time) / 1000000.0;
+	ticks_per_sec = sysconf(_SC_CLK_TCK);
+	if (elapsed <= 0 || ticks_per_sec <= 0) {
+		return;
+	}
+
+	pos = snprintf(hot_process_text, HOT_PROCESS_TEXT_LEN, "Top cpu at %s:", show_time());
+	for (i = 0; i < num_hot_processes && pos < HOT_PROCESS_TEXT_LEN; i++) {
+		pos += snprintf(&hot_process_text[ pos ], HOT_PROCESS_TEXT_LEN - pos, "\n%5.1f%% %s (%d)",
+			(100.0 * hot_processes[i].ticks) / (ticks_per_sec * elapsed),
+			hot_processes[i].comm, (int) hot_processes[i].pid);
+	}
+
+	if (log_file != NULL) {
+		fprintf(log_file, "%s\n", hot_process_text);
+		if (debug) {
+			fprintf(log_file, "scanned %d processes over %.1f seconds in %ld usec\n",
+				snap->num_samples, elapsed, (long) (g_get_monotonic_time() - start_time));
+		}
+		fflush(log_file);
+	}
+}
+
+/* Remote sources */
+/*   Each remote is a host:port or a unix socket path that streams lines "sensor degrees", */
+/*   such as "cpu 67".  The sockets are non-blocking and watched by the main loop. */
+/*   Host names are looked up in a short lived thread, so a slow resolver or a dead */
+/*   host never blocks the panel.  A connection that fails, closes, or sends nothing */
+/*   for REMOTE_STALE_TIME seconds is retried after a delay that doubles up to 5 minutes. */
+
+enum remote_enum {
+	MAX_REMOTES = 8,
+	MAX_REMOTE_SENSORS = 8,
+	REMOTE_BUF_LEN = 512,
+	REMOTE_TEXT_LEN = 512,
+	REMOTE_CONNECT_TIME = 10,
+	REMOTE_STALE_TIME = 60,
+	MAX_REMOTE_RETRY_DELAY = 300
+};
+
+enum remote_state_enum { REMOTE_IDLE, REMOTE_RESOLVING, REMOTE_CONNECTING, REMOTE_CONNECTED };
+
+struct remote_sensor {
+	char name[ SENSOR_NAME_LEN ];
+	int value;			/* degrees C */
+};
+
+struct remote_source {
+	char name[ SENSOR_NAME_LEN ];	/* name in the tooltip and format */
+	char *host;			/* host name or unix socket path */
+	char *port;			/* port, NULL for a unix socket */
+	enum remote_state_enum state;
+	int fd;				/* socket, -1 if closed */
+	guint watch;			/* main loop watch on fd */
+	time_t state_time;		/* when the state last changed or data arrived */
+	char buf[ REMOTE_BUF_LEN ];	/* partial line */
+	int buf_len;
+	struct remote_sensor sensors[ MAX_REMOTE_SENSORS ];
+	int num_sensors;
+	int failures;			/* consecutive failures */
+	time_t retry_time;		/* do not connect before this time */
+	int slot;			/* sensor value slot for the hottest sensor */
+};
+
+struct remote_lookup {
+	int remote;			/* index in remotes */
+	int generation;			/* remotes_generation when started */
+	char *host;
+	char *port;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	int error;			/* getaddrinfo result */
+};
+
+static struct remote_source remotes[ MAX_REMOTES ];
+static int num_remotes = 0;
+static int remotes_generation = 0;	/* changes when the setup file is read */
+static char remote_tooltip_text[ REMOTE_TEXT_LEN ];	/* per host readings for the tooltip */
+
+/* Close a remote connection */
+
+static void
+close_remote(struct remote_source *rs)
+{
+	if (rs->watch != 0) {
+		g_source_remove(rs->watch);
+		rs->watch = 0;
+	}
+	if (rs->fd != -1) {
+		close(rs->fd);
+		rs->fd = -1;
+	}
+	rs->state = REMOTE_IDLE;
+	rs->buf_len = 0;
+	rs->num_sensors = 0;
+	set_sensor_value(rs->slot, 0);
+}
+
+/* Close a remote after a failure and schedule the retry */
+
+static void
+fail_remote(struct remote_source *rs, const char *reason)
+{
+	int delay;
+
+	close_remote(rs);
+	if (rs->failures < 16) {
+		rs->failures++;
+	}
+	delay = 1 << (rs->failures - 1);
+	if (delay > MAX_REMOTE_RETRY_DELAY) {
+		delay = MAX_REMOTE_RETRY_DELAY;
+	}
+	rs->retry_time = time(NULL) + delay;
+	if (log_file != NULL) {
+		fprintf(log_file, "Remote '%s' %s at %s, retry in %d seconds.\n", rs->name, reason, show_time(), delay);
+		fflush(log_file);
+	}
+}
+
+/* Store one line from a remote */
+
+static void
+read_remote_line(struct remote_source *rs, char *line)
+{
+	struct remote_sensor *sensor;
+	char *value;
+	char *end;
+	double degrees;
+	int i;
+
+	while (isspace(*line)) line++;
+	if (*line == '\0' || *line == '#') {
+		return;
+	}
+	value = line;
+	while (*value != '\0' && !isspace(*value)) value++;
+	if (*value == '\0') {
+		/* a bare value */
+		value = line;
+		line = "temp";
+	} else {
+		*value++ = '\0';
+	}
+	degrees = strtod(value, &end);
+	if (end == value) {
+		return;
+	}
+
+	for (i = 0; i < rs->num_sensors; i++) {
+		if (strcmp(rs->sensors[i].name, line) == 0) {
+			break;
+		}
+	}
+	if (i >= rs->num_sensors) {
+		if (rs->num_sensors >= MAX_REMOTE_SENSORS) {
+			return;
+		}
+		sensor = &rs->sensors[ rs->num_sensors++ ];
+		strncpy(sensor->name, line, SENSOR_NAME_LEN - 1);
+		sensor->name[ SENSOR_NAME_LEN - 1 ] = '\0';
+	}
+	rs->sensors[i].value = (int) degrees;
+}
+
+/* Read from a remote */
+
+static gboolean
+on_remote_input(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	struct remote_source *rs = (struct remote_source *) data;
+	char *line;
+	char *nl;
+	int len;
+
+	len = read(rs->fd, &rs->buf[ rs->buf_len ], REMOTE_BUF_LEN - 1 - rs->buf_len);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return TRUE;
+	}
+	if (len <= 0) {
+		rs->watch = 0;
+		fail_remote(rs, (len == 0? "closed the connection": "read failed"));
+		return FALSE;
+	}
+	rs->buf_len += len;
+	rs->buf[ rs->buf_len ] = '\0';
+	rs->state_time = time(NULL);
+
+	line = rs->buf;
+	while ((nl = strchr(line, '\n')) != NULL) {
+		*nl = '\0';
+		read_remote_line(rs, line);
+		line = nl + 1;
+	}
+	rs->buf_len -= (line - rs->buf);
+	memmove(rs->buf, line, rs->buf_len + 1);
+	if (rs->buf_len >= REMOTE_BUF_LEN - 1) {
+		/* drop a line that does not fit */
+		rs->buf_len = 0;
+	}
+	return TRUE;
+}
+
+/* Finish a non-blocking connect */
+
+static gboolean
+on_remote_connect(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	struct remote_source *rs = (struct remote_source *) data;
+	GIOChannel *channel;
+	int error;
+	socklen_t len;
+
+	rs->watch = 0;
+	error = 0;
+	len = sizeof(error);
+	if (getsockopt(rs->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0) {
+		fail_remote(rs, "connect failed");
+		return FALSE;
+	}
+
+	rs->state = REMOTE_CONNECTED;
+	rs->state_time = time(NULL);
+	rs->failures = 0;
+	channel = g_io_channel_unix_new(rs->fd);
+	rs->watch = g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR, on_remote_input, rs);
+	g_io_channel_unref(channel);
+	if (log_file != NULL) {
+		fprintf(log_file, "Remote '%s' connected at %s.\n", rs->name, show_time());
+		fflush(log_file);
+	}
+	return FALSE;
+}
+
+/* Start a non-blocking connect */
+
+static void
+connect_remote(struct remote_source *rs, const struct sockaddr *addr, socklen_t addr_len)
+{
+	GIOChannel *channel;
+
+	rs->fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (rs->fd == -1) {
+		fail_remote(rs, "has no socket");
+		return;
+	}
+	if (connect(rs->fd, addr, addr_len) != 0 && errno != EINPROGRESS) {
+		fail_remote(rs, "connect failed");
+		return;
+	}
+	rs->state = REMOTE_CONNECTING;
+	rs->state_time = time(NULL);
+	channel = g_io_channel_unix_new(rs->fd);
+	rs->watch = g_io_add_watch(channel, G_IO_OUT | G_IO_HUP | G_IO_ERR, on_remote_connect, rs);
+	g_io_channel_unref(channel);
+}
+
+/* Connect to a remote after its host name was looked up */
+
+static gboolean
+on_remote_lookup_done(gpointer data)
+{
+	struct remote_lookup *lookup = (struct remote_lookup *) data;
+	struct remote_source *rs;
+
+	if (lookup->generation == remotes_generation && lookup->remote < num_remotes) {
+		rs = &remotes[ lookup->remote ];
+		rs->state = REMOTE_IDLE;
+		if (lookup->error != 0) {
+			fail_remote(rs, gai_strerror(lookup->error));
+		} else {
+			connect_remote(rs, (struct sockaddr *) &lookup->addr, lookup->addr_len);
+		}
+	}
+	free(lookup->host);
+	free(lookup->port);
+	free(lookup);
+	return FALSE;
+}
+
+/* Look up a host name outside of the main loop */
+
+static gpointer
+remote_lookup_thread(gpointer data)
+{
+	struct remote_lookup *lookup = (struct remote_lookup *) data;
+	struct addrinfo hints;
+	struct addrinfo *result;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	lookup->error = getaddrinfo(lookup->host, lookup->port, &hints, &result);
+	if (lookup->error == 0) {
+		memcpy(&lookup->addr, result->ai_addr, result->ai_addrlen);
+		lookup->addr_len = result->ai_addrlen;
+		freeaddrinfo(result);
+	}
+	g_idle_add(on_remote_lookup_done, lookup);
+	return NULL;
+}
+
+/* Start connecting to a remote */
+
+static void
+start_remote(int remote)
+{
+	struct remote_source *rs = &remotes[ remote ];
+	struct remote_lookup *lookup;
+	struct sockaddr_un addr;
+	GThread *thread;
+
+	if (rs->port == NULL) {
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, rs->host, sizeof(addr.sun_path) - 1);
+		connect_remote(rs, (struct sockaddr *) &addr, sizeof(addr));
+		return;
+	}
+
+	lookup = calloc(1, sizeof(*lookup));
+	if (lookup == NULL) {
+		return;
+	}
+	lookup->remote = remote;
+	lookup->generation = remotes_generation;
+	lookup->host = strdup(rs->host);
+	lookup->port = strdup(rs->port);
+	rs->state = REMOTE_RESOLVING;
+	rs->state_time = time(NULL);
+	thread = (lookup->host && lookup->port? g_thread_try_new("remote lookup", remote_lookup_thread, lookup, NULL): NULL);
+	if (thread == NULL) {
+		free(lookup->host);
+		free(lookup->port);
+		free(lookup);
+		fail_remote(rs, "could not start a lookup");
+		return;
+	}
+	g_thread_unref(thread);
+}
+
+/* Connect, time out, and summarize the remotes */
+/*   Returns the hottest remote temperature and sets *changed if the tooltip text changed */
+
+static int
+poll_remotes(time_t current_time, gboolean *changed)
+{
+	struct remote_source *rs;
+	char text[ REMOTE_TEXT_LEN ];
+	int hottest;
+	int host_hottest;
+	int pos;
+	int i;
+	int j;
+
+	*changed = FALSE;
+	if (num_remotes == 0) {
+		return 0;
+	}
+
+	hottest = 0;
+	pos = 0;
+	text[0] = '\0';
+	for (i = 0; i < num_remotes; i++) {
+		rs = &remotes[i];
+		if (rs->state == REMOTE_IDLE && current_time >= rs->retry_time) {
+			start_remote(i);
+		} else if (rs->state == REMOTE_CONNECTING && current_time > rs->state_time + REMOTE_CONNECT_TIME) {
+			fail_remote(rs, "connect timed out");
+		} else if (rs->state == REMOTE_CONNECTED && current_time > rs->state_time + REMOTE_STALE_TIME) {
+			fail_remote(rs, "sent nothing");
+		}
+
+		if (pos < REMOTE_TEXT_LEN) {
+			pos += snprintf(&text[ pos ], REMOTE_TEXT_LEN - pos, "%s%s", (pos > 0? "\n": ""), rs->name);
+		}
+		if (rs->state != REMOTE_CONNECTED) {
+			if (pos < REMOTE_TEXT_LEN) {
+				pos += snprintf(&text[ pos ], REMOTE_TEXT_LEN - pos, " %s",
+					(rs->state == REMOTE_IDLE? "down": "connecting"));
+			}
+			continue;
+		}
+		host_hottest = 0;
+		for (j = 0; j < rs->num_sensors; j++) {
+			if (rs->sensors[j].value > host_hottest) {
+				host_hottest = rs->sensors[j].value;
+			}
+			if (pos < REMOTE_TEXT_LEN) {
+				pos += snprintf(&text[ pos ], REMOTE_TEXT_LEN - pos, " %s %d", rs->sensors[j].name, rs->sensors[j].value);
+			}
+		}
+		set_sensor_value(rs->slot, host_hottest);
+		if (host_hottest > hottest) {
+			hottest = host_hottest;
+		}
+	}
+
+	if (strcmp(text, remote_tooltip_text) != 0) {
+		strcpy(remote_tooltip_text, text);
+		*changed = TRUE;
+	}
+	return hottest;
+}
+
+/* Close the remotes and forget them */
+
+static void
+clear_remotes()
+{
+	int i;
+
+	for (i = 0; i < num_remotes; i++) {
+		close_remote(&remotes[i]);
+		free(remotes[i].host);
+		free(remotes[i].port);
+	}
+	num_remotes = 0;
+	remotes_generation++;
+	remote_tooltip_text[0] = '\0';
+}
+
+/* Read a remote setting, "name host:port" or "name /path/to/socket" */
+
+static void
+read_remote(const char *setup_name, const char *buf)
+{
+	struct remote_source *rs;
+	const char *p;
+	const char *colon;
+	int len;
+
+	p = buf;
+	while (*p != '\0' && !isspace(*p)) p++;
+	len = p - buf;
+	while (isspace(*p)) p++;
+	colon = strrchr(p, ':');
+	if (len == 0 || len >= SENSOR_NAME_LEN || *p == '\0' || num_remotes >= MAX_REMOTES ||
+	    (*p != '/' && (colon == NULL || colon == p || colon[1] == '\0'))) {
+		if (log_file != NULL)
+			fprintf(log_file, "Setup file '%s' has bad or too many 'remote' '%s'.\n", setup_name, buf);
+		return;
+	}
+	rs = &remotes[ num_remotes ];
+	memset(rs, 0, sizeof(*rs));
+	memcpy(rs->name, buf, len);
+	rs->fd = -1;
+	if (*p == '/') {
+		rs->host = strdup(p);
+		rs->port = NULL;
+	} else {
+		/* allow [::1]:port */
+		rs->host = strndup((*p == '[' ? p + 1: p), colon - p - (*p == '[' ? 2: 0));
+		rs->port = strdup(colon + 1);
+		if (rs->port == NULL) {
+			free(rs->host);
+			rs->host = NULL;
+		}
+	}
+	if (rs->host == NULL) {
+		return;
+	}
+	rs->slot = external_sensor_slot(rs->name, SENSOR_TEMP, &remote_text, "Remote");
+	num_remotes++;
+	if (debug && log_file != NULL) fprintf(log_file, "Set remote '%s' to '%s'.\n", rs->name, p);
+}
+
+/* Pressure stall information */
+/*   A trigger "some <stall> <window>" is written to /proc/pressure/cpu, memory, or io, */
+/*   and the kernel wakes the main loop with POLLPRI only when the tasks stall for */
+/*   more than the stall time within a window.  The averages are read for the */
+/*   tooltip when a trigger fires, on clicks, and once a minute. */
+
+enum psi_enum { PSI_CPU, PSI_MEMORY, PSI_IO, NUM_PSI, PSI_TEXT_LEN = 256, PSI_REFRESH_INTERVAL = 60 };
+
+struct psi_trigger {
+	const char *name;		/* cpu, memory, or io */
+	int stall;			/* ms of stall per window to trigger, 0 if off */
+	int fd;				/* trigger descriptor, -1 if not open */
+	guint watch;			/* main loop watch on fd */
+	time_t last_alert;		/* time of the last beep and sound */
+	long events;			/* number of triggers */
+};
+
+static struct psi_trigger psi_triggers[ NUM_PSI ] = {
+	{ "cpu", 0, -1, 0, 0, 0 },
+	{ "memory", 0, -1, 0, 0, 0 },
+	{ "io", 0, -1, 0, 0, 0 }
+};
+static int psi_window = 2000;		/* ms, unprivileged triggers need a multiple of 2 seconds */
+static char psi_text[ PSI_TEXT_LEN ];	/* pressure averages for the tooltip */
+static time_t psi_text_time = 0;	/* when psi_text was read */
+static GtkWidget *psi_widget = NULL;	/* widget for alerts and the tooltip */
+
+/* Read the pressure averages for the tooltip */
+
+static void
+read_psi_averages()
+{
+	enum read_psi_enum { PSI_BUF_LEN = 256, PSI_PATH_LEN = 32 };
+	char path[ PSI_PATH_LEN ];
+	char buf[ PSI_BUF_LEN ];
+	double avg10, avg60, avg300;
+	int pos;
+	int i;
+
+	psi_text[0] = '\0';
+	psi_text_time = time(NULL);
+	pos = 0;
+	for (i = 0; i < NUM_PSI && pos < PSI_TEXT_LEN; i++) {
+		snprintf(path, PSI_PATH_LEN, "/proc/pressure/%s", psi_triggers[i].name);
+		if (read_sys_file(AT_FDCWD, path, buf, PSI_BUF_LEN) <= 0 ||
+		    sscanf(buf, "some avg10=%lf avg60=%lf avg300=%lf", &avg10, &avg60, &avg300) != 3) {
+			continue;
+		}
+		pos += snprintf(&psi_text[ pos ], PSI_TEXT_LEN - pos, "%s%s %.1f%% %.1f%% %.1f%%",
+			(pos == 0? "Pressure 10s 60s 300s:\n": "\n"), psi_triggers[i].name, avg10, avg60, avg300);
+		if (psi_triggers[i].events > 0 && pos < PSI_TEXT_LEN) {
+			pos += snprintf(&psi_text[ pos ], PSI_TEXT_LEN - pos, ", %ld stalls", psi_triggers[i].events);
+		}
+	}
+}
+
+/* Play the warning sound and beep */
+
+static void
+play_alert(GtkWidget *widget)
+{
+	char *cmd;
+
+	if (do_beep) {
+		XBell( GDK_DISPLAY_XDISPLAY( gtk_widget_get_display( widget ) ), 0 );
+	}
+	if (sound_name != NULL) {
+		cmd = malloc(strlen(sound_name) + 20);
+		if (cmd != NULL) {
+			sprintf(cmd, "play '%s' &", sound_name);
+			system(cmd);
+			free(cmd);
+		}
+	}
+}
+
+/* Set the tooltip */
+
+static void
+update_tooltip(GtkWidget *widget)
+{
+	char text[ PLUGIN_TEXT_LEN + REMOTE_TEXT_LEN + PSI_TEXT_LEN + HOT_PROCESS_TEXT_LEN + 6 ];
+	const char *sections[4];
+	int pos;
+	int i;
+
+	sections[0] = plugin_tooltip_text;
+	sections[1] = remote_tooltip_text;
+	sections[2] = psi_text;
+	sections[3] = hot_process_text;
+	text[0] = '\0';
+	pos = 0;
+	for (i = 0; i < 4; i++) {
+		if (sections[i][0] != '\0') {
+			pos += snprintf(&text[ pos ], sizeof(text) - pos, "%s%s", (pos > 0? "\n\n": ""), sections[i]);
+		}
+	}
+	gtk_widget_set_tooltip_text(widget, (text[0] != '\0'? text: NULL));
+}
+
+/* Handle a pressure trigger */
+
+static gboolean
+on_psi_trigger(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	struct psi_trigger *pt = (struct psi_trigger *) data;
+	time_t current_time;
+
+	if (condition & (G_IO_ERR | G_IO_NVAL)) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Pressure trigger for %s failed at %s.\n", pt->name, show_time());
+			fflush(log_file);
+		}
+		pt->watch = 0;
+		close(pt->fd);
+		pt->fd = -1;
+		return FALSE;
+	}
+
+	current_time = time(NULL);
+	pt->events++;
+	read_psi_averages();
+	if (log_file != NULL) {
+		fprintf(log_file, "%s pressure stalled over %d ms in %d ms at %s\n", pt->name, pt->stall, psi_window, show_time());
+		fflush(log_file);
+	}
+	if (psi_widget != NULL) {
+		update_tooltip(psi_widget);
+		if (current_time >= pt->last_alert + warning_interval) {
+			play_alert(psi_widget);
+			pt->last_alert = current_time;
+		}
+	}
+	return TRUE;
+}
+
+/* Close the pressure triggers */
+
+static void
+close_psi_triggers()
+{
+	int i;
+
+	for (i = 0; i < NUM_PSI; i++) {
+		if (psi_triggers[i].watch != 0) {
+			g_source_remove(psi_triggers[i].watch);
+			psi_triggers[i].watch = 0;
+		}
+		if (psi_triggers[i].fd != -1) {
+			close(psi_triggers[i].fd);
+			psi_triggers[i].fd = -1;
+		}
+	}
+	psi_text[0] = '\0';
+	psi_text_time = 0;
+}
+
+/* Register the pressure triggers from the setup file */
+
+static void
+open_psi_triggers()
+{
+	enum open_psi_enum { PSI_PATH_LEN = 32, PSI_TRIGGER_LEN = 64 };
+	char path[ PSI_PATH_LEN ];
+	char trigger[ PSI_TRIGGER_LEN ];
+	struct psi_trigger *pt;
+	GIOChannel *channel;
+	gboolean any;
+	int len;
+	int i;
+
+	close_psi_triggers();
+	if (psi_widget == NULL) {
+		return;
+	}
+
+	any = FALSE;
+	for (i = 0; i < NUM_PSI; i++) {
+		pt = &psi_triggers[i];
+		pt->events = 0;
+		if (pt->stall <= 0) {
+			continue;
+		}
+		any = TRUE;
+		snprintf(path, PSI_PATH_LEN, "/proc/pressure/%s", pt->name);
+		pt->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (pt->fd == -1) {
+			if (log_file != NULL) {
+				fprintf(log_file, "Could not open '%s', errno %d.\n", path, errno);
+			}
+			continue;
+		}
+		len = snprintf(trigger, PSI_TRIGGER_LEN, "some %d %d", pt->stall * 1000, psi_window * 1000);
+		if (write(pt->fd, trigger, len + 1) < 0) {
+			if (log_file != NULL) {
+				fprintf(log_file, "Could not set trigger '%s' on '%s', errno %d.\n", trigger, path, errno);
+			}
+			close(pt->fd);
+			pt->fd = -1;
+			continue;
+		}
+		channel = g_io_channel_unix_new(pt->fd);
+		pt->watch = g_io_add_watch(channel, G_IO_PRI | G_IO_ERR | G_IO_NVAL, on_psi_trigger, pt);
+		g_io_channel_unref(channel);
+		if (debug && log_file != NULL) {
+			fprintf(log_file, "set trigger '%s' on '%s'\n", trigger, path);
+		}
+	}
+
+	if (any) {
+		read_psi_averages();
+		update_tooltip(psi_widget);
+	}
+}
+
+/* Refresh the pressure averages in the tooltip */
+
+static void
+refresh_psi_averages(GtkWidget *widget, time_t current_time, gboolean force_update)
+{
+	if (psi_text[0] == '\0' && psi_text_time == 0) {
+		return;
+	}
+	if (force_update || current_time >= psi_text_time + PSI_REFRESH_INTERVAL) {
+		read_psi_averages();
+		update_tooltip(widget);
+	}
+}
+
+/* Finish a hot process report one interval after the first snapshot */
+
+static gboolean
+on_hot_process_timer(gpointer data)
+{
+	hot_process_timer = 0;
+	report_hot_processes();
+	update_tooltip(GTK_WIDGET(data));
+	return FALSE;
+}
+
+/* Find the processes using the most cpu after a warning */
+/*   Use the snapshot from the last warning if it is recent, */
+/*   otherwise take one now and report after another interval */
+
+static void
+check_hot_processes(GtkWidget *widget)
+{
+	const struct proc_snapshot *old;
+	gint64 max_age;
+
+	if (hot_process_count <= 0 || hot_process_timer != 0) {
+		return;
+	}
+
+	old = &proc_snapshots[ last_proc_snapshot ];
+	max_age = (gint64) 2 * (warning_interval > interval? warning_interval: interval) * 1000000;
+
+	if (old->time != 0 && g_get_monotonic_time() - old->time <= max_age) {
+		report_hot_processes();
+		update_tooltip(widget);
+	} else if (take_proc_snapshot(&proc_snapshots[ last_proc_snapshot ], NULL)) {
+		hot_process_timer = g_timeout_add(interval * 1000, on_hot_process_timer, widget);
+	}
+}
+
+/* Fan curve control */
+/*   When fancontrol names a hwmon directory, pwm#_enable is set to manual (1) */
+/*   and pwm# follows a temperature to duty curve.  The duty moves toward the */
+/*   curve through the velocity form of a PID controller, with the gap between */
+/*   the curve and the duty as the error: each step changes the duty by */
+/*   kp * (change of the gap) + ki * gap * dt + kd * (change of the change) / dt. */
+/*   Falling temperatures must drop by the hysteresis before the curve is lowered.  The original pwm#_enable and pwm# */
+/*   are restored on exit, on signals, after a failed sensor read, and when the */
+/*   setup file is reloaded.  The directory can be a copy of a sysfs tree for testing. */
+
+enum fan_control_enum { MAX_FAN_CURVE_POINTS = 8, FAN_PATH_LEN = 24, FAN_VALUE_LEN = 16 };
+
+struct fan_curve_point {
+	int temp;			/* degrees C */
+	int duty;			/* percent */
+};
+
+struct fan_control {
+	char *dir_name;			/* hwmon directory from the setup file, NULL if off */
+	char *temp_name;		/* optional file with the temperature in millidegrees */
+	int pwm;			/* # in pwm# */
+	struct fan_curve_point curve[ MAX_FAN_CURVE_POINTS ];
+	int num_points;
+	double kp, ki, kd;		/* PID gains */
+	int hysteresis;			/* degrees */
+	int dir_fd;			/* open directory, -1 if not engaged */
+	char pwm_path[ FAN_PATH_LEN ];	/* pwm# */
+	char enable_path[ FAN_PATH_LEN ];	/* pwm#_enable */
+	char saved_enable[ FAN_VALUE_LEN ];	/* pwm#_enable before engaging */
+	char saved_pwm[ FAN_VALUE_LEN ];	/* pwm# before engaging */
+	int saved_enable_len;
+	int saved_pwm_len;
+	gboolean failed;		/* stay automatic until the setup file is read again */
+	int curve_temp;			/* temperature used for the curve after hysteresis */
+	double duty;			/* current duty in percent */
+	double last_error;		/* gap at the last step */
+	double prev_error;		/* gap at the step before */
+	int last_pwm;			/* last value written to pwm# */
+	gint64 last_time;		/* monotonic time of the last step */
+};
+
+static struct fan_control fan_control;
+
+/* Give the fan back to the automatic control */
+
+static void
+restore_fan_control(void)
+{
+	if (fan_control.dir_fd == -1) {
+		return;
+	}
+	if (fan_control.saved_pwm_len > 0) {
+		write_sys_file(fan_control.dir_fd, fan_control.pwm_path, fan_control.saved_pwm, fan_control.saved_pwm_len);
+	}
+	write_sys_file(fan_control.dir_fd, fan_control.enable_path, fan_control.saved_enable, fan_control.saved_enable_len);
+	close(fan_control.dir_fd);
+	fan_control.dir_fd = -1;
+}
+
+/* Stop controlling the fan, logging why */
+
+static void
+stop_fan_control(const char *reason, gboolean failed)
+{
+	if (fan_control.dir_fd != -1) {
+		restore_fan_control();
+		if (log_file != NULL) {
+			fprintf(log_file, "Fan control restored pwm%d_enable to %.*s at %s, %s.\n",
+				fan_control.pwm, fan_control.saved_enable_len, fan_control.saved_enable, show_time(), reason);
+			fflush(log_file);
+		}
+	}
+	if (failed) {
+		fan_control.failed = TRUE;
+	}
+}
+
+/* Take over the fan */
+
+static gboolean
+start_fan_control()
+{
+	char buf[ FAN_VALUE_LEN ];
+	int dir_fd;
+	int len;
+
+	dir_fd = open(fan_control.dir_name, O_DIRECTORY | __O_PATH | O_CLOEXEC);
+	if (dir_fd == -1) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Fan control could not open '%s'.\n", fan_control.dir_name);
+		}
+		return FALSE;
+	}
+
+	snprintf(fan_control.pwm_path, FAN_PATH_LEN, "pwm%d", fan_control.pwm);
+	snprintf(fan_control.enable_path, FAN_PATH_LEN, "pwm%d_enable", fan_control.pwm);
+
+	len = read_sys_file(dir_fd, fan_control.enable_path, buf, FAN_VALUE_LEN);
+	if (len <= 0 || !isdigit(buf[0])) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Fan control could not read '%s/%s'.\n", fan_control.dir_name, fan_control.enable_path);
+		}
+		close(dir_fd);
+		return FALSE;
+	}
+	while (len > 0 && isspace(buf[len-1])) len--;
+	memcpy(fan_control.saved_enable, buf, len);
+	fan_control.saved_enable_len = len;
+
+	len = read_sys_file(dir_fd, fan_control.pwm_path, buf, FAN_VALUE_LEN);
+	while (len > 0 && isspace(buf[len-1])) len--;
+	fan_control.saved_pwm_len = (len > 0 && isdigit(buf[0])? len: 0);
+	memcpy(fan_control.saved_pwm, buf, fan_control.saved_pwm_len);
+	fan_control.duty = (len > 0? (atoi(buf) * 100.0) / 255.0: 100.0);
+
+	add_restore_function(restore_fan_control);
+
+	fan_control.dir_fd = dir_fd;
+
+	if (!write_sys_file(dir_fd, fan_control.enable_path, "1\n", 2)) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Fan control could not write '%s/%s'.\n", fan_control.dir_name, fan_control.enable_path);
+		}
+		fan_control.dir_fd = -1;
+		close(dir_fd);
+		return FALSE;
+	}
+
+	fan_control.curve_temp = -1;
+	fan_control.last_error = 0.0;
+	fan_control.prev_error = 0.0;
+	fan_control.last_pwm = -1;
+	fan_control.last_time = 0;
+
+	if (log_file != NULL) {
+		fprintf(log_file, "Fan control took over '%s/%s' at %s, was %.*s.\n",
+			fan_control.dir_name, fan_control.pwm_path, show_time(),
+			fan_control.saved_enable_len, fan_control.saved_enable);
+		fflush(log_file);
+	}
+
+	return TRUE;
+}
+
+/* Find the duty for a temperature on the curve */
+
+static double
+fan_curve_duty(int temp)
+{
+	const struct fan_curve_point *lo;
+	const struct fan_curve_point *hi;
+	int i;
+
+	if (temp <= fan_control.curve[0].temp) {
+		return fan_control.curve[0].duty;
+	}
+	for (i = 1; i < fan_control.num_points; i++) {
+		lo = &fan_control.curve[i-1];
+		hi = &fan_control.curve[i];
+		if (temp <= hi->temp) {
+			return lo->duty + ((double) (hi->duty - lo->duty) * (temp - lo->temp)) / (hi->temp - lo->temp);
+		}
+	}
+	return fan_control.curve[ fan_control.num_points - 1 ].duty;
+}
+
+/* Run one step of the fan controller */
+
+static void
+control_fan(int temperature)
+{
+	char buf[ FAN_VALUE_LEN ];
+	double target;
+	double error;
+	double ki_dt;
+	double dt;
+	gint64 now;
+	int temp;
+	int pwm;
+	int len;
+
+	if (fan_control.dir_name == NULL || fan_control.num_points == 0 || fan_control.failed) {
+		return;
+	}
+
+	if (fan_control.dir_fd == -1 && !start_fan_control()) {
+		fan_control.failed = TRUE;
+		return;
+	}
+
+	/* read the controlling temperature */
+
+	temp = temperature;
+	if (fan_control.temp_name != NULL) {
+		temp = 0;
+		len = read_sys_file(AT_FDCWD, fan_control.temp_name, buf, FAN_VALUE_LEN);
+		if (len > 0 && isdigit(buf[0])) {
+			temp = atoi(buf) / 1000;
+		}
+	}
+	if (temp <= 0) {
+		stop_fan_control("temperature read failed", TRUE);
+		return;
+	}
+
+	/* only follow falling temperatures after they drop by the hysteresis */
+
+	if (fan_control.curve_temp < 0 || temp >= fan_control.curve_temp || temp <= fan_control.curve_temp - fan_control.hysteresis) {
+		fan_control.curve_temp = temp;
+	}
+
+	target = fan_curve_duty(fan_control.curve_temp);
+
+	/* move the duty toward the curve */
+
+	now = g_get_monotonic_time();
+	dt = (fan_control.last_time == 0? interval: (now - fan_control.last_time) / 1000000.0);
+	fan_control.last_time = now;
+
+	/* the integral step never passes the curve, even after a long interval */
+
+	error = target - fan_control.duty;
+	ki_dt = fan_control.ki * dt;
+	if (ki_dt > 1.0) ki_dt = 1.0;
+	fan_control.duty += fan_control.kp * (error - fan_control.last_error) + ki_dt * error +
+		(dt > 0? fan_control.kd * (error - 2.0 * fan_control.last_error + fan_control.prev_error) / dt: 0.0);
+	fan_control.prev_error = fan_control.last_error;
+	fan_control.last_error = error;
+
+	if (temp >= warning_temperature) {
+		/* no smoothing when hot */
+		fan_control.duty = 100.0;
+	}
+	if (fan_control.duty < 0.0) fan_control.duty = 0.0;
+	if (fan_control.duty > 100.0) fan_control.duty = 100.0;
+
+	pwm = (int) ((fan_control.duty * 255.0) / 100.0 + 0.5);
+
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "fan control temp %d curve temp %d target %.1f%% duty %.1f%% pwm %d\n",
+			temp, fan_control.curve_temp, target, fan_control.duty, pwm);
+	}
+
+	if (pwm != fan_control.last_pwm) {
+		len = snprintf(buf, FAN_VALUE_LEN, "%d\n", pwm);
+		if (!write_sys_file(fan_control.dir_fd, fan_control.pwm_path, buf, len)) {
+			stop_fan_control("pwm write failed", TRUE);
+			return;
+		}
+		fan_control.last_pwm = pwm;
+	}
+}
+
+/* Read the fancurve setting, a list of temp:duty pairs with rising temperatures */
+
+static void
+read_fan_curve(const char *setup_name, const char *buf)
+{
+	const char *p;
+	char *end;
+	int temp;
+	int duty;
+
+	fan_control.num_points = 0;
+	for (p = buf; *p != '\0'; ) {
+		while (*p == ' ' || *p == '\t' || *p == ',') p++;
+		if (*p == '\0') {
+			break;
+		}
+		temp = (int) strtol(p, &end, 10);
+		if (end == p || *end != ':') {
+			break;
+		}
+		p = end + 1;
+		duty = (int) strtol(p, &end, 10);
+		if (end == p || fan_control.num_points >= MAX_FAN_CURVE_POINTS ||
+		    (fan_control.num_points > 0 && temp <= fan_control.curve[ fan_control.num_points - 1 ].temp)) {
+			break;
+		}
+		p = end;
+		if (duty < 0) duty = 0;
+		if (duty > 100) duty = 100;
+		fan_control.curve[ fan_control.num_points ].temp = temp;
+		fan_control.curve[ fan_control.num_points ].duty = duty;
+		fan_control.num_points++;
+	}
+	if (*p != '\0') {
+		fan_control.num_points = 0;
+		if (log_file != NULL)
+			fprintf(log_file, "Setup file '%s' has bad 'fancurve' '%s'.\n", setup_name, buf);
+	}
+}
+
+/* Cgroup throttling governor */
+/*   When throttlecgroup names a cgroup v2 directory, such as a build.slice, and the */
+/*   cpu stays at or above the warn temperature for throttlesustain seconds, the */
+/*   governor lowers the cgroup's cpu.max by a quarter every throttlestep seconds, */
+/*   down to throttlemin percent.  The percents are of the original limit, the */
+/*   saved cpu.max quota or all cpus for max, so no step loosens it.  Once the */
+/*   temperature is at or below throttlerelease, the limit is raised in steps and */
+/*   then the original cpu.max is written back.  The original is also restored on */
+/*   exit and on reload. */
+
+enum cpu_throttle_enum { CPU_MAX_LEN = 48 };
+
+struct cpu_throttle {
+	char *dir_name;			/* cgroup directory from the setup file, NULL if off */
+	int release_temperature;	/* restore at or below, degrees, -1 for warn - 10 */
+	int sustain;			/* seconds above warn before throttling */
+	int step;			/* seconds between adjustments */
+	int min_percent;		/* lowest limit in percent of saved_quota */
+	int dir_fd;			/* open directory, -1 if not engaged */
+	char saved_cpu_max[ CPU_MAX_LEN ];	/* cpu.max before throttling */
+	int saved_cpu_max_len;
+	long period;			/* cpu.max period in microseconds */
+	long saved_quota;		/* cpu.max quota before throttling, period * cpus for max */
+	int percent;			/* current limit in percent of saved_quota, 100 when not throttled */
+	time_t hot_since;		/* start of the current overheat, 0 if not hot */
+	time_t last_step_time;		/* time of the last adjustment */
+	gboolean failed;		/* stop until the setup file is read again */
+};
+
+static struct cpu_throttle cpu_throttle;
+
+/* Write back the original cpu.max */
+
+static void
+restore_cpu_throttle(void)
+{
+	if (cpu_throttle.dir_fd == -1) {
+		return;
+	}
+	write_sys_file(cpu_throttle.dir_fd, "cpu.max", cpu_throttle.saved_cpu_max, cpu_throttle.saved_cpu_max_len);
+	close(cpu_throttle.dir_fd);
+	cpu_throttle.dir_fd = -1;
+}
+
+/* Stop throttling, logging why */
+
+static void
+stop_cpu_throttle(const char *reason, gboolean failed)
+{
+	if (cpu_throttle.dir_fd != -1) {
+		restore_cpu_throttle();
+		if (log_file != NULL) {
+			fprintf(log_file, "Throttle restored '%s/cpu.max' to '%.*s' at %s, %s.\n",
+				cpu_throttle.dir_name, cpu_throttle.saved_cpu_max_len, cpu_throttle.saved_cpu_max,
+				show_time(), reason);
+			fflush(log_file);
+		}
+	}
+	cpu_throttle.percent = 100;
+	if (failed) {
+		cpu_throttle.failed = TRUE;
+	}
+}
+
+/* Open the cgroup and save its cpu.max */
+
+static gboolean
+start_cpu_throttle()
+{
+	char buf[ CPU_MAX_LEN ];
+	char *p;
+	long cpus;
+	int dir_fd;
+	int len;
+
+	dir_fd = open(cpu_throttle.dir_name, O_DIRECTORY | __O_PATH | O_CLOEXEC);
+	len = (dir_fd == -1? -1: read_sys_file(dir_fd, "cpu.max", buf, CPU_MAX_LEN));
+	while (len > 0 && isspace(buf[len-1])) len--;
+	if (len <= 0) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Throttle could not read '%s/cpu.max'.\n", cpu_throttle.dir_name);
+		}
+		if (dir_fd != -1) close(dir_fd);
+		return FALSE;
+	}
+	buf[ len ] = '\0';
+	memcpy(cpu_throttle.saved_cpu_max, buf, len);
+	cpu_throttle.saved_cpu_max_len = len;
+
+	p = strchr(buf, ' ');
+	cpu_throttle.period = (p != NULL? atol(p + 1): 0);
+	if (cpu_throttle.period <= 0) {
+		cpu_throttle.period = 100000;
+	}
+
+	/* "max 100000" has no limit, so the cpus are the limit */
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) cpus = 1;
+	cpu_throttle.saved_quota = (strncmp(buf, "max", 3) == 0? cpu_throttle.period * cpus: atol(buf));
+	if (cpu_throttle.saved_quota <= 0) {
+		cpu_throttle.saved_quota = cpu_throttle.period * cpus;
+	}
+
+	cpu_throttle.dir_fd = dir_fd;
+	add_restore_function(restore_cpu_throttle);
+	return TRUE;
+}
+
+/* Write a cpu.max limit in percent of the original limit */
+/*   The limit is never looser than the original */
+
+static void
+set_cpu_throttle(int percent, int temperature)
+{
+	char buf[ CPU_MAX_LEN ];
+	long quota;
+	int len;
+
+	quota = (cpu_throttle.saved_quota * percent) / 100;
+	if (quota < 1000) quota = 1000;
+	if (quota > cpu_throttle.saved_quota) quota = cpu_throttle.saved_quota;
+
+	len = snprintf(buf, CPU_MAX_LEN, "%ld %ld", quota, cpu_throttle.period);
+	if (!write_sys_file(cpu_throttle.dir_fd, "cpu.max", buf, len)) {
+		stop_cpu_throttle("cpu.max write failed", TRUE);
+		return;
+	}
+	if (log_file != NULL) {
+		fprintf(log_file, "Throttle '%s' from %d%% to %d%% of quota %ld, cpu.max '%s', temp %d at %s.\n",
+			cpu_throttle.dir_name, cpu_throttle.percent, percent, cpu_throttle.saved_quota, buf, temperature, show_time());
+		fflush(log_file);
+	}
+	cpu_throttle.percent = percent;
+}
+
+/* Run one step of the governor */
+
+static void
+govern_cpu_throttle(int temperature, time_t current_time)
+{
+	int release_temperature;
+	int percent;
+
+	if (cpu_throttle.dir_name == NULL || cpu_throttle.failed) {
+		return;
+	}
+
+	release_temperature = cpu_throttle.release_temperature;
+	if (release_temperature < 0) {
+		release_temperature = warning_temperature - 10;
+	}
+
+	if (temperature >= warning_temperature) {
+		if (cpu_throttle.hot_since == 0) {
+			cpu_throttle.hot_since = current_time;
+		}
+		if (current_time - cpu_throttle.hot_since < cpu_throttle.sustain ||
+		    current_time - cpu_throttle.last_step_time < cpu_throttle.step ||
+		    cpu_throttle.percent <= cpu_throttle.min_percent) {
+			return;
+		}
+		if (cpu_throttle.dir_fd == -1 && !start_cpu_throttle()) {
+			cpu_throttle.failed = TRUE;
+			return;
+		}
+		percent = cpu_throttle.percent - (cpu_throttle.percent + 3) / 4;
+		if (percent < cpu_throttle.min_percent) percent = cpu_throttle.min_percent;
+		cpu_throttle.last_step_time = current_time;
+		set_cpu_throttle(percent, temperature);
+		return;
+	}
+
+	cpu_throttle.hot_since = 0;
+
+	if (temperature > release_temperature || cpu_throttle.dir_fd == -1 ||
+	    current_time - cpu_throttle.last_step_time < cpu_throttle.step) {
+		return;
+	}
+
+	cpu_throttle.last_step_time = current_time;
+	percent = cpu_throttle.percent + 25;
+	if (percent >= 100) {
+		stop_cpu_throttle("temperature released", FALSE);
+	} else {
+		set_cpu_throttle(percent, temperature);
+	}
+}
+
+/* Read an interval */
+/*   return TRUE and read the value if id matches the name */
+/*   return FALSE otherwise */
+
+static gboolean
+check_read_interval(const char *setup_name, const char *id, const char *interval_name, int *interval_ptr, int min_val, int max_val, const char *units, const char *buf, int len)
+{
+	if (strcmp(id, interval_name) != 0) {
+		return FALSE;
+	}
+	if (len == 0 || !isdigit(buf[0])) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Setup file '%s' has '%s' without numeric value.\n", setup_name, id);
+		}
+	} else {
+		*interval_ptr = atoi(buf);
+		if (*interval_ptr < min_val) *interval_ptr = min_val;
+		if (*interval_ptr > max_val) *interval_ptr = max_val;
+		if (debug && log_file != NULL) fprintf(log_file, "Set '%s' to %d %s.\n", id, *interval_ptr, units);
+	}
+	return TRUE;
+}
+
+/* Read a boolean */
+
+static gboolean
+check_read_boolean(const char *setup_name, const char *id, const char *flag_name, int *flag_ptr, const char *buf, int len)
+{
+	if (strcmp(id, flag_name) != 0) {
+		return FALSE;
+	}
+
+	*flag_ptr =
+		((len == 0 ||
+		  (isdigit(buf[0]) && atoi(buf) > 0) ||
+		  (buf[0] == 'y' || buf[0] == 't'))? 1: 0);
+
+	if (*flag_ptr == 0 && buf[0] != '0' && buf[0] != 'n' && buf[0] != 'f') {
+		if (log_file != NULL) {
+			fprintf(log_file, "Setup file '%s' has '%s' without boolean value.\n", setup_name, id);
+		}
+	}
+
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "Set '%s' to %d.\n", flag_name, *flag_ptr);
+	}
+
+	return TRUE;
+}
+
+/* Update settings */
+/*   All settings except temp are responsible for their leading space */
+/*   to simplify formatting with optional settings */
+
+static void
+update_settings()
+{
+	temp_text = (do_unicode? "\xF0\x9F\x8C\xA1": "Temp");
+	gpu_text = (do_unicode? " \xF0\x9F\x8E\xA8": " G");
+	ssd_text = (do_unicode? " \xF0\x9F\x96\xB4": " H");
+	drive_text = (do_unicode? " \xF0\x9F\x92\xBD": " D");
+	plugin_text = (do_unicode? " \xF0\x9F\x94\x8C": " P");
+	remote_text = (do_unicode? " \xF0\x9F\x96\xA5": " R");
+	fan_text = (do_unicode? " \xE2\x9D\x83": " Fan");
+}
+
+/* Sampling profiles */
+/*   A profile overrides the check intervals while on ac or battery power. */
+/*   Fields are -1 when the profile does not set them. */
+
+enum profile_enum { MAX_PROFILES = 8, PROFILE_NAME_LEN = 20 };
+
+struct sampling_profile {
+	char name[ PROFILE_NAME_LEN ];	/* name from the profile line */
+	int interval;			/* time between temperature checks */
+	int temperature_interval;	/* interval to update temperature if it only changed a little */
+	int fan_check_interval;		/* interval to check fan */
+	int gpu_temp_interval;		/* interval to check gpu */
+	int ssd_temp_interval;		/* interval to check ssd */
+};
+
+static struct sampling_profile profiles[ MAX_PROFILES ];
+static int num_profiles = 0;
+static struct sampling_profile base_profile = { "default", -1, -1, -1, -1, -1 };	/* intervals outside of profiles */
+static const struct sampling_profile *active_profile = NULL;	/* profile in use, NULL for the base intervals */
+static char ac_profile_name[ PROFILE_NAME_LEN ] = "ac";		/* profile to use on mains power */
+static char battery_profile_name[ PROFILE_NAME_LEN ] = "battery";	/* profile to use on battery power */
+
+/* Find or add a profile by name */
+
+static struct sampling_profile *
+find_profile(const char *name, gboolean add)
+{
+	int i;
+	struct sampling_profile *profile;
+
+	for (i = 0; i < num_profiles; i++) {
+		if (strcmp(profiles[i].name, name) == 0) {
+			return &profiles[i];
+		}
+	}
+	if (!add || num_profiles >= MAX_PROFILES) {
+		return NULL;
+	}
+	profile = &profiles[ num_profiles++ ];
+	memset(profile, 0, sizeof(*profile));
+	strncpy(profile->name, name, PROFILE_NAME_LEN - 1);
+	profile->interval = profile->temperature_interval = profile->fan_check_interval =
+		profile->gpu_temp_interval = profile->ssd_temp_interval = -1;
+	return profile;
+}
+
+/* Scale a base interval to a profile */
+/*   Intervals that the profile does not set keep their ratio to the main interval */
+
+static int
+profile_interval(int profile_val, int base_val, int profile_main_interval)
 {
-	if (strcmp(id, interval_name) != 0) {
-		return FALSE;
+	if (profile_val >= 0) {
+		return profile_val;
 	}
-	if (len == 0 || !isdigit(buf[0])) {
-		if (log_file != NULL) {
-			fprintf(log_file, "Setup file '%s' has '%s' without numeric value.\n", setup_name, id);
-		}
+	if (base_profile.interval <= 0) {
+		return base_val;
+	}
+	return (base_val * profile_main_interval) / base_profile.interval;
+}
+
+/* Select the profile for the current power source and set the intervals */
+
+static void
+select_profile()
+{
+	const struct sampling_profile *profile;
+	int main_interval;
+
+	profile = find_profile((on_ac_power? ac_profile_name: battery_profile_name), FALSE);
+
+	if (profile == NULL) {
+		interval = base_profile.interval;
+		temperature_interval = base_profile.temperature_interval;
+		fan_check_interval = base_profile.fan_check_interval;
+		gpu_temp_interval = base_profile.gpu_temp_interval;
+		ssd_temp_interval = base_profile.ssd_temp_interval;
 	} else {
-		*interval_ptr = atoi(buf);
-		if (*interval_ptr < min_val) *interval_ptr = min_val;
-		if (*interval_ptr > max_val) *interval_ptr = max_val;
-		if (debug && log_file != NULL) fprintf(log_file, "Set '%s' to %d %s.\n", id, *interval_ptr, units);
+		main_interval = (profile->interval > 0? profile->interval: base_profile.interval);
+		interval = main_interval;
+		temperature_interval = profile_interval(profile->temperature_interval, base_profile.temperature_interval, main_interval);
+		fan_check_interval = profile_interval(profile->fan_check_interval, base_profile.fan_check_interval, main_interval);
+		gpu_temp_interval = profile_interval(profile->gpu_temp_interval, base_profile.gpu_temp_interval, main_interval);
+		ssd_temp_interval = profile_interval(profile->ssd_temp_interval, base_profile.ssd_temp_interval, main_interval);
 	}
-	return TRUE;
+
+	if (profile != active_profile && log_file != NULL) {
+		fprintf(log_file, "Using %s profile '%s' at %s, interval %d seconds.\n",
+			(on_ac_power? "ac": "battery"), (profile? profile->name: base_profile.name), show_time(), interval);
+		fflush(log_file);
+	}
+
+	active_profile = profile;
 }
 
-/* Read a boolean */
+/* Check if the machine is running on mains power */
+/*   Returns TRUE if any non-battery power supply is online, */
+/*   or if there are no power supplies with an online file, as on most desktops */
 
-static gboolean
-check_read_boolean(const char *setup_name, const char *id, const char *flag_name, int *flag_ptr, const char *buf, int len)
+static int
+check_ac_power()
 {
-	if (strcmp(id, flag_name) != 0) {
-		return FALSE;
+	DIR *dir;
+	struct dirent *ent;
+	char path[ MAX_BUF ];
+	char buf[ MAX_BUF ];
+	int fd;
+	int len;
+	int found;
+	int online;
+
+	dir = opendir("/sys/class/power_supply");
+	if (dir == NULL) {
+		return TRUE;
 	}
 
-	*flag_ptr =
-		((len == 0 ||
-		  (isdigit(buf[0]) && atoi(buf) > 0) ||
-		  (buf[0] == 'y' || buf[0] == 't'))? 1: 0);
+	found = FALSE;
+	online = FALSE;
 
-	if (*flag_ptr == 0 && buf[0] != '0' && buf[0] != 'n' && buf[0] != 'f') {
-		if (log_file != NULL) {
-			fprintf(log_file, "Setup file '%s' has '%s' without boolean value.\n", setup_name, id);
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.' || strlen(ent->d_name) > MAX_BUF - 10) {
+			continue;
+		}
+		sprintf(path, "%s/type", ent->d_name);
+		fd = openat(dirfd(dir), path, O_RDONLY);
+		if (fd != -1) {
+			len = read(fd, buf, MAX_BUF - 1);
+			close(fd);
+			if (len > 0 && strncmp(buf, "Battery", 7) == 0) {
+				continue;
+			}
+		}
+		sprintf(path, "%s/online", ent->d_name);
+		fd = openat(dirfd(dir), path, O_RDONLY);
+		if (fd == -1) {
+			continue;
+		}
+		len = read(fd, buf, MAX_BUF - 1);
+		close(fd);
+		if (len > 0) {
+			found = TRUE;
+			if (buf[0] == '1') {
+				online = TRUE;
+			}
+			if (debug && log_file != NULL) {
+				fprintf(log_file, "power supply %s online %c\n", ent->d_name, buf[0]);
+			}
 		}
 	}
 
-	if (debug && log_file != NULL) {
-		fprintf(log_file, "Set '%s' to %d.\n", flag_name, *flag_ptr);
-	}
+	closedir(dir);
 
-	return TRUE;
+	return (found? online: TRUE);
 }
 
-/* Update settings */
-/*   All settings except temp are responsible for their leading space */
-/*   to simplify formatting with optional settings */
+/* Save the intervals from the setup file and apply the profile */
 
 static void
-update_settings()
+set_base_profile()
 {
-	temp_text = (do_unicode? "\xF0\x9F\x8C\xA1": "Temp");
-	gpu_text = (do_unicode? " \xF0\x9F\x8E\xA8": " G");
-	ssd_text = (do_unicode? " \xF0\x9F\x96\xB4": " H");
-	fan_text = (do_unicode? " \xE2\x9D\x83": " Fan");
+	base_profile.interval = interval;
+	base_profile.temperature_interval = temperature_interval;
+	base_profile.fan_check_interval = fan_check_interval;
+	base_profile.gpu_temp_interval = gpu_temp_interval;
+	base_profile.ssd_temp_interval = ssd_temp_interval;
+
+	select_profile();
 }
 
 /* Read the setup file */
@@ -738,6 +3921,8 @@ read_setup_file()
 	int ch;
 	char *str;
 	struct stat stat_buf;
+	struct sampling_profile *section;
+	int i;
 
 	if (debug && log_file != NULL) {
 		fprintf(log_file, "Reading setup file %s.\n", setup_name);
@@ -747,6 +3932,41 @@ read_setup_file()
 	setup_mtime = 0;
 	setup_check_time = time(NULL);
 
+	stop_fan_control("reading setup file", FALSE);
+	free(fan_control.dir_name);
+	free(fan_control.temp_name);
+	fan_control.dir_name = NULL;
+	fan_control.temp_name = NULL;
+	fan_control.pwm = 1;
+	fan_control.num_points = 0;
+	fan_control.kp = DEFAULT_FAN_KP;
+	fan_control.ki = DEFAULT_FAN_KI;
+	fan_control.kd = DEFAULT_FAN_KD;
+	fan_control.hysteresis = 3;
+	fan_control.failed = FALSE;
+
+	unload_plugins();
+	free(plugin_dir);
+	plugin_dir = NULL;
+	clear_command_sensors();
+	clear_remotes();
+
+	for (i = 0; i < NUM_PSI; i++) {
+		psi_triggers[i].stall = 0;
+	}
+	psi_window = 2000;
+
+	stop_cpu_throttle("reading setup file", FALSE);
+	free(cpu_throttle.dir_name);
+	cpu_throttle.dir_name = NULL;
+	cpu_throttle.release_temperature = -1;
+	cpu_throttle.sustain = 10;
+	cpu_throttle.step = 10;
+	cpu_throttle.min_percent = 10;
+	cpu_throttle.hot_since = 0;
+	cpu_throttle.last_step_time = 0;
+	cpu_throttle.failed = FALSE;
+
 	setup_file = fopen(setup_name, "r");
 
 	if (setup_file == NULL) {
@@ -754,12 +3974,31 @@ read_setup_file()
 			fprintf(log_file, "Could not open setup file %s.\n", setup_name);
 			fflush(log_file);
 		}
+		num_profiles = 0;
+		set_base_profile();
 		update_settings();
+		load_plugins();
+		open_psi_triggers();
 		return;
 	}
 
+	if (base_profile.interval > 0) {
+		/* undo the interval from the last profile */
+		interval = base_profile.interval;
+	}
+
 	temperature_interval = fan_check_interval = gpu_temp_interval = ssd_temp_interval = warning_interval = -1;
 	ssd_hide_temperature = -1;
+	drive_hide_temperature = -1;
+	drive_idle_time = -1;
+
+	num_profiles = 0;
+	active_profile = NULL;
+	section = NULL;
+	num_format_ops = 0;
+	format_generation++;
+	strcpy(ac_profile_name, "ac");
+	strcpy(battery_profile_name, "battery");
 
 	if (fstat(fileno(setup_file), &stat_buf) == 0) {
 		setup_mtime = stat_buf.st_mtim.tv_sec;
@@ -827,22 +4066,126 @@ read_setup_file()
 			;
 		} else if (check_read_boolean(setup_name, id, "unicode", &do_unicode, buf, len)) {
 			;
-		} else if (check_read_interval(setup_name, id, "interval", &interval, 1, MAX_INTERVAL, "seconds", buf, len)) {
+		} else if (strcmp(id, "format") == 0) {
+			compile_format(buf);
+		} else if (strcmp(id, "profile") == 0) {
+			if (len == 0 || strcmp(buf, "end") == 0) {
+				section = NULL;
+			} else {
+				section = find_profile(buf, TRUE);
+				if (section == NULL && log_file != NULL) {
+					fprintf(log_file, "Setup file '%s' has too many profiles, ignoring '%s'.\n", setup_name, buf);
+				}
+			}
+		} else if (strcmp(id, "acprofile") == 0 || strcmp(id, "batteryprofile") == 0) {
+			str = (id[0] == 'a'? ac_profile_name: battery_profile_name);
+			if (len == 0 || len >= PROFILE_NAME_LEN) {
+				if (log_file != NULL)
+					fprintf(log_file, "Setup file '%s' has '%s' without a valid profile name.\n", setup_name, id);
+			} else {
+				strcpy(str, buf);
+				if (debug && log_file != NULL) fprintf(log_file, "Set '%s' to '%s'.\n", id, str);
+			}
+		} else if (check_read_interval(setup_name, id, "interval", (section? &section->interval: &interval), 1, MAX_INTERVAL, "seconds", buf, len)) {
 			if (interval < 1) interval = 1;
-		} else if (check_read_interval(setup_name, id, "tempinterval", &temperature_interval, 0, MAX_INTERVAL, "seconds", buf, len)) {
+		} else if (check_read_interval(setup_name, id, "tempinterval", (section? &section->temperature_interval: &temperature_interval), 0, MAX_INTERVAL, "seconds", buf, len)) {
 			;
-		} else if (check_read_interval(setup_name, id, "gpuinterval", &gpu_temp_interval, 0, MAX_INTERVAL, "seconds", buf, len)) {
+		} else if (check_read_interval(setup_name, id, "gpuinterval", (section? &section->gpu_temp_interval: &gpu_temp_interval), 0, MAX_INTERVAL, "seconds", buf, len)) {
 			;
-		} else if (check_read_interval(setup_name, id, "ssdinterval", &ssd_temp_interval, 0, MAX_INTERVAL, "seconds", buf, len)) {
+		} else if (check_read_interval(setup_name, id, "ssdinterval", (section? &section->ssd_temp_interval: &ssd_temp_interval), 0, MAX_INTERVAL, "seconds", buf, len)) {
 			;
 		} else if (check_read_interval(setup_name, id, "ssdhidetemp", &ssd_hide_temperature, 0, MAX_WARNING_TEMPERATURE, "degrees", buf, len)) {
 			;
-		} else if (check_read_interval(setup_name, id, "faninterval", &fan_check_interval, 0, MAX_INTERVAL, "seconds", buf, len)) {
+		} else if (check_read_interval(setup_name, id, "drivehidetemp", &drive_hide_temperature, 0, MAX_WARNING_TEMPERATURE, "degrees", buf, len)) {
+			;
+		} else if (check_read_interval(setup_name, id, "driveidle", &drive_idle_time, 0, 100000, "seconds", buf, len)) {
+			;
+		} else if (check_read_interval(setup_name, id, "faninterval", (section? &section->fan_check_interval: &fan_check_interval), 0, MAX_INTERVAL, "seconds", buf, len)) {
 			;
 		} else if (check_read_interval(setup_name, id, "warn", &warning_temperature, 0, MAX_WARNING_TEMPERATURE, "degrees", buf, len)) {
 			;
 		} else if (check_read_interval(setup_name, id, "warninterval", &warning_interval, 0, MAX_INTERVAL, "seconds", buf, len)) {
 			;
+		} else if (check_read_interval(setup_name, id, "hotprocs", &hot_process_count, 0, MAX_HOT_PROCESSES, "processes", buf, len)) {
+			;
+		} else if (strcmp(id, "fancontrol") == 0 || strcmp(id, "fantemp") == 0) {
+			if (len == 0) {
+				if (log_file != NULL)
+					fprintf(log_file, "Setup file '%s' has '%s' without a path.\n", setup_name, id);
+			} else {
+				str = strdup(buf);
+				if (str != NULL) {
+					if (id[3] == 'c') {
+						free(fan_control.dir_name);
+						fan_control.dir_name = str;
+					} else {
+						free(fan_control.temp_name);
+						fan_control.temp_name = str;
+					}
+					if (debug && log_file != NULL) fprintf(log_file, "Set '%s' to '%s'.\n", id, str);
+				}
+			}
+		} else if (check_read_interval(setup_name, id, "fanpwm", &fan_control.pwm, 1, 16, "pwm", buf, len)) {
+			;
+		} else if (strcmp(id, "fancurve") == 0) {
+			read_fan_curve(setup_name, buf);
+		} else if (strcmp(id, "fanpid") == 0) {
+			if (sscanf(buf, "%lf %lf %lf", &fan_control.kp, &fan_control.ki, &fan_control.kd) != 3 ||
+			    fan_control.kp < 0.0 || fan_control.kp > 1.0 || fan_control.ki < 0.0 || fan_control.kd < 0.0) {
+				fan_control.kp = DEFAULT_FAN_KP;
+				fan_control.ki = DEFAULT_FAN_KI;
+				fan_control.kd = DEFAULT_FAN_KD;
+				if (log_file != NULL)
+					fprintf(log_file, "Setup file '%s' has bad 'fanpid' '%s'.\n", setup_name, buf);
+			}
+		} else if (check_read_interval(setup_name, id, "fanhysteresis", &fan_control.hysteresis, 0, 20, "degrees", buf, len)) {
+			;
+		} else if (strcmp(id, "plugindir") == 0) {
+			if (len == 0) {
+				if (log_file != NULL)
+					fprintf(log_file, "Setup file '%s' has '%s' without a path.\n", setup_name, id);
+			} else {
+				str = strdup(buf);
+				if (str != NULL) {
+					free(plugin_dir);
+					plugin_dir = str;
+					if (debug && log_file != NULL) fprintf(log_file, "Set '%s' to '%s'.\n", id, str);
+				}
+			}
+		} else if (strcmp(id, "command") == 0) {
+			read_command_sensor(setup_name, buf);
+		} else if (check_read_interval(setup_name, id, "commandtimeout", &command_timeout, 10, 60000, "ms", buf, len)) {
+			;
+		} else if (strcmp(id, "remote") == 0) {
+			read_remote(setup_name, buf);
+		} else if (check_read_interval(setup_name, id, "psicpu", &psi_triggers[ PSI_CPU ].stall, 0, 10000, "ms", buf, len)) {
+			;
+		} else if (check_read_interval(setup_name, id, "psimemory", &psi_triggers[ PSI_MEMORY ].stall, 0, 10000, "ms", buf, len)) {
+			;
+		} else if (check_read_interval(setup_name, id, "psiio", &psi_triggers[ PSI_IO ].stall, 0, 10000, "ms", buf, len)) {
+			;
+		} else if (check_read_interval(setup_name, id, "psiwindow", &psi_window, 500, 10000, "ms", buf, len)) {
+			;
+		} else if (strcmp(id, "throttlecgroup") == 0) {
+			if (len == 0) {
+				if (log_file != NULL)
+					fprintf(log_file, "Setup file '%s' has '%s' without a path.\n", setup_name, id);
+			} else {
+				free(cpu_throttle.dir_name);
+				cpu_throttle.dir_name = malloc(len + 20);
+				if (cpu_throttle.dir_name != NULL) {
+					sprintf(cpu_throttle.dir_name, "%s%s", (buf[0] == '/'? "": "/sys/fs/cgroup/"), buf);
+					if (debug && log_file != NULL) fprintf(log_file, "Set '%s' to '%s'.\n", id, cpu_throttle.dir_name);
+				}
+			}
+		} else if (check_read_interval(setup_name, id, "throttlerelease", &cpu_throttle.release_temperature, 0, MAX_WARNING_TEMPERATURE, "degrees", buf, len)) {
+			;
+		} else if (check_read_interval(setup_name, id, "throttlesustain", &cpu_throttle.sustain, 0, MAX_INTERVAL, "seconds", buf, len)) {
+			;
+		} else if (check_read_interval(setup_name, id, "throttlestep", &cpu_throttle.step, 1, MAX_INTERVAL, "seconds", buf, len)) {
+			;
+		} else if (check_read_interval(setup_name, id, "throttlemin", &cpu_throttle.min_percent, 1, 100, "percent", buf, len)) {
+			;
 		} else if (strcmp(id, "debug") == 0) {
 			if (len == 0 || !isdigit(buf[0])) {
 				if (debug && log_file != NULL)
@@ -879,22 +4222,56 @@ read_setup_file()
 	if (ssd_hide_temperature < 0) {
 		ssd_hide_temperature = 40;
 	}
+	if (drive_hide_temperature < 0) {
+		drive_hide_temperature = 40;
+	}
+	if (drive_idle_time < 0) {
+		drive_idle_time = DEFAULT_DRIVE_IDLE_TIME;
+	}
+
+	set_base_profile();
 
 	update_settings();
 
+	load_plugins();
+
+	open_psi_triggers();
+
 	if (log_file != NULL) {
 		fprintf(log_file, "Read setup file '%s' at %s.\n", setup_name, show_time());
+		fprintf(log_file, " %s power, profile '%s', %d profiles\n", (on_ac_power? "ac": "battery"),
+			(active_profile? active_profile->name: base_profile.name), num_profiles);
 		fprintf(log_file, " interval %d seconds\n", interval);
 		fprintf(log_file, " small change temperature interval %d seconds\n", temperature_interval);
 		fprintf(log_file, " fan check interval %d seconds\n", fan_check_interval);
 		fprintf(log_file, " gpu check interval %d seconds\n", gpu_temp_interval);
 		fprintf(log_file, " ssd check interval %d seconds\n", ssd_temp_interval);
 		fprintf(log_file, " ssd hide temperature at or below %d degrees\n", ssd_hide_temperature);
+		fprintf(log_file, " sata drive hide temperature at or below %d degrees\n", drive_hide_temperature);
+		fprintf(log_file, " sata drive idle after %d seconds without io\n", drive_idle_time);
 		fprintf(log_file, " warn at cpu temp %d degrees\n", warning_temperature);
 		fprintf(log_file, " warn again after %d seconds\n", warning_interval);
+		fprintf(log_file, " show %d top cpu processes on warnings\n", hot_process_count);
+		if (fan_control.dir_name != NULL) {
+			fprintf(log_file, " fan control '%s' pwm%d, %d curve points, pid %g %g %g, hysteresis %d degrees\n",
+				fan_control.dir_name, fan_control.pwm, fan_control.num_points,
+				fan_control.kp, fan_control.ki, fan_control.kd, fan_control.hysteresis);
+		}
+		fprintf(log_file, " plugin dir '%s', %d plugins with %d sensors\n",
+			(plugin_dir? plugin_dir: "<none>"), num_plugins, num_plugin_sensors);
+		fprintf(log_file, " %d command sensors, reply timeout %d ms\n", num_command_sensors, command_timeout);
+		fprintf(log_file, " %d remotes\n", num_remotes);
+		fprintf(log_file, " pressure stall triggers cpu %d ms memory %d ms io %d ms in %d ms\n",
+			psi_triggers[ PSI_CPU ].stall, psi_triggers[ PSI_MEMORY ].stall, psi_triggers[ PSI_IO ].stall, psi_window);
+		if (cpu_throttle.dir_name != NULL) {
+			fprintf(log_file, " throttle '%s' after %d seconds hot, step %d seconds, min %d%%, release at %d degrees\n",
+				cpu_throttle.dir_name, cpu_throttle.sustain, cpu_throttle.step, cpu_throttle.min_percent,
+				(cpu_throttle.release_temperature < 0? warning_temperature - 10: cpu_throttle.release_temperature));
+		}
 		fprintf(log_file, " play sound '%s'\n", (sound_name? sound_name: "<none>"));
 		fprintf(log_file, " beep '%d'\n", do_beep);
 		fprintf(log_file, " unicode '%d'\n", do_unicode);
+		fprintf(log_file, " format %s with %d ops\n", (num_format_ops > 0? "set": "not set"), num_format_ops);
 		fprintf(log_file, " debug level %d\n", debug);
 		fflush(log_file);
 	}
@@ -909,17 +4286,28 @@ open_window (GtkEventBox *event_box, gboolean force_update)
 	static int last_temperature = 0;
 	static int last_gpu_temp = 0;
 	static int last_ssd_temp = 0;
+	static int last_drive_temp = 0;
+	static int last_plugin_temp = 0;
+	static int last_remote_temp = 0;
 	static int last_fan_speed = -1;
 	static time_t last_warning_time = 0;
 	static time_t last_fan_check_time = 0;
 	static time_t last_gpu_temp_check_time = 0;
 	static time_t last_ssd_temp_check_time = 0;
 	static time_t last_repaint_time = 0;
+	static int last_format_generation = 0;
 	time_t current_time;
 	int temperature;
 	int ssd_temp;
+	int drive_temp;
+	int plugin_temp;
+	int remote_temp;
 	int fan_speed;
-	enum open_window_enum { TEMP_BUF_LEN = 80 };
+	gboolean plugin_changed;
+	gboolean remote_changed;
+	gboolean label_changed;
+	uint64_t format_changes;
+	enum open_window_enum { TEMP_BUF_LEN = 160 };
 	char temp_buf[ TEMP_BUF_LEN ];
 
 	current_time = time(NULL);
@@ -945,37 +4333,77 @@ open_window (GtkEventBox *event_box, gboolean force_update)
 		last_ssd_temp_check_time = current_time;
 	}
 
+	drive_temp = last_drive_temp;
+
+	if (num_drives > 0) {
+		drive_temp = check_drive_temp(current_time);
+		if (drive_temp <= drive_hide_temperature) {
+			drive_temp = 0;
+		}
+	}
+
+	plugin_temp = sample_plugins(&plugin_changed);
+	remote_temp = poll_remotes(current_time, &remote_changed);
+	if (plugin_changed || remote_changed) {
+		update_tooltip(GTK_WIDGET(event_box));
+	}
+
 	if (debug && log_file != NULL) {
 		fprintf(log_file, "old temp %d new temp %d old gpu %d old ssd %d old fan %d new fan %d at %s\n",
 			last_temperature, temperature, last_gpu_temp, last_ssd_temp, last_fan_speed, fan_speed, show_time());
+		fprintf(log_file, "hwmon reads %ld, reads avoided by update interval %ld\n", hwmon_reads, hwmon_reads_avoided);
 		fflush(log_file);
 	}
 
-	if (temperature >= warning_temperature && current_time >= last_warning_time + warning_interval) {
+	control_fan(temperature);
+
+	govern_cpu_throttle(temperature, current_time);
+
+	if ((temperature >= warning_temperature || plugin_hot_sensor >= 0) && current_time >= last_warning_time + warning_interval) {
 		last_warning_time = current_time;
 		if (debug && log_file != NULL) {
 			fprintf(log_file, "high temp %d at %ld, last temp %d\n", temperature, last_warning_time, last_temperature);
 		}
-		if (do_beep) {
-			XBell( GDK_DISPLAY_XDISPLAY( gtk_widget_get_display( GTK_WIDGET( event_box ) ) ), 0 );
+		if (plugin_hot_sensor >= 0 && log_file != NULL) {
+			fprintf(log_file, "high plugin sensor '%s' %d at %s\n", plugin_sensors[ plugin_hot_sensor ].name,
+				plugin_samples[ plugin_hot_sensor ].value / 1000, show_time());
+			fflush(log_file);
+		}
+		check_hot_processes(GTK_WIDGET(event_box));
+		play_alert(GTK_WIDGET(event_box));
+	}
+
+	refresh_psi_averages(GTK_WIDGET(event_box), current_time, force_update);
+
+	if (num_format_ops > 0) {
+		/* the format decides which changes are visible */
+		if (current_time > last_gpu_temp_check_time + gpu_temp_interval) {
+			last_gpu_temp = check_gpu_temp();
+			last_gpu_temp_check_time = current_time;
 		}
-		if (sound_name != NULL) {
-			char *cmd;
-			cmd = malloc(strlen(sound_name) + 20);
-			if (cmd != NULL) {
-				sprintf(cmd, "play '%s' &", sound_name);
-				system(cmd);
-				free(cmd);
-			}
+		format_changes = render_format(temp_buf, TEMP_BUF_LEN);
+		label_changed = (format_changes != 0 || last_label == NULL);
+		if (debug && log_file != NULL) {
+			fprintf(log_file, "format changes %llx label '%s'\n", (unsigned long long) format_changes, temp_buf);
 		}
+	} else {
+		label_changed = (temperature != last_temperature || fan_speed != last_fan_speed || ssd_temp != last_ssd_temp ||
+			drive_temp != last_drive_temp || plugin_temp != last_plugin_temp || remote_temp != last_remote_temp);
+	}
+
+	if (format_generation != last_format_generation) {
+		/* the format changed */
+		last_format_generation = format_generation;
+		label_changed = TRUE;
 	}
 
-	if ((temperature != last_temperature || fan_speed != last_fan_speed || ssd_temp != last_ssd_temp) &&
+	if (label_changed &&
 	    (force_update ||
 	     abs(temperature - last_temperature) > 2 ||
 	     temperature >= warning_temperature ||
 	     last_temperature >= warning_temperature ||
 	     ssd_temp != last_ssd_temp ||
+	     drive_temp != last_drive_temp ||
 	     fan_speed != last_fan_speed ||
 	     current_time >= last_repaint_time + temperature_interval)) {
 
@@ -988,9 +4416,20 @@ open_window (GtkEventBox *event_box, gboolean force_update)
 
 		last_temperature = temperature;
 		last_ssd_temp = ssd_temp;
+		last_drive_temp = drive_temp;
+		last_plugin_temp = plugin_temp;
+		last_remote_temp = remote_temp;
 		last_fan_speed = fan_speed;
 		last_repaint_time = current_time;
-		if (temperature > 0) {
+		if (num_format_ops > 0) {
+			mark_format_shown();
+			last_label = gtk_label_new (temp_buf);
+			gtk_container_add (GTK_CONTAINER (event_box), last_label);
+			if (debug && log_file != NULL) {
+				fprintf(log_file, "add formatted label '%s'\n", temp_buf);
+				fflush(log_file);
+			}
+		} else if (temperature > 0) {
 			const char *gpu_mark;
 			char ssd_buf[ TEMP_BUF_LEN ];
 			if (current_time > last_gpu_temp_check_time + gpu_temp_interval) {
@@ -1002,6 +4441,15 @@ open_window (GtkEventBox *event_box, gboolean force_update)
 			if (last_ssd_temp > 0) {
 				sprintf(ssd_buf, "%s %d", ssd_text, last_ssd_temp);
 			}
+			if (last_drive_temp > 0) {
+				sprintf(&ssd_buf[ strlen(ssd_buf) ], "%s %d", drive_text, last_drive_temp);
+			}
+			if (last_plugin_temp > 0) {
+				sprintf(&ssd_buf[ strlen(ssd_buf) ], "%s %d", plugin_text, last_plugin_temp);
+			}
+			if (last_remote_temp > 0) {
+				sprintf(&ssd_buf[ strlen(ssd_buf) ], "%s %d", remote_text, last_remote_temp);
+			}
 			if (fan_speed > 0) {
 				sprintf(temp_buf, "%s %d%s%s%s %d", temp_text, temperature, gpu_mark, ssd_buf, fan_text, fan_speed);
 			} else {
@@ -1027,6 +4475,20 @@ open_window (GtkEventBox *event_box, gboolean force_update)
 
 static gint on_timer (gpointer data);
 
+/* Restart the timer if the interval changed */
+
+static void
+reset_timer(GtkWidget *event_box, int last_interval)
+{
+	if (interval != last_interval) {
+		g_source_remove(timer_handle);
+		timer_handle = g_timeout_add (interval * 1000, on_timer, event_box);
+		if (debug && log_file != NULL) {
+			fprintf(log_file, "Resetting timer from %d to %d seconds.\n", last_interval, interval);
+		}
+	}
+}
+
 /* Handle a left click on the panel */
 /*   Reload the setup file (if needed) and update the panel */
 
@@ -1066,13 +4528,7 @@ on_button_press (GtkWidget      *event_box,
 
 			read_setup_file();
 
-			if (interval != last_interval) {
-				g_source_remove(timer_handle);
-				timer_handle = g_timeout_add (interval * 1000, on_timer, event_box);
-				if (debug && log_file != NULL) {
-					fprintf(log_file, "Resetting timer from %d to %d seconds.\n", last_interval, interval);
-				}
-			}
+			reset_timer(event_box, last_interval);
 		}
 	}
 
@@ -1088,6 +4544,263 @@ on_timer (gpointer data)
 	return open_window(data, /* force update */ FALSE);
 }
 
+/* Handle a hwmon directory that was added */
+/*   Only the new directory is examined, the sensors in use are not touched */
+
+static gboolean
+add_hwmon_device(const char *devpath)
+{
+	static const char *gpu_names[] = { "amdgpu", "radeon", "nouveau", "i915", "xe", NULL };
+	char path[ 512 ];
+	char name[ MAX_BUF ];
+	char nvme_name[ SENSOR_NAME_LEN ];
+	const char *p;
+	int hwmon_num;
+	int dir_fd;
+	int i;
+
+	p = strrchr(devpath, '/');
+	if (p == NULL || strncmp(p, "/hwmon", 6) != 0 || !isdigit(p[6]) || strlen(devpath) > sizeof(path) - 10) {
+		return FALSE;
+	}
+	hwmon_num = atoi(&p[6]);
+	if (hwmon_in_use(hwmon_num)) {
+		return FALSE;
+	}
+
+	sprintf(path, "/sys%s", devpath);
+	dir_fd = open(path, O_DIRECTORY | __O_PATH);
+	if (dir_fd == -1) {
+		return FALSE;
+	}
+	if (read_sys_file(dir_fd, "name", name, MAX_BUF) <= 0) {
+		close(dir_fd);
+		return FALSE;
+	}
+	name[ strcspn(name, "\n") ] = '\0';
+
+	if (debug && log_file != NULL) {
+		fprintf(log_file, "hwmon%d '%s' added\n", hwmon_num, name);
+	}
+
+	if (strcmp(name, "drivetemp") == 0) {
+		add_drive(dir_fd, hwmon_num);
+		return TRUE;
+	}
+
+	if (strcmp(name, "nvme") == 0) {
+		strcpy(nvme_name, "nvme");
+		p = strstr(devpath, "/nvme/nvme");
+		if (p != NULL) {
+			p += 6;
+			for (i = 0; i < SENSOR_NAME_LEN - 1 && p[i] != '/' && p[i] != '\0'; i++) {
+				nvme_name[i] = p[i];
+			}
+			nvme_name[i] = '\0';
+		}
+		if (attach_ssd_chip(dir_fd, hwmon_num, nvme_name)) {
+			return TRUE;
+		}
+	}
+
+	if (hwmon_gpu_temp_path == NULL) {
+		for (i = 0; gpu_names[i] != NULL; i++) {
+			if (strcmp(name, gpu_names[i]) == 0) {
+				attach_gpu_chip(dir_fd, hwmon_num);
+				return TRUE;
+			}
+		}
+	}
+
+	close(dir_fd);
+	return FALSE;
+}
+
+/* Handle a hwmon directory that was removed */
+
+static gboolean
+remove_hwmon_device(const char *devpath)
+{
+	const char *p;
+	int hwmon_num;
+
+	p = strrchr(devpath, '/');
+	if (p == NULL || strncmp(p, "/hwmon", 6) != 0 || !isdigit(p[6])) {
+		return FALSE;
+	}
+	hwmon_num = atoi(&p[6]);
+
+	if (remove_drive(hwmon_num)) {
+		return TRUE;
+	}
+	if (detach_ssd_chip(hwmon_num)) {
+		return TRUE;
+	}
+	if (hwmon_gpu_temp_path != NULL && hwmon_gpu_temp_chip == &gpu_chip && gpu_chip.hwmon_num == hwmon_num) {
+		detach_gpu_chip();
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* Handle kernel uevents */
+/*   Messages are "action@devpath" followed by KEY=value strings, */
+/*   each terminated by a nul. */
+/*   A power supply event with POWER_SUPPLY_ONLINE is an ac adapter */
+/*   being plugged or unplugged, so recheck the power source. */
+/*   hwmon add and remove events update just the affected sensor, */
+/*   and cpu online and offline events rescan the coretemp items. */
+
+static gboolean
+on_uevent (GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	enum uevent_enum { UEVENT_BUF_LEN = 8192 };
+	char buf[ UEVENT_BUF_LEN ];
+	struct sockaddr_nl addr;
+	socklen_t addr_len;
+	ssize_t len;
+	char *p;
+	char *end;
+	const char *subsystem;
+	const char *action;
+	const char *devpath;
+	gboolean power_changed = FALSE;
+	gboolean sensors_changed = FALSE;
+	gboolean has_online;
+	int last_interval;
+	int new_ac_power;
+
+	for (;;) {
+		addr_len = sizeof(addr);
+		len = recvfrom(uevent_fd, buf, UEVENT_BUF_LEN - 1, MSG_DONTWAIT, (struct sockaddr *) &addr, &addr_len);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == ENOBUFS) {
+				/* dropped messages, recheck the power and look for new drives and cores */
+				power_changed = TRUE;
+				rescan_cores = TRUE;
+				scan_drives();
+				sensors_changed = TRUE;
+				continue;
+			}
+			break;
+		}
+		if (len == 0 || addr.nl_pid != 0) {
+			/* ignore messages that did not come from the kernel */
+			continue;
+		}
+		buf[ len ] = '\0';
+		end = buf + len;
+
+		subsystem = NULL;
+		action = "";
+		devpath = "";
+		has_online = FALSE;
+		for (p = buf + strlen(buf) + 1; p < end; p += strlen(p) + 1) {
+			if (strncmp(p, "SUBSYSTEM=", 10) == 0) {
+				subsystem = p + 10;
+			} else if (strncmp(p, "ACTION=", 7) == 0) {
+				action = p + 7;
+			} else if (strncmp(p, "DEVPATH=", 8) == 0) {
+				devpath = p + 8;
+			} else if (strncmp(p, "POWER_SUPPLY_ONLINE=", 20) == 0) {
+				has_online = TRUE;
+			}
+		}
+
+		if (debug > 1 && log_file != NULL) {
+			fprintf(log_file, "uevent %s subsystem %s\n", buf, (subsystem? subsystem: "<none>"));
+		}
+
+		if (subsystem == NULL) {
+			continue;
+		}
+
+		if (strcmp(subsystem, "power_supply") == 0 && has_online) {
+			power_changed = TRUE;
+		} else if (strcmp(subsystem, "hwmon") == 0) {
+			if (strcmp(action, "add") == 0) {
+				sensors_changed |= add_hwmon_device(devpath);
+			} else if (strcmp(action, "remove") == 0) {
+				sensors_changed |= remove_hwmon_device(devpath);
+			}
+		} else if (strcmp(subsystem, "cpu") == 0) {
+			if (strcmp(action, "online") == 0 || strcmp(action, "offline") == 0) {
+				rescan_cores = TRUE;
+				sensors_changed = TRUE;
+			}
+		} else if (strcmp(subsystem, "nvme") == 0) {
+			/* the hwmon directory of a nvme controller has its own events */
+			if (debug && log_file != NULL) {
+				fprintf(log_file, "nvme %s %s\n", action, devpath);
+			}
+		}
+	}
+
+	if (power_changed) {
+		new_ac_power = check_ac_power();
+		if (new_ac_power != on_ac_power) {
+			if (log_file != NULL) {
+				fprintf(log_file, "Switched to %s power at %s.\n", (new_ac_power? "ac": "battery"), show_time());
+			}
+			on_ac_power = new_ac_power;
+			last_interval = interval;
+			select_profile();
+			reset_timer(GTK_WIDGET(data), last_interval);
+			open_window(GTK_EVENT_BOX(data), /* force update */ TRUE);
+			sensors_changed = FALSE;
+		}
+	}
+
+	if (sensors_changed) {
+		open_window(GTK_EVENT_BOX(data), /* force update */ TRUE);
+	}
+
+	return TRUE;
+}
+
+/* Subscribe to kernel uevents */
+/*   The socket is added to the main loop so the applet only wakes for events */
+
+static void
+open_uevent_socket(GtkEventBox *event_box)
+{
+	enum uevent_socket_enum { UEVENT_RCVBUF_LEN = 1024 * 1024 };
+	struct sockaddr_nl addr;
+	GIOChannel *channel;
+	int rcvbuf;
+
+	uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (uevent_fd == -1) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Could not open uevent socket, errno %d.\n", errno);
+		}
+		return;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;	/* kernel events */
+
+	rcvbuf = UEVENT_RCVBUF_LEN;
+	setsockopt(uevent_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if (bind(uevent_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		if (log_file != NULL) {
+			fprintf(log_file, "Could not bind uevent socket, errno %d.\n", errno);
+		}
+		close(uevent_fd);
+		uevent_fd = -1;
+		return;
+	}
+
+	channel = g_io_channel_unix_new(uevent_fd);
+	g_io_add_watch(channel, G_IO_IN, on_uevent, event_box);
+	g_io_channel_unref(channel);
+}
+
 /* Main entry point of the applet */
 /*   Initialize from the environment */
 /*   Set up global variables */
@@ -1117,6 +4830,13 @@ temperature_applet_fill (MatePanelApplet *applet,
 
 	warning_interval = DEFAULT_WARNING_INTERVAL;
 
+	hot_process_count = DEFAULT_HOT_PROCESS_COUNT;
+
+	fan_control.dir_fd = -1;
+
+	cpu_throttle.dir_fd = -1;
+	cpu_throttle.percent = 100;
+
 	home_dir = getenv("HOME");
 	if (home_dir == NULL) {
 		home_dir = "/tmp";
@@ -1147,6 +4867,8 @@ temperature_applet_fill (MatePanelApplet *applet,
 
 	sprintf(setup_name, "%s/.%src", home_dir, BASE_NAME);
 
+	on_ac_power = check_ac_power();
+
 	read_setup_file();
 
 	free(log_name);
@@ -1166,10 +4888,19 @@ temperature_applet_fill (MatePanelApplet *applet,
 
 	timer_handle = g_timeout_add (interval * 1000, on_timer, event_box);
 
+	open_uevent_socket(event_box);
+
+	psi_widget = GTK_WIDGET(event_box);
+	open_psi_triggers();
+
 	return TRUE;
 }
 
 /* Factory to interface with the server */
+/*   temperature_fantest.c and temperature_remotetest.c include this file with */
+/*   TEMPERATURE_FANTEST or TEMPERATURE_REMOTETEST and have their own main */
+
+#if !defined(TEMPERATURE_FANTEST) && !defined(TEMPERATURE_REMOTETEST)
 
 #if 1
 
@@ -1206,3 +4937,11 @@ MATE_PANEL_APPLET_MATECOMPONENT_FACTORY ("OAFIID:Temperature_Factory",
 			     NULL);
 
 #endif
+
+#else
+
+/* the test programs have no factory to call the fill function */
+
+static gboolean temperature_applet_fill (MatePanelApplet *applet, const gchar *iid, gpointer data) G_GNUC_UNUSED;
+
+#endif
@@ -0,0 +1,250 @@
+/* temperature_fantest -- run the fan controller against a fake sysfs tree
+ *
+ * make fantest
+ *
+ * Makes a directory with pwm1, pwm1_enable, and temp1_input files, points
+ * fancontrol and fantemp at it, and checks that
+ *	the controller sets pwm1_enable to manual and moves pwm1 to the curve
+ *	a rising temperature raises the duty without passing the curve
+ *	the fan runs at 100% at the warn temperature
+ *	a failed temperature read restores pwm1_enable and pwm1 and stays off
+ *	exit and SIGTERM restore pwm1_enable and pwm1
+ * Prints one line per check and exits with 1 if any check failed.
+ *
+ * Options
+ *	-v		log the controller steps to stderr
+ *
+ * 19Oct26 wb initial version
+ */
+
+#include <math.h>
+
+#define	TEMPERATURE_FANTEST
+
+#include "temperature.c"
+
+#define	FANTEST_CURVE		"40:20 60:40 80:100"
+#define	FANTEST_SAVED_ENABLE	2
+#define	FANTEST_SAVED_PWM	120
+#define	FANTEST_WARN		90
+
+enum fantest_enum { FANTEST_STEPS = 12, FANTEST_DIR_LEN = 64, FANTEST_PATH_LEN = 256 };
+
+static char fantest_dir[ FANTEST_DIR_LEN ];
+static int fantest_dir_fd = -1;
+static int fantest_failures = 0;
+
+/* Report a check */
+
+static void
+fantest_check(gboolean ok, const char *what)
+{
+	printf("%s %s\n", (ok? "ok  ": "FAIL"), what);
+	if (!ok) {
+		fantest_failures++;
+	}
+}
+
+/* Write a file in the fake hwmon directory */
+
+static void
+fantest_write(const char *name, const char *value)
+{
+	char path[ FANTEST_PATH_LEN ];
+	FILE *f;
+
+	snprintf(path, FANTEST_PATH_LEN, "%s/%s", fantest_dir, name);
+	f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fputs(value, f);
+	fclose(f);
+}
+
+/* Read a number from a file in the fake hwmon directory, -1 if it cannot be read */
+
+static int
+fantest_read(const char *name)
+{
+	char buf[ MAX_BUF ];
+
+	if (read_sys_file(fantest_dir_fd, name, buf, MAX_BUF) <= 0 || !isdigit(buf[0])) {
+		return -1;
+	}
+	return atoi(buf);
+}
+
+/* Set the temperature in degrees C */
+
+static void
+fantest_temp(int temp)
+{
+	char buf[ MAX_BUF ];
+
+	sprintf(buf, "%d\n", temp * 1000);
+	fantest_write("temp1_input", buf);
+}
+
+/* Put back the files of a fan in automatic mode and set up the controller */
+
+static void
+fantest_reset(void)
+{
+	char buf[ MAX_BUF ];
+	char path[ FANTEST_PATH_LEN ];
+
+	sprintf(buf, "%d\n", FANTEST_SAVED_ENABLE);
+	fantest_write("pwm1_enable", buf);
+	sprintf(buf, "%d\n", FANTEST_SAVED_PWM);
+	fantest_write("pwm1", buf);
+	fantest_temp(50);
+
+	free(fan_control.dir_name);
+	free(fan_control.temp_name);
+	snprintf(path, FANTEST_PATH_LEN, "%s/temp1_input", fantest_dir);
+	fan_control.dir_name = strdup(fantest_dir);
+	fan_control.temp_name = strdup(path);
+	fan_control.pwm = 1;
+	fan_control.kp = DEFAULT_FAN_KP;
+	fan_control.ki = DEFAULT_FAN_KI;
+	fan_control.kd = DEFAULT_FAN_KD;
+	fan_control.hysteresis = 3;
+	fan_control.dir_fd = -1;
+	fan_control.failed = FALSE;
+	read_fan_curve("fantest", FANTEST_CURVE);
+}
+
+/* Run one controller step, one interval after the last */
+
+static void
+fantest_step(void)
+{
+	fan_control.last_time = 0;
+	control_fan(0);
+}
+
+/* Check that the fan is back in automatic mode */
+
+static gboolean
+fantest_restored(void)
+{
+	return (fantest_read("pwm1_enable") == FANTEST_SAVED_ENABLE && fantest_read("pwm1") == FANTEST_SAVED_PWM);
+}
+
+/* Step toward the curve at a temperature, checking that the duty */
+/* moves one way and does not pass the curve at curve_temp */
+
+static void
+fantest_follow(int temp, int curve_temp, const char *what)
+{
+	char buf[ MAX_BUF ];
+	double target;
+	double last_gap;
+	double gap;
+	gboolean ok = TRUE;
+	int i;
+
+	fantest_temp(temp);
+	target = fan_curve_duty(curve_temp);
+	last_gap = target - fan_control.duty;
+	for (i = 0; i < FANTEST_STEPS; i++) {
+		fantest_step();
+		gap = target - fan_control.duty;
+		if (gap * last_gap < -0.01 || fabs(gap) > fabs(last_gap) + 0.01) {
+			ok = FALSE;
+		}
+		last_gap = gap;
+	}
+	snprintf(buf, MAX_BUF, "%s, %.1f%% for a curve of %.1f%%", what, fan_control.duty, target);
+	fantest_check(ok && fabs(gap) < 0.5 && fantest_read("pwm1") == fan_control.last_pwm, buf);
+}
+
+/* Check that a child process gives the fan back when it ends */
+
+static void
+fantest_child(gboolean use_signal, const char *what)
+{
+	pid_t pid;
+	int status;
+
+	fantest_reset();
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		fantest_step();
+		if (fantest_read("pwm1_enable") != 1) {
+			_exit(2);
+		}
+		if (use_signal) {
+			kill(getpid(), SIGTERM);
+		}
+		exit(0);
+	}
+	if (pid == -1 || waitpid(pid, &status, 0) != pid) {
+		fantest_check(FALSE, what);
+		return;
+	}
+	fantest_check(((use_signal && WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM) ||
+		(!use_signal && WIFEXITED(status) && WEXITSTATUS(status) == 0)) && fantest_restored(), what);
+}
+
+int
+main(int argc, char **argv)
+{
+	char path[ FANTEST_PATH_LEN ];
+	static const char *names[] = { "pwm1", "pwm1_enable", "temp1_input", NULL };
+	int i;
+
+	if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+		log_file = stderr;
+		debug = 1;
+	}
+
+	strcpy(fantest_dir, "/tmp/temperature_fantest.XXXXXX");
+	if (mkdtemp(fantest_dir) == NULL) {
+		perror(fantest_dir);
+		return 1;
+	}
+	fantest_dir_fd = open(fantest_dir, O_DIRECTORY | __O_PATH);
+
+	interval = DEFAULT_INTERVAL;
+	warning_temperature = FANTEST_WARN;
+
+	/* take over and follow the curve */
+
+	fantest_reset();
+	fantest_step();
+	fantest_check(fantest_read("pwm1_enable") == 1, "pwm1_enable set to manual");
+	fantest_follow(50, 50, "falling to the curve at 50 C");
+	fantest_follow(70, 70, "rising to the curve at 70 C");
+	fantest_follow(68, 70, "hysteresis holds the duty at 68 C");
+	fantest_follow(60, 60, "falling to the curve at 60 C");
+
+	fantest_temp(FANTEST_WARN);
+	fantest_step();
+	fantest_check(fantest_read("pwm1") == 255, "full speed at the warn temperature");
+
+	/* fail safe */
+
+	fantest_write("temp1_input", "");
+	fantest_step();
+	fantest_check(fantest_restored() && fan_control.failed, "failed temperature read restores automatic mode");
+	fantest_temp(50);
+	fantest_step();
+	fantest_check(fantest_restored(), "stays automatic after a failed read");
+
+	fantest_child(FALSE, "exit restores automatic mode");
+	fantest_child(TRUE, "SIGTERM restores automatic mode");
+
+	for (i = 0; names[i] != NULL; i++) {
+		snprintf(path, FANTEST_PATH_LEN, "%s/%s", fantest_dir, names[i]);
+		unlink(path);
+	}
+	close(fantest_dir_fd);
+	rmdir(fantest_dir);
+
+	printf("%s\n", (fantest_failures == 0? "all fan control checks passed": "some fan control checks failed"));
+	return (fantest_failures == 0? 0: 1);
+}
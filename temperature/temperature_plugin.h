@@ -0,0 +1,60 @@
+/* temperature_plugin.h -- sensor plugins for the temperature applet */
+
+/*
+ * A plugin is a shared object in the plugindir directory from $HOME/.temperaturerc.
+ * It exports a struct temperature_plugin named temperature_plugin.
+ *
+ * The applet calls init once after dlopen.  init fills in up to max_sensors
+ * sensor descriptions and returns how many it filled, or -1 to be unloaded.
+ *
+ * The applet then calls sample once per interval with an array of samples,
+ * one for each sensor declared by init, in the same order.  sample sets value
+ * and valid for each sensor and returns 0, or -1 if nothing could be read.
+ * The samples are owned by the applet, so plugins never allocate per sample.
+ * A sensor named like one of the applet's own, such as cpu, core0, fan1, or sda,
+ * is not used in format placeholders.
+ * sample runs in the panel's main loop and should not block.
+ *
+ * fini, if not NULL, is called before dlclose when the setup file
+ * changes the plugin directory.
+ *
+ * Build a plugin with
+ *   cc -shared -fPIC -O2 -o myplugin.so myplugin.c
+ *
+ * Changes to these structs change TEMPERATURE_PLUGIN_ABI_VERSION.
+ */
+
+#ifndef TEMPERATURE_PLUGIN_H
+#define TEMPERATURE_PLUGIN_H
+
+#define TEMPERATURE_PLUGIN_ABI_VERSION 1
+
+#define TEMPERATURE_PLUGIN_SYMBOL "temperature_plugin"
+
+enum temperature_plugin_enum { TEMPERATURE_PLUGIN_NAME_LEN = 16 };
+
+enum temperature_plugin_kind {
+	TEMPERATURE_PLUGIN_TEMP = 0,	/* value in millidegrees C */
+	TEMPERATURE_PLUGIN_FAN = 1	/* value in rpm */
+};
+
+struct temperature_plugin_sensor {
+	char name[ TEMPERATURE_PLUGIN_NAME_LEN ];	/* name in format placeholders, such as ups or inlet */
+	int kind;			/* enum temperature_plugin_kind */
+	int warn;			/* warning level in degrees C, 0 to use the applet's warn */
+};
+
+struct temperature_plugin_sample {
+	int value;			/* millidegrees C or rpm */
+	int valid;			/* nonzero if value was read */
+};
+
+struct temperature_plugin {
+	int abi_version;		/* TEMPERATURE_PLUGIN_ABI_VERSION */
+	const char *name;		/* for the log */
+	int (*init)(struct temperature_plugin_sensor *sensors, int max_sensors);
+	int (*sample)(struct temperature_plugin_sample *samples, int num_samples);
+	void (*fini)(void);
+};
+
+#endif
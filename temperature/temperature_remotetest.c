@@ -0,0 +1,337 @@
+/* temperature_remotetest -- run the remote sources against stand-in servers
+ *
+ * make remotetest
+ *
+ * Listens on a port of 127.0.0.1 and on a unix socket, and checks that
+ *	the lines of a good host are read, split across writes, with comments and bare values
+ *	a unix socket source is read the same way
+ *	a connect to a host that never answers does not block, and times out
+ *	a refused connect is retried after 1, 2, and 4 seconds
+ *	a host that stops sending is dropped after REMOTE_STALE_TIME, and connects again
+ * The times are passed to poll_remotes, so the test does not wait for the timeouts.
+ * Prints one line per check and exits with 1 if any check failed.
+ *
+ * Options
+ *	-v		log the remote steps to stderr
+ *
+ * 19Oct26 wb initial version
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#define	TEMPERATURE_REMOTETEST
+
+#include "temperature.c"
+
+enum remotetest_enum {
+	REMOTETEST_WAIT = 5000,		/* milliseconds to wait for a check */
+	REMOTETEST_BLOCK = 100,		/* milliseconds a poll may take */
+	REMOTETEST_DIR_LEN = 64,
+	REMOTETEST_SOCKET_LEN = 108,	/* size of sun_path */
+	REMOTETEST_LINE_LEN = 256
+};
+
+static char remotetest_dir[ REMOTETEST_DIR_LEN ];
+static char remotetest_socket_name[ REMOTETEST_SOCKET_LEN ];
+static int remotetest_failures = 0;
+
+/* Report a check */
+
+static void
+remotetest_check(gboolean ok, const char *what)
+{
+	printf("%s %s\n", (ok? "ok  ": "FAIL"), what);
+	if (!ok) {
+		remotetest_failures++;
+	}
+}
+
+/* Open a listening TCP socket on 127.0.0.1 and return its port */
+
+static int
+remotetest_listen_tcp(int backlog, int *port)
+{
+	struct sockaddr_in addr;
+	socklen_t addr_len;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr_len = sizeof(addr);
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1 || bind(fd, (struct sockaddr *) &addr, addr_len) != 0 || listen(fd, backlog) != 0 ||
+	    getsockname(fd, (struct sockaddr *) &addr, &addr_len) != 0) {
+		perror("remotetest");
+		exit(1);
+	}
+	*port = ntohs(addr.sin_port);
+	return fd;
+}
+
+/* Write a string to a connection */
+
+static void
+remotetest_write(int fd, const char *text)
+{
+	if (write(fd, text, strlen(text)) != (ssize_t) strlen(text)) {
+		perror("remotetest write");
+	}
+}
+
+/* Wait until the client closes a connection */
+
+static void
+remotetest_wait_close(int fd)
+{
+	char buf[ REMOTETEST_LINE_LEN ];
+
+	while (read(fd, buf, sizeof(buf)) > 0) {
+	}
+	close(fd);
+}
+
+/* Good host: send readings split across writes, then nothing until dropped, */
+/* then one reading on the next connection */
+
+static void *
+remotetest_tcp_server(void *data)
+{
+	int listen_fd = (int) (long) data;
+	int fd;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd == -1) {
+		return NULL;
+	}
+	remotetest_write(fd, "cpu 67\ngpu 5");
+	usleep(100000);
+	remotetest_write(fd, "5\n# a comment\n\n71.9\n");
+	remotetest_wait_close(fd);
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd == -1) {
+		return NULL;
+	}
+	remotetest_write(fd, "cpu 50\n");
+	remotetest_wait_close(fd);
+	return NULL;
+}
+
+/* Unix socket: send one reading */
+
+static void *
+remotetest_unix_server(void *data)
+{
+	int listen_fd = (int) (long) data;
+	int fd;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd == -1) {
+		return NULL;
+	}
+	remotetest_write(fd, "disk 45\n");
+	remotetest_wait_close(fd);
+	return NULL;
+}
+
+/* Run the main loop until a remote is in a state with some sensors and failures */
+/*   Returns FALSE if it was not in REMOTETEST_WAIT milliseconds */
+
+static gboolean
+remotetest_wait(const struct remote_source *rs, enum remote_state_enum state, int num_sensors, int failures)
+{
+	gint64 end;
+
+	end = g_get_monotonic_time() + REMOTETEST_WAIT * 1000LL;
+	while (g_get_monotonic_time() < end) {
+		if (rs->state == state && rs->num_sensors >= num_sensors && rs->failures == failures) {
+			return TRUE;
+		}
+		g_main_context_iteration(NULL, FALSE);
+		usleep(1000);
+	}
+	return FALSE;
+}
+
+/* Poll the remotes at a time, and return how many milliseconds it took */
+
+static long
+remotetest_poll(time_t current_time)
+{
+	gboolean changed;
+	gint64 start;
+
+	start = g_get_monotonic_time();
+	poll_remotes(current_time, &changed);
+	return (long) ((g_get_monotonic_time() - start) / 1000);
+}
+
+/* Poll the refused host when its retry is due, and check the next delay */
+
+static void
+remotetest_retry(struct remote_source *rs, int failures, int delay)
+{
+	char what[ REMOTETEST_LINE_LEN ];
+	time_t before;
+	time_t after;
+	gboolean early;
+	gboolean ok;
+
+	/* nothing happens before the retry time */
+	remotetest_poll(rs->retry_time - 1);
+	early = (rs->state == REMOTE_IDLE && rs->failures == failures - 1);
+
+	before = time(NULL);
+	remotetest_poll(rs->retry_time);
+	ok = remotetest_wait(rs, REMOTE_IDLE, 0, failures);
+	after = time(NULL);
+	snprintf(what, REMOTETEST_LINE_LEN, "refused connect %d retried after %d seconds", failures, delay);
+	remotetest_check(early && ok && rs->retry_time >= before + delay && rs->retry_time <= after + delay, what);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sockaddr_un unix_addr;
+	struct sockaddr_in dead_addr;
+	struct remote_source *good;
+	struct remote_source *local;
+	struct remote_source *refused;
+	struct remote_source *dead;
+	char line[ REMOTETEST_LINE_LEN ];
+	pthread_t tcp_server;
+	pthread_t unix_server;
+	gboolean changed;
+	time_t now;
+	long took;
+	int tcp_fd;
+	int unix_fd;
+	int dead_fd;
+	int filler_fd;
+	int tcp_port;
+	int refused_port;
+	int dead_port;
+	int fd;
+	int i;
+
+	if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+		log_file = stderr;
+		debug = 1;
+	}
+
+	strcpy(remotetest_dir, "/tmp/temperature_remotetest.XXXXXX");
+	if (mkdtemp(remotetest_dir) == NULL) {
+		perror(remotetest_dir);
+		return 1;
+	}
+	snprintf(remotetest_socket_name, REMOTETEST_SOCKET_LEN, "%s/sensors.sock", remotetest_dir);
+
+	/* the stand-in servers */
+
+	tcp_fd = remotetest_listen_tcp(4, &tcp_port);
+	pthread_create(&tcp_server, NULL, remotetest_tcp_server, (void *) (long) tcp_fd);
+
+	memset(&unix_addr, 0, sizeof(unix_addr));
+	unix_addr.sun_family = AF_UNIX;
+	strncpy(unix_addr.sun_path, remotetest_socket_name, sizeof(unix_addr.sun_path) - 1);
+	unix_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (unix_fd == -1 || bind(unix_fd, (struct sockaddr *) &unix_addr, sizeof(unix_addr)) != 0 || listen(unix_fd, 4) != 0) {
+		perror(remotetest_socket_name);
+		return 1;
+	}
+	pthread_create(&unix_server, NULL, remotetest_unix_server, (void *) (long) unix_fd);
+
+	/* a port that refuses */
+	fd = remotetest_listen_tcp(1, &refused_port);
+	close(fd);
+
+	/* a host that never answers: a listener that never accepts, with a full queue */
+	dead_fd = remotetest_listen_tcp(0, &dead_port);
+	memset(&dead_addr, 0, sizeof(dead_addr));
+	dead_addr.sin_family = AF_INET;
+	dead_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	dead_addr.sin_port = htons(dead_port);
+	for (i = 0; i < 2; i++) {
+		filler_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (connect(filler_fd, (struct sockaddr *) &dead_addr, sizeof(dead_addr)) != 0 && errno != EINPROGRESS) {
+			perror("remotetest filler");
+		}
+	}
+	usleep(100000);
+
+	snprintf(line, REMOTETEST_LINE_LEN, "rack 127.0.0.1:%d", tcp_port);
+	read_remote("remotetest", line);
+	snprintf(line, REMOTETEST_LINE_LEN, "sock %s", remotetest_socket_name);
+	read_remote("remotetest", line);
+	snprintf(line, REMOTETEST_LINE_LEN, "refused 127.0.0.1:%d", refused_port);
+	read_remote("remotetest", line);
+	snprintf(line, REMOTETEST_LINE_LEN, "dead 127.0.0.1:%d", dead_port);
+	read_remote("remotetest", line);
+	remotetest_check(num_remotes == 4, "four remote lines read");
+	good = &remotes[0];
+	local = &remotes[1];
+	refused = &remotes[2];
+	dead = &remotes[3];
+
+	/* connect */
+
+	now = time(NULL);
+	took = remotetest_poll(now);
+	remotetest_check(took < REMOTETEST_BLOCK, "starting the connects does not block");
+	remotetest_check(remotetest_wait(good, REMOTE_CONNECTED, 3, 0) &&
+		strcmp(good->sensors[0].name, "cpu") == 0 && good->sensors[0].value == 67 &&
+		strcmp(good->sensors[1].name, "gpu") == 0 && good->sensors[1].value == 55 &&
+		strcmp(good->sensors[2].name, "temp") == 0 && good->sensors[2].value == 71,
+		"good host lines read across writes, with a comment and a bare value");
+	remotetest_check(remotetest_wait(local, REMOTE_CONNECTED, 1, 0) &&
+		strcmp(local->sensors[0].name, "disk") == 0 && local->sensors[0].value == 45,
+		"unix socket line read");
+	remotetest_check(poll_remotes(now, &changed) == 71 && strstr(remote_tooltip_text, "rack cpu 67 gpu 55 temp 71") != NULL &&
+		strstr(remote_tooltip_text, "sock disk 45") != NULL, "hottest reading and tooltip text");
+
+	/* refused, retried with a delay that doubles */
+
+	remotetest_check(remotetest_wait(refused, REMOTE_IDLE, 0, 1) &&
+		refused->retry_time >= now + 1 && refused->retry_time <= time(NULL) + 1, "refused connect retried after 1 second");
+	remotetest_retry(refused, 2, 2);
+	remotetest_retry(refused, 3, 4);
+
+	/* a host that never answers */
+
+	took = 0;
+	for (i = 0; i < 10; i++) {
+		took += remotetest_poll(time(NULL));
+		g_main_context_iteration(NULL, FALSE);
+	}
+	remotetest_check(dead->state == REMOTE_CONNECTING && took < REMOTETEST_BLOCK, "host that never answers does not block");
+	remotetest_poll(dead->state_time + REMOTE_CONNECT_TIME + 1);
+	remotetest_check(dead->state == REMOTE_IDLE && dead->failures == 1, "host that never answers times out");
+
+	/* stale */
+
+	remotetest_check(good->state == REMOTE_CONNECTED, "good host still connected");
+	remotetest_poll(good->state_time + REMOTE_STALE_TIME);
+	remotetest_check(good->state == REMOTE_CONNECTED, "good host kept before the stale time");
+	remotetest_poll(good->state_time + REMOTE_STALE_TIME + 1);
+	remotetest_check(good->state == REMOTE_IDLE && good->failures == 1 && good->num_sensors == 0,
+		"good host dropped after it sent nothing for the stale time");
+	remotetest_poll(good->retry_time);
+	remotetest_check(remotetest_wait(good, REMOTE_CONNECTED, 1, 0) && good->sensors[0].value == 50,
+		"good host connects again and reads");
+
+	clear_remotes();
+	close(dead_fd);
+	close(unix_fd);
+	close(tcp_fd);
+	unlink(remotetest_socket_name);
+	rmdir(remotetest_dir);
+
+	printf("%s\n", (remotetest_failures == 0? "all remote checks passed": "some remote checks failed"));
+	return (remotetest_failures == 0? 0: 1);
+}